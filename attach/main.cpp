@@ -0,0 +1,348 @@
+#include <parser/Args.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <elf.h>
+#include <fstream>
+#include <signal.h>
+#include <string>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+// Loads the attach build of the preload into a running process. The
+// process' main thread is stopped with ptrace and made to call dlopen,
+// dlsym and then mtrack_attach as if it had called them itself, after
+// which its registers are put back and it's let go. If the thread happened
+// to be stopped holding a lock dlopen or malloc needs this deadlocks, same
+// as it would for a debugger doing the same thing.
+
+namespace {
+
+#if defined(__x86_64__)
+typedef user_regs_struct Registers;
+#elif defined(__aarch64__)
+typedef user_pt_regs Registers;
+#else
+#error "Unsupported architecture"
+#endif
+
+bool getRegisters(pid_t pid, Registers* regs)
+{
+    iovec iov = { regs, sizeof(*regs) };
+    return ptrace(PTRACE_GETREGSET, pid, NT_PRSTATUS, &iov) == 0;
+}
+
+bool setRegisters(pid_t pid, const Registers* regs)
+{
+    iovec iov = { const_cast<Registers*>(regs), sizeof(*regs) };
+    return ptrace(PTRACE_SETREGSET, pid, NT_PRSTATUS, &iov) == 0;
+}
+
+bool writeMemory(pid_t pid, uintptr_t addr, const void* data, size_t size)
+{
+    // word at a time, the last one is read first so that whatever follows
+    // the data is left alone
+    const auto bytes = static_cast<const uint8_t*>(data);
+    for (size_t offset = 0; offset < size; offset += sizeof(long)) {
+        long word = 0;
+        const size_t chunk = std::min(sizeof(long), size - offset);
+        if (chunk < sizeof(long)) {
+            errno = 0;
+            word = ptrace(PTRACE_PEEKDATA, pid, addr + offset, nullptr);
+            if (errno != 0)
+                return false;
+        }
+        memcpy(&word, bytes + offset, chunk);
+        if (ptrace(PTRACE_POKEDATA, pid, addr + offset, word) == -1)
+            return false;
+    }
+    return true;
+}
+
+// Finds where the mapping of path with offset 0 starts in pid
+uintptr_t moduleBase(pid_t pid, const std::string& path)
+{
+    std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+    std::string line;
+    while (std::getline(maps, line)) {
+        uintptr_t start, end, offset;
+        char perms[8];
+        int pathOffset = 0;
+        if (sscanf(line.c_str(), "%lx-%lx %7s %lx %*s %*s %n", &start, &end, perms, &offset, &pathOffset) < 4 || pathOffset == 0)
+            continue;
+        if (offset == 0 && line.compare(pathOffset, std::string::npos, path) == 0)
+            return start;
+    }
+    return 0;
+}
+
+bool hasModule(pid_t pid, const char* name)
+{
+    std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+    std::string line;
+    while (std::getline(maps, line)) {
+        if (line.find(name) != std::string::npos)
+            return true;
+    }
+    return false;
+}
+
+// The address of one of our own functions in pid, assuming it has the same
+// library mapped
+uintptr_t remoteSymbol(pid_t pid, const char* name)
+{
+    void* local = dlsym(RTLD_DEFAULT, name);
+    Dl_info info;
+    if (local == nullptr || !dladdr(local, &info) || info.dli_fname == nullptr)
+        return 0;
+    char path[PATH_MAX];
+    if (realpath(info.dli_fname, path) == nullptr)
+        return 0;
+    const uintptr_t remote = moduleBase(pid, path);
+    if (remote == 0)
+        return 0;
+    return remote + (reinterpret_cast<uintptr_t>(local) - reinterpret_cast<uintptr_t>(info.dli_fbase));
+}
+
+class Tracee
+{
+public:
+    Tracee(pid_t pid)
+        : mPid(pid)
+    {
+    }
+    ~Tracee()
+    {
+        detach();
+    }
+
+    bool attach();
+    void detach();
+
+    // Writes size bytes of data below the stack of the stopped thread and
+    // returns where, everything written has to be in place before call
+    uintptr_t push(const void* data, size_t size);
+
+    // Calls func(args) on the stopped thread, the return address is 0 so
+    // the thread faults when the function returns
+    bool call(uintptr_t func, uintptr_t arg0, uintptr_t arg1, uintptr_t* result);
+
+private:
+    pid_t mPid {};
+    bool mAttached {};
+    Registers mSaved {};
+    uintptr_t mStackTop {};
+};
+
+bool Tracee::attach()
+{
+    if (ptrace(PTRACE_ATTACH, mPid, nullptr, nullptr) == -1) {
+        fprintf(stderr, "can't attach to %d: %m\n", mPid);
+        return false;
+    }
+    mAttached = true;
+    int status;
+    if (waitpid(mPid, &status, __WALL) == -1 || !WIFSTOPPED(status)) {
+        fprintf(stderr, "%d didn't stop\n", mPid);
+        return false;
+    }
+    if (!getRegisters(mPid, &mSaved)) {
+        fprintf(stderr, "can't read the registers of %d: %m\n", mPid);
+        return false;
+    }
+    // leave the red zone alone
+#if defined(__x86_64__)
+    mStackTop = (mSaved.rsp - 128) & ~static_cast<uintptr_t>(15);
+#elif defined(__aarch64__)
+    mStackTop = mSaved.sp & ~static_cast<uintptr_t>(15);
+#endif
+    return true;
+}
+
+void Tracee::detach()
+{
+    if (!mAttached)
+        return;
+    mAttached = false;
+    setRegisters(mPid, &mSaved);
+    ptrace(PTRACE_DETACH, mPid, nullptr, nullptr);
+}
+
+uintptr_t Tracee::push(const void* data, size_t size)
+{
+    mStackTop = (mStackTop - size) & ~static_cast<uintptr_t>(15);
+    if (!writeMemory(mPid, mStackTop, data, size))
+        return 0;
+    return mStackTop;
+}
+
+bool Tracee::call(uintptr_t func, uintptr_t arg0, uintptr_t arg1, uintptr_t* result)
+{
+    Registers regs = mSaved;
+    uintptr_t sp = (mStackTop - 256) & ~static_cast<uintptr_t>(15);
+#if defined(__x86_64__)
+    const uintptr_t returnAddress = 0;
+    sp -= sizeof(returnAddress);
+    if (!writeMemory(mPid, sp, &returnAddress, sizeof(returnAddress)))
+        return false;
+    regs.rsp = sp;
+    regs.rip = func;
+    regs.rdi = arg0;
+    regs.rsi = arg1;
+    regs.rax = 0;
+    // the thread might have been stopped in a syscall, it mustn't be
+    // restarted at the new rip
+    regs.orig_rax = -1;
+#elif defined(__aarch64__)
+    regs.sp = sp;
+    regs.pc = func;
+    regs.regs[0] = arg0;
+    regs.regs[1] = arg1;
+    regs.regs[30] = 0;
+#endif
+    if (!setRegisters(mPid, &regs))
+        return false;
+
+    int sig = 0;
+    for (;;) {
+        if (ptrace(PTRACE_CONT, mPid, nullptr, sig) == -1)
+            return false;
+        int status;
+        if (waitpid(mPid, &status, __WALL) == -1 || !WIFSTOPPED(status)) {
+            fprintf(stderr, "%d went away\n", mPid);
+            mAttached = false;
+            return false;
+        }
+        sig = WSTOPSIG(status);
+        if (sig == SIGSEGV)
+            break;
+        // whatever else came in is delivered, the stop from attaching isn't
+        if (sig == SIGSTOP)
+            sig = 0;
+    }
+
+    if (!getRegisters(mPid, &regs))
+        return false;
+#if defined(__x86_64__)
+    if (regs.rip != 0) {
+        fprintf(stderr, "%d crashed at 0x%llx\n", mPid, regs.rip);
+        return false;
+    }
+    *result = regs.rax;
+#elif defined(__aarch64__)
+    if (regs.pc != 0) {
+        fprintf(stderr, "%d crashed at 0x%llx\n", mPid, regs.pc);
+        return false;
+    }
+    *result = regs.regs[0];
+#endif
+    return true;
+}
+
+std::string defaultLibrary()
+{
+    // bin/mtrack_attach and lib/libmtrack_attach_preload.so
+    char buf[PATH_MAX];
+    const ssize_t l = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+    if (l <= 0)
+        return {};
+    std::string self(buf, l);
+    auto slash = self.find_last_of('/');
+    if (slash == std::string::npos)
+        return {};
+    slash = self.find_last_of('/', slash - 1);
+    if (slash == std::string::npos)
+        return {};
+    return self.substr(0, slash + 1) + "lib/libmtrack_attach_preload.so";
+}
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    auto args = args::Parser::parse(argc, argv, [](const char* msg, int offset, char* word) {
+        fprintf(stderr, "%s at offset %d word %s\n", msg, offset - 1, word);
+    });
+
+    if (!args.has<pid_t>("pid")) {
+        fprintf(stderr, "usage: %s --pid <pid> [--library <libmtrack_attach_preload.so>]\n"
+                "MTRACK_ variables in the environment are passed on to the preload\n", argv[0]);
+        return 1;
+    }
+    const pid_t pid = args.value<pid_t>("pid");
+
+    std::string library = args.has<std::string>("library") ? args.value<std::string>("library") : defaultLibrary();
+    char path[PATH_MAX];
+    if (library.empty() || realpath(library.c_str(), path) == nullptr) {
+        fprintf(stderr, "no preload library '%s'\n", library.c_str());
+        return 1;
+    }
+    library = path;
+
+    if (hasModule(pid, "libmtrack")) {
+        fprintf(stderr, "%d is already tracked\n", pid);
+        return 1;
+    }
+
+    // dlopen and dlsym moved into libc in glibc 2.34, before that libc only
+    // has the private variants for when libdl isn't loaded
+    uintptr_t remoteDlopen = remoteSymbol(pid, "dlopen");
+    uintptr_t remoteDlsym = remoteSymbol(pid, "dlsym");
+    if (remoteDlopen == 0 || remoteDlsym == 0) {
+        remoteDlopen = remoteSymbol(pid, "__libc_dlopen_mode");
+        remoteDlsym = remoteSymbol(pid, "__libc_dlsym");
+    }
+    if (remoteDlopen == 0 || remoteDlsym == 0) {
+        fprintf(stderr, "can't find dlopen in %d, it has to use the same libc as this\n", pid);
+        return 1;
+    }
+
+    std::string settings;
+    for (char** env = environ; *env != nullptr; ++env) {
+        if (!strncmp(*env, "MTRACK_", 7)) {
+            settings += *env;
+            settings += '\n';
+        }
+    }
+
+    Tracee tracee(pid);
+    if (!tracee.attach())
+        return 1;
+
+    const char entry[] = "mtrack_attach";
+    const uintptr_t libraryAddr = tracee.push(library.c_str(), library.size() + 1);
+    const uintptr_t entryAddr = tracee.push(entry, sizeof(entry));
+    const uintptr_t settingsAddr = tracee.push(settings.c_str(), settings.size() + 1);
+    if (libraryAddr == 0 || entryAddr == 0 || settingsAddr == 0) {
+        fprintf(stderr, "can't write to %d: %m\n", pid);
+        return 1;
+    }
+
+    uintptr_t handle = 0, func = 0, attached = 0;
+    if (!tracee.call(remoteDlopen, libraryAddr, RTLD_NOW, &handle) || handle == 0) {
+        fprintf(stderr, "%d couldn't load %s\n", pid, library.c_str());
+        return 1;
+    }
+    if (!tracee.call(remoteDlsym, handle, entryAddr, &func) || func == 0) {
+        fprintf(stderr, "%s has no %s\n", library.c_str(), entry);
+        return 1;
+    }
+    if (!tracee.call(func, settingsAddr, 0, &attached) || attached == 0) {
+        fprintf(stderr, "%d was already attached\n", pid);
+        return 1;
+    }
+    tracee.detach();
+
+    printf("attached to %d\n", pid);
+    return 0;
+}
@@ -55,6 +55,18 @@ public:
         const uint32_t siz { 0 };
     };
 
+    // LEB128 encoded unsigned integer, written without a size prefix
+    struct VarInt
+    {
+        VarInt(uint64_t value);
+
+        const void* data() const { return buf; }
+        uint32_t size() const { return len; }
+
+        uint8_t buf[10] {};
+        uint32_t len { 0 };
+    };
+
     virtual void writeBytes(const void* data, size_t size, WriteType type) = 0;
 
 private:
@@ -82,6 +94,9 @@ private:
 template<typename T, std::enable_if_t<!std::is_arithmetic_v<std::decay_t<T>> && !std::is_enum_v<std::decay_t<T>>> *>
 inline size_t Emitter::emitSize_helper(T&& str)
 {
+    if constexpr (std::is_same_v<std::decay_t<T>, VarInt>) {
+        return str.size();
+    }
     return str.size() + sizeof(uint32_t);
 }
 
@@ -112,6 +127,10 @@ inline size_t Emitter::emitSize(T&& arg, Ts&&... args)
 template<typename T, std::enable_if_t<!std::is_arithmetic_v<std::decay_t<T>> && !std::is_enum_v<std::decay_t<T>>> *>
 inline size_t Emitter::emit_helper(T&& str, WriteType type)
 {
+    if constexpr (std::is_same_v<std::decay_t<T>, VarInt>) {
+        writeBytes(str.data(), str.size(), type);
+        return str.size();
+    }
     if (str.size() == 0) {
         return emit_helper(static_cast<decltype(str.size())>(0), type);
     }
@@ -178,3 +197,12 @@ inline Emitter::Data::Data(const void* d, uint32_t sz)
     : dta(d), siz(sz)
 {
 }
+
+inline Emitter::VarInt::VarInt(uint64_t value)
+{
+    while (value >= 0x80) {
+        buf[len++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    buf[len++] = static_cast<uint8_t>(value);
+}
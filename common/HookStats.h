@@ -0,0 +1,115 @@
+#pragma once
+
+#include "RecordType.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <sched.h>
+#include <sys/types.h>
+
+// What the preload costs the application it's loaded into, turned on with
+// MTRACK_STATS=<interval ms>. The counters live in a file in /dev/shm (see
+// path()) so another process can map it and watch them while the
+// application runs, and the preload sends their totals as HookStats records
+// every interval. Hooks add to the slot of the cpu they run on so threads
+// rarely share a cache line, readers sum up the slots. Times are in
+// nanoseconds.
+struct HookStats
+{
+    enum Counter : uint32_t {
+        Packets,
+        Bytes,
+        WriteNs,
+        Unwinds,
+        UnwindNs,
+        LockWaits,
+        LockWaitNs,
+        PageFaults,
+        PageFaultNs,
+        ModuleScans,
+        // packets written per RecordType from here on
+        Events,
+        Count = Events + static_cast<uint32_t>(RecordType::Max) + 1
+    };
+
+    enum : uint32_t {
+        Magic = 0x5453544d, // "MTST"
+        Version = 1,
+        Slots = 64
+    };
+
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> counters[Count];
+    };
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t counters;
+    uint32_t pid;
+    Slot slot[Slots];
+
+    void init(pid_t p)
+    {
+        magic = Magic;
+        version = Version;
+        slots = Slots;
+        counters = Count;
+        pid = static_cast<uint32_t>(p);
+    }
+
+    void add(uint32_t counter, uint64_t value)
+    {
+        // -1 if the cpu can't be had, which is as good a slot as any
+        const auto cpu = static_cast<unsigned>(sched_getcpu());
+        slot[cpu % Slots].counters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // adds the time since start, which came from now()
+    void addTime(uint32_t counter, uint64_t start)
+    {
+        add(counter, now() - start);
+    }
+
+    uint64_t total(uint32_t counter) const
+    {
+        uint64_t sum = 0;
+        for (const auto& s : slot) {
+            sum += s.counters[counter].load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    static uint64_t now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (static_cast<uint64_t>(ts.tv_sec) * 1000000000ull) + static_cast<uint64_t>(ts.tv_nsec);
+    }
+
+    static void path(char* buf, size_t size, pid_t pid)
+    {
+        snprintf(buf, size, "/dev/shm/mtrack-stats.%d", static_cast<int>(pid));
+    }
+
+    static const char* counterName(uint32_t counter)
+    {
+        switch (counter) {
+        case Packets: return "packets";
+        case Bytes: return "bytes";
+        case WriteNs: return "write ns";
+        case Unwinds: return "unwinds";
+        case UnwindNs: return "unwind ns";
+        case LockWaits: return "lock waits";
+        case LockWaitNs: return "lock wait ns";
+        case PageFaults: return "page faults";
+        case PageFaultNs: return "page fault ns";
+        case ModuleScans: return "module scans";
+        }
+        if (counter >= Events && counter < Count)
+            return recordTypeToString(static_cast<RecordType>(counter - Events));
+        return "";
+    }
+};
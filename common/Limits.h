@@ -1,5 +1,10 @@
 #pragma once
 
+#include <cstdint>
+
 namespace Limits {
 constexpr uint64_t PageSize = 4096;
+// ends a stack that was cut off at its depth limit in place of the frames
+// towards the root, never a valid return address
+constexpr uint64_t TruncatedFrame = 1;
 }
@@ -2,11 +2,14 @@
 
 #include <cstdint>
 #include <tuple>
-#include <vector>
+#include <map>
 #include <algorithm>
 #include <sys/mman.h>
-#include <algorithm>
 
+// Mappings are kept in a balanced tree keyed on their start address. They
+// never overlap so that's enough to find the one containing an address, and
+// splitting or removing a mapping is O(log n) instead of moving the tail of
+// a vector around, which matters for processes with 100k+ mappings.
 class MmapTracker
 {
 public:
@@ -18,7 +21,7 @@ public:
         int32_t flags {};
         int32_t stack {};
     };
-    using Mmaps = std::vector<Mmap>;
+    using Mmaps = std::map<uintptr_t, Mmap>;
 
     MmapTracker() = default;
 
@@ -33,14 +36,24 @@ public:
     void mremap(void* oldAddr, void* newAddr, size_t oldSize, size_t newSize, int32_t stack);
     void mremap(uintptr_t oldAddr, uintptr_t newAddr, size_t oldSize, size_t newSize, int32_t stack);
 
+    // flags of the first mapping in the range, what mprotect returns
+    // without modifying anything
+    int32_t flags(void* addr, size_t size) const;
+    int32_t flags(uintptr_t addr, size_t size) const;
+
+    // the mapping containing addr, nullptr if there is none
+    const Mmap* lookup(uintptr_t addr) const;
+
     template<typename Func>
     void forEach(Func&& func) const;
 
     const Mmaps& data() const;
     size_t size() const;
+    void clear();
 
 private:
     bool intersects(Mmaps::const_iterator it, uintptr_t start, uintptr_t end);
+    Mmaps::iterator insert(Mmaps::iterator after, const Mmap& mmap);
 
 private:
     std::pair<Mmaps::iterator, Mmaps::iterator> find(uintptr_t addr);
@@ -52,31 +65,33 @@ private:
 
 inline bool MmapTracker::intersects(Mmaps::const_iterator it, uintptr_t start, uintptr_t end)
 {
-    return it != mMmaps.end() && start < it->end && it->start < end;
+    return it != mMmaps.end() && start < it->second.end && it->second.start < end;
+}
+
+// inserts a mapping that goes right after 'after'
+inline MmapTracker::Mmaps::iterator MmapTracker::insert(Mmaps::iterator after, const Mmap& mmap)
+{
+    return mMmaps.emplace_hint(std::next(after), mmap.start, mmap);
 }
 
 inline std::pair<MmapTracker::Mmaps::iterator, MmapTracker::Mmaps::iterator> MmapTracker::find(uintptr_t addr)
 {
-    auto foundit = std::upper_bound(mMmaps.begin(), mMmaps.end(), addr, [](auto address, const auto& item) {
-        return address < item.start;
-    });
+    auto foundit = mMmaps.upper_bound(addr);
     auto it = foundit;
     if (it != mMmaps.begin())
         --it;
-    while (it != mMmaps.end() && it->end <= addr)
+    while (it != mMmaps.end() && it->second.end <= addr)
         ++it;
     return std::make_pair(it, foundit);
 }
 
 inline std::pair<MmapTracker::Mmaps::const_iterator, MmapTracker::Mmaps::const_iterator> MmapTracker::find(uintptr_t addr) const
 {
-    auto foundit = std::upper_bound(mMmaps.begin(), mMmaps.end(), addr, [](auto address, const auto& item) {
-        return address < item.start;
-    });
+    auto foundit = mMmaps.upper_bound(addr);
     auto it = foundit;
     if (it != mMmaps.begin())
         --it;
-    while (it != mMmaps.end() && it->end <= addr)
+    while (it != mMmaps.end() && it->second.end <= addr)
         ++it;
     return std::make_pair(it, foundit);
 }
@@ -88,37 +103,38 @@ inline void MmapTracker::mmap(uintptr_t iaddr, size_t size, int32_t prot, int32_
     if (intersects(it, iaddr, iaddrend)) {
         // got a hit
         do {
-            if (it->prot != prot || it->flags != flags || it->stack != stack) {
-                const auto curstart = it->start;
-                const auto curend = it->end;
-                const auto curprot = it->prot;
-                const auto curflags = it->flags;
-                const auto curstack = it->stack;
+            auto& cur = it->second;
+            if (cur.prot != prot || cur.flags != flags || cur.stack != stack) {
+                const auto curstart = cur.start;
+                const auto curend = cur.end;
+                const auto curprot = cur.prot;
+                const auto curflags = cur.flags;
+                const auto curstack = cur.stack;
 
                 if (curstart < iaddr) {
                     // item addr is prior to input addr, update end and add new item
-                    it->end = iaddr;
-                    it = mMmaps.insert(it + 1, { iaddr, std::min(curend, iaddrend), prot, flags, stack });
+                    cur.end = iaddr;
+                    it = insert(it, { iaddr, std::min(curend, iaddrend), prot, flags, stack });
 
                     // if we're fully contained in the item, we need to add one more at the end
                     if (iaddrend < curend) {
-                        it = mMmaps.insert(it + 1, { iaddrend, curend, curprot, curflags, curstack });
+                        it = insert(it, { iaddrend, curend, curprot, curflags, curstack });
                     }
                     ++it;
                 } else if (iaddr <= curstart && iaddrend >= curend) {
                     // item is fully contained in input addr, just update prot and flags
-                    it->prot = prot;
-                    it->flags = flags;
-                    it->stack = stack;
+                    cur.prot = prot;
+                    cur.flags = flags;
+                    cur.stack = stack;
                     ++it;
                 } else if (iaddrend < curend) {
                     // item end is past input end, update and add new item
-                    it->end = iaddrend;
-                    it->prot = prot;
-                    it->flags = flags;
-                    it->stack = stack;
+                    cur.end = iaddrend;
+                    cur.prot = prot;
+                    cur.flags = flags;
+                    cur.stack = stack;
 
-                    it = mMmaps.insert(it + 1, { iaddrend, curend, curprot, curflags, curstack });
+                    insert(it, { iaddrend, curend, curprot, curflags, curstack });
                     return;
                 }
             } else {
@@ -126,7 +142,7 @@ inline void MmapTracker::mmap(uintptr_t iaddr, size_t size, int32_t prot, int32_
             }
         } while (intersects(it, iaddr, iaddrend));
     } else {
-        mMmaps.insert(insertit, { iaddr, iaddrend, prot, flags, stack });
+        mMmaps.emplace_hint(insertit, iaddr, Mmap { iaddr, iaddrend, prot, flags, stack });
     }
 }
 
@@ -141,20 +157,21 @@ inline uint64_t MmapTracker::munmap(uintptr_t iaddr, size_t size)
     const auto iaddrend = iaddr + size;
     auto [ it, insertit ] = find(iaddr);
     while (intersects(it, iaddr, iaddrend)) {
-        const auto curstart = it->start;
-        const auto curend = it->end;
-        const auto curprot = it->prot;
-        const auto curflags = it->flags;
-        const auto curstack = it->stack;
+        auto& cur = it->second;
+        const auto curstart = cur.start;
+        const auto curend = cur.end;
+        const auto curprot = cur.prot;
+        const auto curflags = cur.flags;
+        const auto curstack = cur.stack;
 
         if (curstart < iaddr) {
             // item addr is prior to input addr, update end
             num += std::min(curend, iaddrend) - iaddr;
-            it->end = iaddr;
+            cur.end = iaddr;
 
             // if we're fully contained in the item, we need to add one more at the end
             if (iaddrend < curend) {
-                it = mMmaps.insert(it + 1, { iaddrend, curend, curprot, curflags, curstack });
+                it = insert(it, { iaddrend, curend, curprot, curflags, curstack });
             }
             ++it;
         } else if (iaddr <= curstart && iaddrend >= curend) {
@@ -162,9 +179,14 @@ inline uint64_t MmapTracker::munmap(uintptr_t iaddr, size_t size)
             num += curend - curstart;
             it = mMmaps.erase(it);
         } else if (iaddrend < curend) {
-            // item end is past input end, update
+            // item end is past input end, update. The key changes but the
+            // order doesn't, reinsert the node where it was
             num += iaddrend - curstart;
-            it->start = iaddrend;
+            const auto next = std::next(it);
+            auto node = mMmaps.extract(it);
+            node.key() = iaddrend;
+            node.mapped().start = iaddrend;
+            mMmaps.insert(next, std::move(node));
             return num;
         }
     }
@@ -182,36 +204,37 @@ inline int32_t MmapTracker::mprotect(uintptr_t iaddr, size_t size, int32_t prot)
     const auto iaddrend = iaddr + size;
     auto [ it, insertit ] = find(iaddr);
     while (intersects(it, iaddr, iaddrend)) {
+        auto& cur = it->second;
         if (flags == 0) {
-            flags = it->flags;
+            flags = cur.flags;
         }
-        if (it->prot != prot) {
-            const auto curstart = it->start;
-            const auto curend = it->end;
-            const auto curprot = it->prot;
-            const auto curflags = it->flags;
-            const auto curstack = it->stack;
+        if (cur.prot != prot) {
+            const auto curstart = cur.start;
+            const auto curend = cur.end;
+            const auto curprot = cur.prot;
+            const auto curflags = cur.flags;
+            const auto curstack = cur.stack;
 
             if (curstart < iaddr) {
                 // item addr is prior to input addr, update end and add new item
-                it->end = iaddr;
-                it = mMmaps.insert(it + 1, { iaddr, std::min(curend, iaddrend), prot, curflags, curstack });
+                cur.end = iaddr;
+                it = insert(it, { iaddr, std::min(curend, iaddrend), prot, curflags, curstack });
 
                 // if we're fully contained in the item, we need to add one more at the end
                 if (iaddrend < curend) {
-                    it = mMmaps.insert(it + 1, { iaddrend, curend, curprot, curflags, curstack });
+                    it = insert(it, { iaddrend, curend, curprot, curflags, curstack });
                 }
                 ++it;
             } else if (iaddr <= curstart && iaddrend >= curend) {
                 // item is fully contained in input addr, just update prot and flags
-                it->prot = prot;
+                cur.prot = prot;
                 ++it;
             } else if (iaddrend < curend) {
                 // item end is past input end, update and add new item
-                it->end = iaddrend;
-                it->prot = prot;
+                cur.end = iaddrend;
+                cur.prot = prot;
 
-                it = mMmaps.insert(it + 1, { iaddrend, curend, curprot, curflags, curstack });
+                insert(it, { iaddrend, curend, curprot, curflags, curstack });
                 return flags;
             }
         } else {
@@ -232,8 +255,8 @@ inline uint64_t MmapTracker::madvise(uintptr_t iaddr, size_t size)
     const auto iaddrend = iaddr + size;
     auto [ it, insertit ] = find(iaddr);
     while (intersects(it, iaddr, iaddrend)) {
-        const auto curstart = it->start;
-        const auto curend = it->end;
+        const auto curstart = it->second.start;
+        const auto curend = it->second.end;
 
         if (curstart < iaddr) {
             num += std::min(curend, iaddrend) - iaddr;
@@ -259,8 +282,8 @@ inline void MmapTracker::mremap(uintptr_t oldAddr, uintptr_t newAddr, size_t old
     if (it == mMmaps.end())
         return;
 
-    const auto curprot = it->prot;
-    const auto curflags = it->flags;
+    const auto curprot = it->second.prot;
+    const auto curflags = it->second.flags;
 
     munmap(oldAddr, oldSize);
     mmap(newAddr, newSize, curprot, curflags, stack);
@@ -271,10 +294,31 @@ inline void MmapTracker::mremap(void* oldAddr, void* newAddr, size_t oldSize, si
     mremap(reinterpret_cast<uintptr_t>(oldAddr), reinterpret_cast<uintptr_t>(newAddr), oldSize, newSize, stack);
 }
 
+inline int32_t MmapTracker::flags(uintptr_t iaddr, size_t size) const
+{
+    auto [ it, insertit ] = find(iaddr);
+    if (it != mMmaps.end() && iaddr < it->second.end && it->second.start < iaddr + size)
+        return it->second.flags;
+    return 0;
+}
+
+inline int32_t MmapTracker::flags(void* addr, size_t size) const
+{
+    return flags(reinterpret_cast<uintptr_t>(addr), size);
+}
+
+inline const MmapTracker::Mmap* MmapTracker::lookup(uintptr_t addr) const
+{
+    auto [ it, insertit ] = find(addr);
+    if (it != mMmaps.end() && it->second.start <= addr && addr < it->second.end)
+        return &it->second;
+    return nullptr;
+}
+
 template<typename Func>
 inline void MmapTracker::forEach(Func&& func) const
 {
-    for (const auto& t : mMmaps) {
+    for (const auto& [ start, t ] : mMmaps) {
         func(t.start, t.end, t.prot, t.flags, t.stack);
     }
 }
@@ -284,6 +328,11 @@ inline const MmapTracker::Mmaps& MmapTracker::data() const
     return mMmaps;
 }
 
+inline void MmapTracker::clear()
+{
+    mMmaps.clear();
+}
+
 inline size_t MmapTracker::size() const
 {
     return mMmaps.size();
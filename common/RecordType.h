@@ -5,6 +5,16 @@ enum class ApplicationType : uint8_t {
     WASM
 };
 
+// Milliseconds sends Malloc/PageFault times as uint32. Nanoseconds sends
+// them as a varint where the low bit is set if the rest is the time since
+// the start, otherwise it's the time since the previous timestamp from the
+// same writer. Malloc and Free records key that on the thread id, which
+// precedes the varint in this mode, Free has no time in Milliseconds.
+enum class TimestampMode : uint8_t {
+    Milliseconds,
+    Nanoseconds
+};
+
 enum class CommandType : uint8_t {
     Invalid,
     DisableSnapshots,
@@ -30,7 +40,17 @@ enum class RecordType : uint8_t {
     PageRemove,
     ThreadName,
     WorkingDirectory,
-    Max = WorkingDirectory
+    StackDefinition,
+    SizedFree,
+    LibraryUnload,
+    Fork,
+    Tracking,
+    Dropped,
+    Aggregate,
+    Exit,
+    HookStats,
+    WorkingSet,
+    Max = WorkingSet
 };
 
 inline static const char *recordTypeToString(RecordType t)
@@ -52,6 +72,16 @@ inline static const char *recordTypeToString(RecordType t)
     case RecordType::PageRemove: return "PageRemove";
     case RecordType::ThreadName: return "ThreadName";
     case RecordType::WorkingDirectory: return "WorkingDirectory";
+    case RecordType::StackDefinition: return "StackDefinition";
+    case RecordType::SizedFree: return "SizedFree";
+    case RecordType::LibraryUnload: return "LibraryUnload";
+    case RecordType::Fork: return "Fork";
+    case RecordType::Tracking: return "Tracking";
+    case RecordType::Dropped: return "Dropped";
+    case RecordType::Aggregate: return "Aggregate";
+    case RecordType::Exit: return "Exit";
+    case RecordType::HookStats: return "HookStats";
+    case RecordType::WorkingSet: return "WorkingSet";
     }
     return "Invalid";
 }
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <signal.h>
+
+// Shared memory transport between the preload and the parser. The memfd
+// starts with a Header, followed by numRings Ring control blocks and then
+// the data area of each ring. Every ring has a single producer (the thread
+// that claimed it) and the parser as its only consumer. Ring 0 is never
+// claimed, threads that could not get a ring of their own take turns on it
+// under the lock in the Header, forked children included. Rings whose owner
+// died are claimed again.
+//
+// Packets are framed by a PacketHeader carrying a global sequence number so
+// the parser can merge the rings back into the order the events happened in.
+// A producer that dies between taking a sequence number and publishing its
+// packet leaves a gap, the pending word of its ring tells the parser which
+// sequence that was. Whoever takes the ring over publishes an empty packet in
+// its place. The word says Reserving while the sequence is being taken, a
+// producer that dies then leaves a gap that nobody can name.
+class ShmRings
+{
+public:
+    enum { Magic = 0x6b72746d, PacketAlign = 8 };
+    enum : uint64_t { Reserving = ~0ull };
+
+    struct Header
+    {
+        uint32_t magic {};
+        uint32_t numRings {};
+        uint64_t ringSize {};
+        alignas(64) std::atomic<uint64_t> sequence {};
+        alignas(64) std::atomic<uint32_t> consumerWaiting {};
+        // pid of the process writing to ring 0, 0 when it's free
+        alignas(64) std::atomic<uint32_t> sharedOwner {};
+    };
+
+    struct alignas(64) Ring
+    {
+        std::atomic<uint64_t> head {};
+        // sequence + 1 of the packet the producer is writing, Reserving
+        // while it takes the sequence, 0 in between
+        std::atomic<uint64_t> pending {};
+        alignas(64) std::atomic<uint64_t> tail {};
+        alignas(64) std::atomic<uint32_t> owner {};
+    };
+
+    struct PacketHeader
+    {
+        uint32_t size {};
+        uint32_t reserved {};
+        uint64_t sequence {};
+    };
+
+    ShmRings() = default;
+
+    static size_t mappingSize(uint32_t numRings, uint64_t ringSize);
+    // owners are thread ids for claimed rings and pids for ring 0, a process
+    // that hasn't been reaped yet still counts as alive
+    static bool ownerDead(uint32_t owner);
+
+    void init(void* mem, uint32_t numRings, uint64_t ringSize);
+    bool attach(void* mem, size_t size);
+
+    Header* header() const;
+    uint32_t numRings() const;
+    Ring* ring(uint32_t idx) const;
+
+    // producer
+    Ring* claim(uint32_t owner);
+    void release(Ring* ring);
+    bool write(Ring* ring, uint64_t sequence, const void* data, uint32_t size);
+    bool hasSpace(const Ring* ring, uint32_t size) const;
+
+    // consumer
+    bool peek(uint32_t idx, PacketHeader* packet) const;
+    void read(uint32_t idx, const PacketHeader& packet, void* out);
+
+private:
+    static uint64_t packetSize(uint32_t size);
+    uint8_t* ringData(const Ring* ring) const;
+    void copyIn(Ring* ring, uint64_t offset, const void* data, size_t size);
+    void copyOut(const Ring* ring, uint64_t offset, void* out, size_t size) const;
+
+private:
+    Header* mHeader {};
+    Ring* mRings {};
+    uint8_t* mData {};
+    uint64_t mRingSize {};
+    uint32_t mNumRings {};
+};
+
+inline size_t ShmRings::mappingSize(uint32_t numRings, uint64_t ringSize)
+{
+    return sizeof(Header) + (numRings * sizeof(Ring)) + (numRings * ringSize);
+}
+
+inline bool ShmRings::ownerDead(uint32_t owner)
+{
+    return ::kill(static_cast<pid_t>(owner), 0) == -1 && errno == ESRCH;
+}
+
+inline void ShmRings::init(void* mem, uint32_t numRings, uint64_t ringSize)
+{
+    mHeader = new (mem) Header();
+    mHeader->magic = Magic;
+    mHeader->numRings = numRings;
+    mHeader->ringSize = ringSize;
+
+    mRings = reinterpret_cast<Ring*>(static_cast<uint8_t*>(mem) + sizeof(Header));
+    for (uint32_t i = 0; i < numRings; ++i) {
+        new (mRings + i) Ring();
+    }
+    mData = reinterpret_cast<uint8_t*>(mRings + numRings);
+    mRingSize = ringSize;
+    mNumRings = numRings;
+}
+
+inline bool ShmRings::attach(void* mem, size_t size)
+{
+    auto header = static_cast<Header*>(mem);
+    if (size < sizeof(Header) || header->magic != Magic)
+        return false;
+    // the ring size needs to be a power of two for the offset masking
+    if (header->ringSize == 0 || (header->ringSize & (header->ringSize - 1)) != 0)
+        return false;
+    if (mappingSize(header->numRings, header->ringSize) > size)
+        return false;
+
+    mHeader = header;
+    mRings = reinterpret_cast<Ring*>(static_cast<uint8_t*>(mem) + sizeof(Header));
+    mData = reinterpret_cast<uint8_t*>(mRings + header->numRings);
+    mRingSize = header->ringSize;
+    mNumRings = header->numRings;
+    return true;
+}
+
+inline ShmRings::Header* ShmRings::header() const
+{
+    return mHeader;
+}
+
+inline uint32_t ShmRings::numRings() const
+{
+    return mNumRings;
+}
+
+inline ShmRings::Ring* ShmRings::ring(uint32_t idx) const
+{
+    return mRings + idx;
+}
+
+inline ShmRings::Ring* ShmRings::claim(uint32_t owner)
+{
+    // free rings first, threads of processes that exited never released theirs
+    for (uint32_t i = 1; i < mNumRings; ++i) {
+        uint32_t expected = 0;
+        if (mRings[i].owner.load(std::memory_order_relaxed) == 0
+            && mRings[i].owner.compare_exchange_strong(expected, owner, std::memory_order_acquire, std::memory_order_relaxed)) {
+            return mRings + i;
+        }
+    }
+    for (uint32_t i = 1; i < mNumRings; ++i) {
+        uint32_t expected = mRings[i].owner.load(std::memory_order_relaxed);
+        if (expected != 0 && ownerDead(expected)
+            && mRings[i].owner.compare_exchange_strong(expected, owner, std::memory_order_acquire, std::memory_order_relaxed)) {
+            return mRings + i;
+        }
+    }
+    return nullptr;
+}
+
+inline void ShmRings::release(Ring* ring)
+{
+    ring->owner.store(0, std::memory_order_release);
+}
+
+inline uint64_t ShmRings::packetSize(uint32_t size)
+{
+    return (sizeof(PacketHeader) + size + (PacketAlign - 1)) & ~static_cast<uint64_t>(PacketAlign - 1);
+}
+
+inline uint8_t* ShmRings::ringData(const Ring* ring) const
+{
+    return mData + ((ring - mRings) * mRingSize);
+}
+
+inline void ShmRings::copyIn(Ring* ring, uint64_t offset, const void* data, size_t size)
+{
+    uint8_t* base = ringData(ring);
+    const uint64_t start = offset & (mRingSize - 1);
+    const uint64_t first = std::min<uint64_t>(size, mRingSize - start);
+    memcpy(base + start, data, first);
+    if (first < size) {
+        memcpy(base, static_cast<const uint8_t*>(data) + first, size - first);
+    }
+}
+
+inline void ShmRings::copyOut(const Ring* ring, uint64_t offset, void* out, size_t size) const
+{
+    const uint8_t* base = ringData(ring);
+    const uint64_t start = offset & (mRingSize - 1);
+    const uint64_t first = std::min<uint64_t>(size, mRingSize - start);
+    memcpy(out, base + start, first);
+    if (first < size) {
+        memcpy(static_cast<uint8_t*>(out) + first, base, size - first);
+    }
+}
+
+inline bool ShmRings::write(Ring* ring, uint64_t sequence, const void* data, uint32_t size)
+{
+    const uint64_t total = packetSize(size);
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+    const uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    if (mRingSize - (head - tail) < total)
+        return false;
+
+    const PacketHeader packet { size, 0, sequence };
+    copyIn(ring, head, &packet, sizeof(packet));
+    copyIn(ring, head + sizeof(packet), data, size);
+    ring->head.store(head + total, std::memory_order_release);
+    return true;
+}
+
+inline bool ShmRings::hasSpace(const Ring* ring, uint32_t size) const
+{
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+    const uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    return mRingSize - (head - tail) >= packetSize(size);
+}
+
+inline bool ShmRings::peek(uint32_t idx, PacketHeader* packet) const
+{
+    const Ring* ring = mRings + idx;
+    const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (ring->head.load(std::memory_order_acquire) == tail)
+        return false;
+    copyOut(ring, tail, packet, sizeof(PacketHeader));
+    return true;
+}
+
+inline void ShmRings::read(uint32_t idx, const PacketHeader& packet, void* out)
+{
+    Ring* ring = mRings + idx;
+    const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    copyOut(ring, tail + sizeof(PacketHeader), out, packet.size);
+    ring->tail.store(tail + packetSize(packet.size), std::memory_order_release);
+}
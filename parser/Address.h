@@ -98,4 +98,6 @@ inline bool Address<T>::valid() const
 struct UnresolvedAddress : public InstructionPointer
 {
     backtrace_state* state {};
+    // ip rebased to the address the state was created with
+    uint64_t moduleIp {};
 };
@@ -1,5 +1,6 @@
 #include "FileEmitter.h"
 #include "base64.h"
+#include <algorithm>
 #include <cassert>
 #include <zlib.h>
 
@@ -148,8 +149,21 @@ void FileEmitter::flush(bool finalize)
     }
 }
 
+void FileEmitter::writeHeld(const std::vector<uint8_t>& held)
+{
+    for (size_t offset = 0; offset < held.size(); offset += BufferSize) {
+        writeBytes(held.data() + offset, std::min<size_t>(BufferSize, held.size() - offset), WriteType::Continuation);
+    }
+}
+
 void FileEmitter::writeBytes(const void* data, size_t size, WriteType)
 {
+    if (mHold != nullptr) {
+        const auto bytes = static_cast<const uint8_t*>(data);
+        mHold->insert(mHold->end(), bytes, bytes + size);
+        return;
+    }
+
     assert(mBufferOffset > 0 || mBufferOffset + size <= BufferSize);
     if (mBufferOffset + size <= BufferSize) {
         memcpy(mBuffer.data() + mBufferOffset, data, size);
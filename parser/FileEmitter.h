@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <string>
+#include <vector>
 
 extern "C" struct z_stream_s;
 
@@ -26,6 +27,11 @@ public:
 
     void setFile(FILE* file, uint8_t writeMode);
 
+    // while set everything emitted is appended to hold instead of being
+    // written, writeHeld writes it out later
+    void setHold(std::vector<uint8_t>* hold) { mHold = hold; }
+    void writeHeld(const std::vector<uint8_t>& held);
+
     virtual void writeBytes(const void* data, size_t size, WriteType type) override;
 
 private:
@@ -36,6 +42,7 @@ private:
 private:
     uint64_t mOffset {}, mBOffset {};
     FILE* mFile { nullptr };
+    std::vector<uint8_t>* mHold { nullptr };
     uint32_t mBufferOffset {};
     std::array<uint8_t, BufferSize> mBuffer;
     z_stream_s* mZStream = nullptr;
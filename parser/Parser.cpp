@@ -1,11 +1,14 @@
 #include "Parser.h"
 #include "Logger.h"
 #include "ResolverThread.h"
+#include <common/HookStats.h>
 #include <common/Limits.h>
 #include <common/MmapTracker.h>
 #include <fmt/core.h>
 #include <cassert>
+#include <chrono>
 #include <climits>
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
 #include <limits>
@@ -20,7 +23,8 @@ enum class EmitType : uint8_t {
     Stack,
     StackAddr,
     StackString,
-    ThreadName
+    ThreadName,
+    WorkingSet
 };
 
 namespace {
@@ -28,6 +32,23 @@ inline bool intersects(uint64_t startA, uint64_t endA, uint64_t startB, uint64_t
 {
     return startA < endB && startB < endA;
 }
+
+// An allocation of size bytes is sampled with probability
+// 1 - exp(-size / sampleRate), weight it by the inverse of that to get
+// an unbiased estimate of the bytes it stands for.
+inline uint64_t unsampledSize(uint64_t size, uint64_t sampleRate)
+{
+    if (sampleRate == 0 || size == 0)
+        return size;
+    const double probability = -std::expm1(-static_cast<double>(size) / static_cast<double>(sampleRate));
+    return static_cast<uint64_t>(std::llround(static_cast<double>(size) / probability));
+}
+
+// the output has times as fractional milliseconds
+inline double milliseconds(uint64_t ns)
+{
+    return static_cast<double>(ns) / 1000000.0;
+}
 } // anonymous namespace
 
 // #define DEBUG_EMITS
@@ -48,7 +69,30 @@ Parser::Parser(const Options& options)
         mData.resize(options.fileSize);
     }
 
-    mFile = fopen(options.output.c_str(), "w");
+    if (flightRecorderEnabled()) {
+        // the file is only created once something triggers a dump
+        mFlightRecorder.holding = true;
+        mFileEmitter.setHold(&mFlightRecorder.definitions);
+    } else {
+        openOutput();
+    }
+
+    mLastMemory.upThreshold = 0.01;
+    mLastMemory.downThreshold = 0.01;
+    mLastMemory.timeThreshold = 25;
+    mLastMemory.peakThreshold = 50;
+    mLastMemory.peakTimeThreshold = 250;
+    mLastMemory.maxTimeThreshold = 1000;
+}
+
+Parser::~Parser()
+{
+    cleanup();
+}
+
+void Parser::openOutput()
+{
+    mFile = fopen(mOptions.output.c_str(), "w");
 
     uint8_t fileEmitterFlags = FileEmitter::WriteMode::None;
     if (mOptions.html) {
@@ -59,18 +103,57 @@ Parser::Parser(const Options& options)
     }
 
     mFileEmitter.setFile(mFile, fileEmitterFlags);
+}
 
-    mLastMemory.upThreshold = 0.01;
-    mLastMemory.downThreshold = 0.01;
-    mLastMemory.timeThreshold = 25;
-    mLastMemory.peakThreshold = 50;
-    mLastMemory.peakTimeThreshold = 250;
-    mLastMemory.maxTimeThreshold = 1000;
+// Memory and Snapshot records go to their own FlightRecord so they can be
+// pruned, SnapshotName is never held since mtrack_snapshot triggers a dump
+void Parser::holdTimeline(uint64_t now)
+{
+    if (!mFlightRecorder.holding)
+        return;
+    mFlightRecorder.timeline.push_back(FlightRecord { now, {} });
+    mFileEmitter.setHold(&mFlightRecorder.timeline.back().data);
 }
 
-Parser::~Parser()
+void Parser::releaseTimeline()
 {
-    cleanup();
+    if (!mFlightRecorder.holding)
+        return;
+    auto& timeline = mFlightRecorder.timeline;
+    mFlightRecorder.timelineBytes += timeline.back().data.size();
+    mFileEmitter.setHold(&mFlightRecorder.definitions);
+
+    // the newest record is always kept
+    const uint64_t window = mOptions.flightRecorderTime * 1000000000ull;
+    const uint64_t newest = timeline.back().time;
+    while (timeline.size() > 1) {
+        const auto& oldest = timeline.front();
+        const bool tooOld = window > 0 && newest - oldest.time > window;
+        const bool tooLarge = mOptions.flightRecorderSize > 0 && mFlightRecorder.timelineBytes > mOptions.flightRecorderSize;
+        if (!tooOld && !tooLarge)
+            break;
+        mFlightRecorder.timelineBytes -= oldest.data.size();
+        timeline.pop_front();
+    }
+}
+
+// Writes out what the flight recorder held, everything after this goes
+// straight to the file as usual
+void Parser::triggerFlightRecorder(const char* reason)
+{
+    if (!mFlightRecorder.holding)
+        return;
+    LOG("flight recorder triggered by {}, writing {} records of history", reason, mFlightRecorder.timeline.size());
+    mFlightRecorder.holding = false;
+    mFileEmitter.setHold(nullptr);
+    openOutput();
+    mFileEmitter.writeHeld(mFlightRecorder.definitions);
+    for (const auto& record : mFlightRecorder.timeline) {
+        mFileEmitter.writeHeld(record.data);
+    }
+    mFlightRecorder.definitions = {};
+    mFlightRecorder.timeline.clear();
+    mFlightRecorder.timelineBytes = 0;
 }
 
 void Parser::cleanup()
@@ -107,16 +190,16 @@ void Parser::onResolvedAddresses(std::vector<Address<std::string>>&& addresses)
 
 void Parser::emitStack(Application &app, int32_t idx)
 {
-    if(!(mOptions.appId & app.id))
+    if(!mOptions.includesApp(app.id))
         return;
 
     ++mStacksResolved;
     // auto prior = mStackAddrIndexer.size();
-    if (app.libraries.size() > app.modules.size()) {
-        // create new modules
-        for (size_t libIdx = app.modules.size(); libIdx < app.libraries.size(); ++libIdx) {
+    if (app.libraries.size() > app.librariesProcessed) {
+        // create modules for the libraries that came in since last time
+        for (size_t libIdx = app.librariesProcessed; libIdx < app.libraries.size(); ++libIdx) {
             const auto& lib = app.libraries[libIdx];
-            if (lib.name.substr(0, 13) == "linux-vdso.so" || lib.name.substr(0, 13) == "linux-gate.so") {
+            if (lib.unloaded || lib.name.substr(0, 13) == "linux-vdso.so" || lib.name.substr(0, 13) == "linux-gate.so") {
                 // skip
                 continue;
             }
@@ -134,22 +217,28 @@ void Parser::emitStack(Application &app, int32_t idx)
                     name = file->second;
             }
 
+            // the module might already have been created by another
+            // application, possibly at a different address
             auto module = Module::create(app.type, mStringIndexer, std::move(name), lib.addr);
+            const bool created = module->ranges().empty();
+            const uint64_t bias = module->address() - lib.addr;
+
+            // what was there before is taken out, see unloadLibrary
             for (const auto& hdr : lib.headers) {
-                module->addHeader(hdr.addr, hdr.len);
+                if (created)
+                    module->addHeader(hdr.addr, hdr.len);
+                const uint64_t start = lib.addr + hdr.addr;
+                const uint64_t end = start + hdr.len;
+                auto it = app.moduleCache.lower_bound(start);
+                if (it != app.moduleCache.begin() && std::prev(it)->second.end > start)
+                    --it;
+                while (it != app.moduleCache.end() && it->first < end)
+                    it = app.moduleCache.erase(it);
+                app.moduleCache.insert(std::make_pair(start, ModuleEntry { end, module.get(), bias }));
             }
             app.modules.push_back(std::move(module));
         }
-        app.moduleCache.clear();
-    }
-    if (app.moduleCache.empty()) {
-        // update module cache
-        for (const auto& m : app.modules) {
-            const auto& rs = m->ranges();
-            for (const auto& r : rs) {
-                app.moduleCache.insert(std::make_pair(r.first, ModuleEntry { r.second, m.get() }));
-            }
-        }
+        app.librariesProcessed = app.libraries.size();
     }
 
     const auto& hashable = mHashIndexer.value(idx);
@@ -158,20 +247,39 @@ void Parser::emitStack(Application &app, int32_t idx)
     std::vector<UnresolvedAddress> stackFrames;
     stackFrames.resize(numFrames);
     std::vector<UnresolvedAddress> unresolved;
+    std::vector<std::pair<InstructionPointer, const Address<int32_t>*>> known;
     EMIT(mFileEmitter.emit(EmitType::Stack, app.id, idx, numFrames));
     for (uint32_t i = 0; i < numFrames; ++i) {
         void* ipptr;
         memcpy(&ipptr, data + (i * sizeof(void*)), sizeof(void*));
         const InstructionPointer ip = { app.id, reinterpret_cast<uint64_t>(ipptr) };
         auto ait = mAddressCache.find(ip);
-        if (ait == mAddressCache.end()) {
+        if (ait == mAddressCache.end() && ip.ip == Limits::TruncatedFrame) {
+            // where the preload cut the stack off, shown as its root
+            Frame<std::string> frame;
+            frame.function = "[truncated]";
+            auto& addr = mAddressCache[ip];
+            addr = Address<int32_t>();
+            addr->frame = convertFrame(std::move(frame));
+            known.push_back(std::make_pair(ip, &*addr));
+        } else if (ait == mAddressCache.end()) {
             auto it = app.moduleCache.upper_bound(ip.ip);
             if (it != app.moduleCache.begin())
                 --it;
             if (app.moduleCache.size() == 1)
                 it = app.moduleCache.begin();
             if (it != app.moduleCache.end() && ip.ip >= it->first && ip <= InstructionPointer{app.id, it->second.end }) {
-                unresolved.push_back(UnresolvedAddress{ app.id, ip.ip, it->second.module->state() });
+                const ModuleAddress moduleIp = { it->second.module->state(), ip.ip + it->second.bias };
+                auto& shared = mModuleAddresses[moduleIp];
+                if (shared.resolved) {
+                    known.push_back(std::make_pair(ip, &*shared.resolved));
+                } else {
+                    if (shared.waiting.empty()) {
+                        unresolved.push_back(UnresolvedAddress{ app.id, ip.ip, moduleIp.state, moduleIp.ip });
+                        mResolving[ip].push_back(moduleIp);
+                    }
+                    shared.waiting.push_back(ip);
+                }
                 mAddressCache[ip] = std::nullopt;
             } else {
                 mAddressCache[ip] = Address<int32_t>();
@@ -179,6 +287,9 @@ void Parser::emitStack(Application &app, int32_t idx)
         }
         EMIT(mFileEmitter.emit(static_cast<double>(ip.ip)));
     }
+    for (const auto& [ ip, addr ] : known) {
+        emitStackAddr(ip, *addr);
+    }
     if (!unresolved.empty()) {
         auto lock = mResolverThread->lock();
         lock->insert(lock->end(), unresolved.begin(), unresolved.end());
@@ -208,7 +319,7 @@ inline Frame<int32_t> Parser::convertFrame(Frame<std::string> &&frame)
 
 inline void Parser::emitAddress(Address<std::string> &&strAddr)
 {
-    if(!(mOptions.appId & strAddr.aid))
+    if(!mOptions.includesApp(strAddr.aid))
         return;
 
     Address<int32_t> intAddr;
@@ -219,20 +330,42 @@ inline void Parser::emitAddress(Address<std::string> &&strAddr)
     for (size_t i=0; i<strAddr.inlined.size(); ++i) {
         intAddr.inlined[i] = convertFrame(std::move(strAddr.inlined[i]));
     }
-    EMIT(mFileEmitter.emit(EmitType::StackAddr, static_cast<uint8_t>(strAddr.aid), static_cast<double>(strAddr.ip), static_cast<uint32_t>(intAddr.inlined.size() + 1)));
 
-    EMIT(mFileEmitter.emit(intAddr.frame.function, intAddr.frame.file, intAddr.frame.line));
-    for (const Frame<int32_t> &frame : intAddr.inlined) {
+    const InstructionPointer ip = strAddr;
+    auto resolving = mResolving.find(ip);
+    if (resolving == mResolving.end()) {
+        emitStackAddr(ip, intAddr);
+        return;
+    }
+
+    // every application waiting for this module address gets it now
+    auto& shared = mModuleAddresses[resolving->second.front()];
+    resolving->second.pop_front();
+    if (resolving->second.empty())
+        mResolving.erase(resolving);
+    for (const auto& waiting : shared.waiting) {
+        emitStackAddr(waiting, intAddr);
+    }
+    shared.waiting = {};
+    shared.resolved = std::move(intAddr);
+}
+
+inline void Parser::emitStackAddr(const InstructionPointer& ip, const Address<int32_t>& addr)
+{
+    EMIT(mFileEmitter.emit(EmitType::StackAddr, static_cast<uint8_t>(ip.aid), static_cast<double>(ip.ip), static_cast<uint32_t>(addr.inlined.size() + 1)));
+
+    EMIT(mFileEmitter.emit(addr.frame.function, addr.frame.file, addr.frame.line));
+    for (const Frame<int32_t> &frame : addr.inlined) {
         EMIT(mFileEmitter.emit(frame.function, frame.file, frame.line));
     }
 }
 
-inline void Parser::emitSnapshot(uint32_t now)
+inline void Parser::emitSnapshot(uint64_t now)
 {
     //printf("emitting snapshot\n");
     // send snapshot
     for(auto app = mApplications.begin(); app != mApplications.end(); ++app) {
-        if(!(mOptions.appId & app->first))
+        if(!mOptions.includesApp(app->first))
             continue;
 
         std::vector<int32_t> newStacks;
@@ -246,21 +379,29 @@ inline void Parser::emitSnapshot(uint32_t now)
         };
 
         // emit a memory as well to ease parsing this in javascript
-        EMIT(mFileEmitter.emit(EmitType::Snapshot, app->first, now, static_cast<double>(mLastSnapshot.pageFaultBytes), static_cast<double>(mLastSnapshot.mallocBytes),
-                               static_cast<uint32_t>(app->second.pageFaults.size()), static_cast<uint32_t>(app->second.mallocs.size()), static_cast<uint32_t>(app->second.mmaps.size())));
+        holdTimeline(now);
+        EMIT(mFileEmitter.emit(EmitType::Snapshot, app->first, milliseconds(now), static_cast<double>(mLastSnapshot.pageFaultBytes), static_cast<double>(mLastSnapshot.mallocBytes),
+                               static_cast<uint8_t>(!app->second.dropped.empty()),
+                               static_cast<uint32_t>(app->second.pageFaults.size()), static_cast<uint32_t>(app->second.mallocs.size()), static_cast<uint32_t>(app->second.mmaps.size()),
+                               static_cast<uint32_t>(app->second.callsites.size())));
 
         for (const auto& pf : app->second.pageFaults) {
-            EMIT(mFileEmitter.emit(static_cast<double>(pf.place), pf.ptid, pf.stack, pf.time));
+            EMIT(mFileEmitter.emit(static_cast<double>(pf.place), static_cast<double>(pf.size), pf.ptid, pf.stack, milliseconds(pf.time)));
             checkStack(pf.stack);
         }
         for (const auto& m : app->second.mallocs) {
-            EMIT(mFileEmitter.emit(static_cast<double>(m.addr), static_cast<double>(m.size), m.ptid, m.stack, m.time));
+            EMIT(mFileEmitter.emit(static_cast<double>(m.addr), static_cast<double>(m.size), m.ptid, m.stack, milliseconds(m.time)));
             checkStack(m.stack);
         }
         app->second.mmaps.forEach([this, &checkStack](uintptr_t start, uintptr_t end, int32_t /*prot*/, int32_t /*flags*/, int32_t stack) {
             EMIT(mFileEmitter.emit(static_cast<double>(start), static_cast<double>(end), stack));
             checkStack(stack);
         });
+        for (const auto& [ stack, callsite ] : app->second.callsites) {
+            EMIT(mFileEmitter.emit(static_cast<double>(callsite.bytes), static_cast<double>(callsite.count), static_cast<double>(callsite.allocations), stack));
+            checkStack(stack);
+        }
+        releaseTimeline();
 
         for (const int32_t stack : newStacks) {
             emitStack(app->second, stack);
@@ -268,6 +409,58 @@ inline void Parser::emitSnapshot(uint32_t now)
     }
 }
 
+inline void Parser::emitWorkingSet(Application& app, uint64_t now)
+{
+    if (mOptions.includesApp(app.id)) {
+        uint64_t hot = 0, cold = 0;
+        for (const auto& [ stack, ws ] : app.workingSet) {
+            hot += ws.hot;
+            cold += ws.cold;
+        }
+
+        std::vector<int32_t> newStacks;
+        holdTimeline(now);
+        EMIT(mFileEmitter.emit(EmitType::WorkingSet, app.id, milliseconds(now), static_cast<double>(hot), static_cast<double>(cold),
+                               static_cast<uint32_t>(app.workingSet.size())));
+        for (const auto& [ stack, ws ] : app.workingSet) {
+            EMIT(mFileEmitter.emit(stack, static_cast<double>(ws.hot), static_cast<double>(ws.cold)));
+            auto it = app.pendingStacks.find(stack);
+            if (it != app.pendingStacks.end()) {
+                app.pendingStacks.erase(it);
+                newStacks.push_back(stack);
+            }
+        }
+        releaseTimeline();
+
+        for (const int32_t stack : newStacks) {
+            emitStack(app, stack);
+        }
+    }
+    app.workingSet.clear();
+}
+
+void Parser::requestFlightRecorderDump()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mFlightRecorderRequested.store(true, std::memory_order_relaxed);
+    mCond.notify_one();
+}
+
+void Parser::checkFlightRecorderRequest()
+{
+    if (!mFlightRecorderRequested.load(std::memory_order_relaxed)
+        || !mFlightRecorderRequested.exchange(false, std::memory_order_relaxed)
+        || !mFlightRecorder.holding) {
+        return;
+    }
+    triggerFlightRecorder("signal");
+    mLastSnapshot.time = mLastTimestamp / 1000000;
+    mLastSnapshot.pageFaultBytes = currentPageFaultBytes();
+    mLastSnapshot.mallocBytes = currentMallocBytes();
+    emitSnapshot(mLastTimestamp);
+    EMIT(mFileEmitter.emit(EmitType::SnapshotName, Emitter::String("flight recorder")));
+}
+
 void Parser::parseThread()
 {
     size_t packetSizeCount = 0;
@@ -282,7 +475,7 @@ void Parser::parseThread()
         // LOG("loop.");
         {
             std::unique_lock<std::mutex> lock(mMutex);
-            while (mPacketSizeCount == 0 && !mShutdown) {
+            while (mPacketSizeCount == 0 && !mShutdown && !mFlightRecorderRequested.load(std::memory_order_relaxed)) {
                 mCond.wait(lock);
             }
             if (mShutdown && mPacketSizeCount == 0) {
@@ -325,6 +518,7 @@ void Parser::parseThread()
             dataOffset += packetSizes[packetNo];
             bytesConsumed += packetSizes[packetNo];
             ++totalPacketNo;
+            checkFlightRecorderRequest();
         }
         packetSizeCount = 0;
 
@@ -336,13 +530,120 @@ void Parser::parseThread()
         for (Address<std::string> &strAddress : resolved) {
             emitAddress(std::move(strAddress));
         }
+
+        checkFlightRecorderRequest();
     }
 
-    if (mLastSnapshot.enabled) {
+    if (mFlightRecorder.holding) {
+        // an application that went away without the preload's atexit
+        // handler running crashed or was killed
+        for (const auto& app : mApplications) {
+            if (mOptions.includesApp(app.first) && !app.second.exited) {
+                LOG("app {} exited abnormally", app.first);
+                triggerFlightRecorder("abnormal exit");
+                break;
+            }
+        }
+    }
+
+    if (mFlightRecorder.holding) {
+        LOG("flight recorder was never triggered, nothing written");
+    } else if (mLastSnapshot.enabled) {
         emitSnapshot(mLastTimestamp);
     }
 
-    LOG("Finished parsing {} events in {}ms", totalPacketNo, mLastTimestamp);
+    for (const auto& app : mApplications) {
+        if (app.second.sizeMismatches > 0) {
+            LOG("app {} had {} sized deletes that didn't match the allocated size", app.first, app.second.sizeMismatches);
+        }
+        for (const auto& [ type, count ] : app.second.dropped) {
+            LOG("app {} dropped {} {} records", app.first, count, recordTypeToString(static_cast<RecordType>(type)));
+        }
+        const auto& stats = app.second.hookStats;
+        for (uint32_t counter = 0; counter < stats.size(); ++counter) {
+            if (stats[counter] == 0)
+                continue;
+            if (counter < HookStats::Events) {
+                LOG("app {} hook stats {}: {}", app.first, HookStats::counterName(counter), stats[counter]);
+            } else {
+                LOG("app {} hook stats {} records: {}", app.first, HookStats::counterName(counter), stats[counter]);
+            }
+        }
+    }
+
+    LOG("Finished parsing {} events in {}ms", totalPacketNo, mLastTimestamp / 1000000);
+}
+
+// The daemon hands out the appId of an application that's gone to the next
+// one, what the old one had is dropped
+void Parser::replaceApplication(uint8_t appId)
+{
+    const auto app = mApplications.find(appId);
+    if (app == mApplications.end())
+        return;
+    LOG("app {} is reused, dropping the application that had it", appId);
+    if (mFlightRecorder.holding && mOptions.includesApp(appId) && !app->second.exited) {
+        LOG("app {} exited abnormally", appId);
+        triggerFlightRecorder("abnormal exit");
+    }
+    mApplications.erase(app);
+    // the addresses are resolved again, for the modules of the new one.
+    // What's still with the resolver goes to the other applications
+    // waiting for it, the old one isn't one of them anymore.
+    std::erase_if(mAddressCache, [appId](const auto& entry) {
+        return entry.first.aid == appId;
+    });
+    for (auto& [ moduleIp, shared ] : mModuleAddresses) {
+        std::erase_if(shared.waiting, [appId](const InstructionPointer& ip) {
+            return ip.aid == appId;
+        });
+    }
+}
+
+// Stacks recorded before the unload can still be pending, the ones with
+// frames in the library are emitted while it's there to resolve them. Then
+// its ranges are taken out of the application's module cache and addresses
+// in them are looked up again, something else can get loaded there.
+void Parser::unloadLibrary(Application& app, Library& lib)
+{
+    auto inLibrary = [&lib](uint64_t ip) {
+        for (const auto& hdr : lib.headers) {
+            if (ip >= lib.addr + hdr.addr && ip < lib.addr + hdr.addr + hdr.len)
+                return true;
+        }
+        return false;
+    };
+
+    std::vector<int32_t> stacks;
+    for (const int32_t stack : app.pendingStacks) {
+        const auto& hashable = mHashIndexer.value(stack);
+        const uint32_t numFrames = hashable.size() / sizeof(void*);
+        const uint8_t* data = hashable.data<uint8_t>();
+        for (uint32_t i = 0; i < numFrames; ++i) {
+            uint64_t ip;
+            memcpy(&ip, data + (i * sizeof(void*)), sizeof(void*));
+            if (inLibrary(ip)) {
+                stacks.push_back(stack);
+                break;
+            }
+        }
+    }
+    for (const int32_t stack : stacks) {
+        app.pendingStacks.erase(stack);
+        emitStack(app, stack);
+    }
+
+    // a library that hasn't been processed yet is skipped when it is
+    lib.unloaded = true;
+    for (const auto& hdr : lib.headers) {
+        const uint64_t start = lib.addr + hdr.addr;
+        const auto it = app.moduleCache.find(start);
+        if (it != app.moduleCache.end() && it->second.end == start + hdr.len)
+            app.moduleCache.erase(it);
+    }
+    std::erase_if(mAddressCache, [&app, &inLibrary](const auto& entry) {
+        return entry.first.aid == app.id && inLibrary(entry.first.ip);
+    });
 }
 
 static bool comparePageFaultItem(const PageFault& item, uint64_t start)
@@ -350,38 +651,113 @@ static bool comparePageFaultItem(const PageFault& item, uint64_t start)
     return item.place < start;
 }
 
+// Takes start..end out of the page fault ranges, splitting the ones that
+// stick out on either side. The parts that were taken out are added to
+// removed if it's set.
+static void cutPageFaults(Application& app, uint64_t start, uint64_t end, std::vector<PageFault>* removed)
+{
+    auto item = std::lower_bound(app.pageFaults.begin(), app.pageFaults.end(), start, comparePageFaultItem);
+    if (item != app.pageFaults.begin() && std::prev(item)->place + std::prev(item)->size > start)
+        --item;
+    while (item != app.pageFaults.end() && item->place < end) {
+        const uint64_t itemEnd = item->place + item->size;
+        if (removed != nullptr) {
+            PageFault cut = *item;
+            cut.place = std::max(item->place, start);
+            cut.size = std::min(itemEnd, end) - cut.place;
+            removed->push_back(cut);
+        }
+        if (item->place < start && itemEnd > end) {
+            // the middle of it goes
+            PageFault tail = *item;
+            tail.place = end;
+            tail.size = itemEnd - end;
+            item->size = start - item->place;
+            app.pageFaultSize -= end - start;
+            app.pageFaults.insert(std::next(item), tail);
+            return;
+        }
+        if (item->place < start) {
+            app.pageFaultSize -= itemEnd - start;
+            item->size = start - item->place;
+            ++item;
+        } else if (itemEnd > end) {
+            app.pageFaultSize -= end - item->place;
+            item->size = itemEnd - end;
+            item->place = end;
+            return;
+        } else {
+            app.pageFaultSize -= item->size;
+            item = app.pageFaults.erase(item);
+        }
+    }
+}
+
+// The preload counts the working set per mapping. Its hot and cold bytes
+// are split over the stacks of the page faults in it by how much of the
+// mapping each of them faulted in, a mapping with no known page faults
+// goes to the stack of its mmap.
+static void addWorkingSet(Application& app, uint64_t start, uint64_t end, int32_t mmapStack, uint64_t hot, uint64_t cold)
+{
+    std::vector<std::pair<int32_t, uint64_t>> faulted;
+    uint64_t total = 0;
+    auto item = std::lower_bound(app.pageFaults.begin(), app.pageFaults.end(), start, comparePageFaultItem);
+    if (item != app.pageFaults.begin() && std::prev(item)->place + std::prev(item)->size > start)
+        --item;
+    for (; item != app.pageFaults.end() && item->place < end; ++item) {
+        const uint64_t bytes = std::min(item->place + item->size, end) - std::max(item->place, start);
+        auto stack = std::find_if(faulted.begin(), faulted.end(), [item](const auto& f) {
+            return f.first == item->stack;
+        });
+        if (stack == faulted.end()) {
+            faulted.emplace_back(item->stack, bytes);
+        } else {
+            stack->second += bytes;
+        }
+        total += bytes;
+    }
+
+    if (total == 0) {
+        auto& ws = app.workingSet[mmapStack];
+        ws.hot += hot;
+        ws.cold += cold;
+        return;
+    }
+    for (const auto& [ stack, bytes ] : faulted) {
+        const double share = static_cast<double>(bytes) / static_cast<double>(total);
+        auto& ws = app.workingSet[stack];
+        ws.hot += static_cast<uint64_t>(std::llround(static_cast<double>(hot) * share));
+        ws.cold += static_cast<uint64_t>(std::llround(static_cast<double>(cold) * share));
+    }
+}
+
+// a page that faults again was dropped at some point, the new range wins
+static void insertPageFault(Application& app, const PageFault& pf)
+{
+    cutPageFaults(app, pf.place, pf.place + pf.size, nullptr);
+    auto it = std::lower_bound(app.pageFaults.begin(), app.pageFaults.end(), pf.place, comparePageFaultItem);
+    app.pageFaults.insert(it, pf);
+    app.pageFaultSize += pf.size;
+}
+
 void Parser::parsePacket(const uint8_t* data, uint32_t dataSize)
 {
     ++mPacketNo;
 
-    auto removePageFaults = [this](Application &app, uint64_t start, uint64_t end) {
-        auto item = std::lower_bound(app.pageFaults.begin(), app.pageFaults.end(), start, comparePageFaultItem);
-        while (item != app.pageFaults.end() && intersects(start, end, item->place, item->place + Limits::PageSize)) {
-            item = app.pageFaults.erase(item);
-        }
+    auto removePageFaults = [](Application &app, uint64_t start, uint64_t end) {
+        cutPageFaults(app, start, end, nullptr);
     };
 
-    auto remapPageFaults = [this](Application &app, uint64_t from, uint64_t to, uint64_t len) {
-        const auto fromEnd = from + len;
+    auto remapPageFaults = [](Application &app, uint64_t from, uint64_t to, uint64_t len) {
         std::vector<PageFault> removed;
         // is 5 a good number?
         removed.reserve(5);
-
-        auto item = std::lower_bound(app.pageFaults.begin(), app.pageFaults.end(), from, comparePageFaultItem);
-        while (item != app.pageFaults.end() && intersects(from, fromEnd, item->place, item->place + Limits::PageSize)) {
-            // remove item at 'from'
-            item->place -= from;
-            removed.push_back(*item);
-            item = app.pageFaults.erase(item);
-        }
+        cutPageFaults(app, from, from + len, &removed);
 
         for (auto& i : removed) {
             // reinsert item at 'to'
-            i.place += to;
-            auto newit = std::lower_bound(app.pageFaults.begin(), app.pageFaults.end(), i.place, comparePageFaultItem);
-            if (newit == app.pageFaults.end() || newit->place > i.place) {
-                app.pageFaults.insert(newit, i);
-            }
+            i.place = i.place - from + to;
+            insertPageFault(app, i);
         }
     };
 
@@ -439,6 +815,52 @@ void Parser::parsePacket(const uint8_t* data, uint32_t dataSize)
         return std::make_pair(idx, inserted);
     };
 
+    auto readVarInt = [data, &offset]() {
+        uint64_t ret = 0;
+        unsigned shift = 0;
+        uint8_t byte;
+        do {
+            byte = data[offset++];
+            ret |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        return ret;
+    };
+
+    // returns nanoseconds since the start of the application
+    auto readTimestamp = [&](Application& app, uint64_t* last) -> uint64_t {
+        if (app.timestampMode == TimestampMode::Nanoseconds) {
+            const auto value = readVarInt();
+            *last = (value & 1) ? (value >> 1) : (*last + (value >> 1));
+            return *last;
+        }
+        // uint32 milliseconds wrap after ~49 days, pick the value closest
+        // to the previous one
+        const uint64_t prev = app.lastTimestamp / 1000000;
+        uint64_t now = (prev & ~0xffffffffull) | static_cast<uint32_t>(readUint32());
+        if (now + 0x80000000ull < prev) {
+            now += 0x100000000ull;
+        } else if (now > prev + 0x80000000ull && now >= 0x100000000ull) {
+            now -= 0x100000000ull;
+        }
+        return now * 1000000;
+    };
+
+    // moves the application's clock to now and returns it on the shared
+    // timeline. Records of different applications are interleaved a little
+    // out of order, the timeline never goes back
+    auto advanceTimestamp = [this](Application& app, uint64_t now) {
+        app.lastTimestamp = now;
+        now += app.timeOffset;
+        mLastTimestamp = std::max(mLastTimestamp, now);
+        return now;
+    };
+
+    auto readStack = [&](const Application& app) {
+        const auto id = readUint32();
+        return id < app.stackIds.size() ? app.stackIds[id] : -1;
+    };
+
     auto readHashableString = [data, &offset, this]() {
         uint32_t size;
         memcpy(&size, data + offset, sizeof(size));
@@ -458,17 +880,114 @@ void Parser::parsePacket(const uint8_t* data, uint32_t dataSize)
     switch (static_cast<RecordType>(type)) {
     case RecordType::Start: {
         const auto appId = readUint8();
-        assert(mApplications.find(appId) == mApplications.end());
+        replaceApplication(appId);
         Application app;
         app.id = appId;
         app.type = static_cast<ApplicationType>(readUint8());
-        app.startTimestamp = app.lastTimestamp = readUint32();
+        app.timestampMode = static_cast<TimestampMode>(readUint8());
+        app.startTimestamp = readUint64();
+        app.sampleRate = readUint64();
         if(!mApplications.size())
-            mLastMemory.time = mLastSnapshot.time = app.lastTimestamp;
-        mLastTimestamp = app.startTimestamp;
+            mLastMemory.time = mLastSnapshot.time = 0;
+        // with the daemon applications start at any time, their timestamps
+        // are relative to their own start. Without a start time to go by
+        // the application starts where the timeline is at
+        if (mStartTimestamp == 0 && mLastTimestamp == 0)
+            mStartTimestamp = app.startTimestamp;
+        if (app.startTimestamp != 0 && mStartTimestamp != 0 && app.startTimestamp >= mStartTimestamp) {
+            app.timeOffset = app.startTimestamp - mStartTimestamp;
+        } else {
+            app.timeOffset = mLastTimestamp;
+        }
+        mApplications[appId] = std::move(app);
+        if(mOptions.includesApp(appId))
+            EMIT(mFileEmitter.emit(EmitType::Start, appId));
+        break; }
+    case RecordType::Fork: {
+        const auto parentId = readUint8();
+        const auto appId = readUint8();
+        const auto pid = readUint32();
+        const auto parent = mApplications.find(parentId);
+        assert(parent != mApplications.end());
+        replaceApplication(appId);
+        // the child has everything the parent had at the time of the fork,
+        // stacks already pending in the parent are emitted by the parent
+        Application app = parent->second;
+        app.id = appId;
+        app.threadTimestamps.clear();
+        app.pageFaultTimestamp = 0;
+        app.pendingStacks.clear();
+        app.sizeMismatches = 0;
+        LOG("app {} is pid {} forked from app {}", appId, pid, parentId);
         mApplications[appId] = std::move(app);
-        if(mOptions.appId & app.id)
-            EMIT(mFileEmitter.emit(EmitType::Start, app.id));
+        if(mOptions.includesApp(appId))
+            EMIT(mFileEmitter.emit(EmitType::Start, appId));
+        break; }
+    case RecordType::Dropped: {
+        const auto appId = readUint8();
+        const auto app = mApplications.find(appId);
+        assert(app != mApplications.end());
+        const auto droppedType = readUint8();
+        app->second.dropped[droppedType] += readUint64();
+        break; }
+    case RecordType::Tracking: {
+        const auto appId = readUint8();
+        const auto app = mApplications.find(appId);
+        assert(app != mApplications.end());
+        const bool enabled = readUint8() != 0;
+        LOG("app {} tracking {}", appId, enabled ? "enabled" : "disabled");
+        if (enabled) {
+            // nothing is known about what happened while the application
+            // was dormant, a baseline of its mappings follows
+            app->second.mallocs.clear();
+            app->second.callsites.clear();
+            app->second.mallocSize = 0;
+            app->second.pageFaults.clear();
+            app->second.pageFaultSize = 0;
+            app->second.mmaps.clear();
+        }
+        break; }
+    case RecordType::HookStats: {
+        const auto appId = readUint8();
+        const auto app = mApplications.find(appId);
+        assert(app != mApplications.end());
+        // sent by the preload's own thread in nanoseconds since the start,
+        // the totals so far follow
+        advanceTimestamp(app->second, readUint64());
+        const auto size = readUint32();
+        auto& stats = app->second.hookStats;
+        stats.assign(size / sizeof(uint64_t), 0);
+        for (auto& counter : stats) {
+            counter = readUint64();
+        }
+        break; }
+    case RecordType::WorkingSet: {
+        const auto appId = readUint8();
+        const auto app = mApplications.find(appId);
+        assert(app != mApplications.end());
+        // sent by the preload's own thread in nanoseconds since the start,
+        // a mapping at a time over as many records as it takes, the last
+        // one of an interval is done
+        advanceTimestamp(app->second, readUint64());
+        const bool done = readUint8() != 0;
+        const auto size = readUint32();
+        const auto end = offset + size;
+        while (offset < end) {
+            const auto stackIdx = readStack(app->second);
+            const auto start = readUint64();
+            const auto mmapEnd = readUint64();
+            const uint64_t hot = readUint32() * Limits::PageSize;
+            const uint64_t cold = readUint32() * Limits::PageSize;
+            addWorkingSet(app->second, start, mmapEnd, stackIdx, hot, cold);
+        }
+        if (done)
+            emitWorkingSet(app->second, mLastTimestamp);
+        break; }
+    case RecordType::Exit: {
+        const auto appId = readUint8();
+        const auto app = mApplications.find(appId);
+        assert(app != mApplications.end());
+        app->second.exited = true;
         break; }
     case RecordType::Executable: {
         const auto appId = readUint8();
@@ -492,9 +1011,10 @@ void Parser::parsePacket(const uint8_t* data, uint32_t dataSize)
             break;
         case CommandType::Snapshot: {
             const auto snapshotTime = mLastTimestamp;
-            mLastSnapshot.time = snapshotTime;
+            mLastSnapshot.time = snapshotTime / 1000000;
             mLastSnapshot.pageFaultBytes = currentPageFaultBytes();
             mLastSnapshot.mallocBytes = currentMallocBytes();
+            triggerFlightRecorder("mtrack_snapshot");
             emitSnapshot(snapshotTime);
             const auto name = readHashableString();
             EMIT(mFileEmitter.emit(EmitType::SnapshotName, name));
@@ -518,6 +1038,18 @@ void Parser::parsePacket(const uint8_t* data, uint32_t dataSize)
         assert(app != mApplications.end());
         app->second.libraries.push_back(Library{ readString(), readUint64(), {} });
         break; }
+    case RecordType::LibraryUnload: {
+        const auto appId = readUint8();
+        const auto app = mApplications.find(appId);
+        assert(app != mApplications.end());
+        const auto addr = readUint64();
+        for (auto lib = app->second.libraries.rbegin(); lib != app->second.libraries.rend(); ++lib) {
+            if (lib->addr == addr && !lib->unloaded) {
+                unloadLibrary(app->second, *lib);
+                break;
+            }
+        }
+        break; }
     case RecordType::LibraryHeader: {
         const auto appId = readUint8();
         const auto app = mApplications.find(appId);
@@ -529,25 +1061,13 @@ void Parser::parsePacket(const uint8_t* data, uint32_t dataSize)
         const auto appId = readUint8();
         const auto app = mApplications.find(appId);
         assert(app != mApplications.end());
-        const uint32_t now = app->second.lastTimestamp = readUint32() - app->second.startTimestamp;
-        mLastTimestamp = app->second.lastTimestamp = now;
-        const auto place = readUint64();
+        const auto now = advanceTimestamp(app->second, readTimestamp(app->second, &app->second.pageFaultTimestamp));
+        // the preload can fill in several pages for one fault
+        const auto place = readUint64() & ~(Limits::PageSize - 1);
+        const auto pages = readUint32();
         const auto ptid = readUint32();
-        const auto [ stackIdx, stackInserted ] = readHashable(Hashable::Stack);
-        //EMIT(mFileEmitter.emit(EmitType::Stack, static_cast<uint32_t>(stackIdx)));
-        if (stackInserted) {
-            app->second.pendingStacks.insert(stackIdx);
-            // resolveStack(stackIdx);
-        }
-        auto it = std::lower_bound(app->second.pageFaults.begin(), app->second.pageFaults.end(), place, [](const auto& item, auto p) {
-            return item.place < p;
-        });
-        if (it != app->second.pageFaults.end() && it->place == place) {
-            // already got this fault?
-            break;
-        }
-        assert(it == app->second.pageFaults.end() || it->place > place);
-        app->second.pageFaults.insert(it, PageFault { place, ptid, stackIdx, now });
+        const auto stackIdx = readStack(app->second);
+        insertPageFault(app->second, PageFault { place, pages * Limits::PageSize, ptid, stackIdx, now });
         //EMIT(mFileEmitter.emit(EmitType::PageFault, static_cast<double>(place), ptid));
         break; }
     case RecordType::PageRemap: {
@@ -572,38 +1092,65 @@ void Parser::parsePacket(const uint8_t* data, uint32_t dataSize)
         const auto appId = readUint8();
         const auto app = mApplications.find(appId);
         assert(app != mApplications.end());
-        const uint32_t now = readUint32() - app->second.startTimestamp;
-        mLastTimestamp = app->second.lastTimestamp = now;
+        const bool nanoseconds = app->second.timestampMode == TimestampMode::Nanoseconds;
+        // the delta follows the thread id it's relative to
+        const uint64_t msTime = nanoseconds ? 0 : readTimestamp(app->second, nullptr);
         const auto addr = readUint64();
-        const auto size = readUint64();
+        const auto size = unsampledSize(readUint64(), app->second.sampleRate);
         const auto ptid = readUint32();
-        const auto [ stackIdx, stackInserted ] = readHashable(Hashable::Stack);
-        //EMIT(mFileEmitter.emit(EmitType::Stack, static_cast<uint32_t>(stackIdx)));
-        if (stackInserted) {
-            app->second.pendingStacks.insert(stackIdx);
-            // resolveStack(stackIdx);
-        } else {
-            // LOG("not inserted");
-        }
+        const auto now = advanceTimestamp(app->second, nanoseconds ? readTimestamp(app->second, &app->second.threadTimestamps[ptid]) : msTime);
+        const auto stackIdx = readStack(app->second);
         app->second.mallocs.insert(Malloc { addr, size, ptid, stackIdx, now });
         app->second.mallocSize += size;
         //printf("[%d] Found malloc(%zu) 0x%lx %ld [%ld] @ %d\n", appId, app->second.mallocs.size(), addr, size, app->second.mallocSize, now);
         //EMIT(mFileEmitter.emit(EmitType::Malloc, ptid));
         break; }
-    case RecordType::Free: {
+    case RecordType::Free:
+    case RecordType::SizedFree: {
         const auto appId = readUint8();
         const auto app = mApplications.find(appId);
         assert(app != mApplications.end());
         const auto addr = readUint64();
+        // sized operator delete
+        const uint64_t size = static_cast<RecordType>(type) == RecordType::SizedFree ? unsampledSize(readVarInt(), app->second.sampleRate) : 0;
+        if (app->second.timestampMode == TimestampMode::Nanoseconds) {
+            const auto ptid = readUint32();
+            advanceTimestamp(app->second, readTimestamp(app->second, &app->second.threadTimestamps[ptid]));
+        }
         auto it = app->second.mallocs.find(Malloc { addr, static_cast<uint64_t>(0), static_cast<uint32_t>(0), static_cast<int32_t>(0) });
         if (it != app->second.mallocs.end()) {
             assert(it->addr == addr);
+            if (size > 0 && size != it->size) {
+                ++app->second.sizeMismatches;
+            }
             app->second.mallocSize -= it->size;
             //EMIT(mFileEmitter.emit(EmitType::Malloc, static_cast<double>(app->second.mallocSize)));
             app->second.mallocs.erase(it);
             //printf("[%d] Found free(%zu) 0x%lx %ld [%ld]\n", appId, app->second.mallocs.size(), addr, it->size, app->second.mallocSize);
         }
         break; }
+    case RecordType::Aggregate: {
+        growth = true;
+        const auto appId = readUint8();
+        const auto app = mApplications.find(appId);
+        assert(app != mApplications.end());
+        // the aggregate is sent by the preload's own thread, always in
+        // nanoseconds since the start
+        advanceTimestamp(app->second, readUint64());
+        const auto size = readUint32();
+        const auto end = offset + size;
+        while (offset < end) {
+            const auto stackIdx = readStack(app->second);
+            const auto bytes = static_cast<int64_t>(readUint64());
+            const auto count = static_cast<int64_t>(readUint64());
+            const auto allocations = readUint64();
+            auto& callsite = app->second.callsites[stackIdx];
+            callsite.bytes += bytes;
+            callsite.count += count;
+            callsite.allocations += allocations;
+            app->second.mallocSize += bytes;
+        }
+        break; }
     case RecordType::Mmap: {
         const auto appId = readUint8();
         const auto app = mApplications.find(appId);
@@ -614,12 +1161,7 @@ void Parser::parsePacket(const uint8_t* data, uint32_t dataSize)
         const auto flags = readInt32();
         const auto ptid = readUint32();
         static_cast<void>(ptid);
-        const auto [ stackIdx, stackInserted ] = readHashable(Hashable::Stack);
-        //EMIT(mFileEmitter.emit(EmitType::Stack, static_cast<uint32_t>(stackIdx)));
-        if (stackInserted) {
-            app->second.pendingStacks.insert(stackIdx);
-            // resolveStack(stackIdx);
-        }
+        const auto stackIdx = readStack(app->second);
         app->second.mmaps.mmap(addr, size, prot, flags, stackIdx);
         //EMIT(mFileEmitter.emit(EmitType::Mmap, static_cast<double>(addr), static_cast<double>(size)));
         break; }
@@ -635,10 +1177,7 @@ void Parser::parsePacket(const uint8_t* data, uint32_t dataSize)
         const auto ptid = readUint64();
         static_cast<void>(flags);
         static_cast<void>(ptid);
-        const auto [ stackIdx, stackInserted ] = readHashable(Hashable::Stack);
-        if (stackInserted) {
-            app->second.pendingStacks.insert(stackIdx);
-        }
+        const auto stackIdx = readStack(app->second);
         app->second.mmaps.mremap(oldAddr, newAddr, oldSize, newSize, stackIdx);
         break; }
     case RecordType::Munmap: {
@@ -651,11 +1190,25 @@ void Parser::parsePacket(const uint8_t* data, uint32_t dataSize)
         app->second.mmaps.munmap(addr, size);
         removePageFaults(app->second, addr, addr + size);
         break; }
+    case RecordType::StackDefinition: {
+        const auto appId = readUint8();
+        const auto app = mApplications.find(appId);
+        assert(app != mApplications.end());
+        const auto id = readUint32();
+        const auto [ stackIdx, stackInserted ] = readHashable(Hashable::Stack);
+        if (stackInserted) {
+            app->second.pendingStacks.insert(stackIdx);
+        }
+        if (id >= app->second.stackIds.size()) {
+            app->second.stackIds.resize(id + 1, -1);
+        }
+        app->second.stackIds[id] = stackIdx;
+        break; }
     case RecordType::ThreadName: {
         const auto appId = readUint8();
         const auto ptid = readUint32();
         const auto name = readHashableString();
-        if(mOptions.appId & appId)
+        if(mOptions.includesApp(appId))
             EMIT(mFileEmitter.emit(EmitType::ThreadName, appId, ptid, name));
         break; }
     default:
@@ -671,19 +1224,22 @@ void Parser::parsePacket(const uint8_t* data, uint32_t dataSize)
     if (growth) {
         const uint64_t mallocBytes = currentMallocBytes();
         const uint64_t pageFaultBytes = currentPageFaultBytes();
-        if (mLastMemory.shouldSend(mLastTimestamp, mallocBytes, pageFaultBytes)) {
+        if (mLastMemory.shouldSend(mLastTimestamp / 1000000, mallocBytes, pageFaultBytes)) {
             // LOG("emitting memory");
-            EMIT(mFileEmitter.emit(EmitType::Memory, mLastTimestamp, static_cast<double>(mLastMemory.pageFaultBytes),
+            holdTimeline(mLastTimestamp);
+            EMIT(mFileEmitter.emit(EmitType::Memory, milliseconds(mLastTimestamp), static_cast<double>(mLastMemory.pageFaultBytes),
                                    static_cast<double>(mLastMemory.mallocBytes)));
+            releaseTimeline();
         }
 
-        if (mLastSnapshot.shouldSend(mLastTimestamp, mallocBytes, pageFaultBytes)) {
+        if (mLastSnapshot.shouldSend(mLastTimestamp / 1000000, mallocBytes, pageFaultBytes)) {
             emitSnapshot(mLastTimestamp);
         }
 
         if (mOptions.threshold > 0 && mallocBytes + pageFaultBytes >= mOptions.threshold) {
             std::lock_guard<std::mutex> lock(mMutex);
             mThreshold = true;
+            triggerFlightRecorder("threshold");
             emitSnapshot(mLastTimestamp);
         }
     }
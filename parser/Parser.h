@@ -7,11 +7,13 @@
 #include <common/Indexer.h>
 #include <common/MmapTracker.h>
 #include <common/RecordType.h>
+#include <atomic>
 #include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <cmath>
+#include <deque>
 #include <functional>
 #include <map>
 #include <mutex>
@@ -19,6 +21,7 @@
 #include <signal.h>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 
 struct Library
@@ -32,14 +35,17 @@ struct Library
     };
 
     std::vector<Header> headers;
+    bool unloaded {};
 };
 
+// one or more pages faulted in together, size is a multiple of the page size
 struct PageFault
 {
     uint64_t place {};
+    uint64_t size {};
     uint32_t ptid {};
     int32_t stack {};
-    uint32_t time {};
+    uint64_t time {};
 };
 
 struct Malloc
@@ -48,13 +54,54 @@ struct Malloc
     uint64_t size {};
     uint32_t ptid {};
     int32_t stack {};
-    uint32_t time {};
+    uint64_t time {};
+};
+
+// allocations of one call site in the aggregated mode, the preload only
+// sends the changes
+struct Callsite
+{
+    int64_t bytes {};
+    int64_t count {};
+    uint64_t allocations {};
+};
+
+// hot bytes were used in the last working set interval, cold ones are
+// resident but weren't
+struct WorkingSet
+{
+    uint64_t hot {};
+    uint64_t cold {};
 };
 
 struct ModuleEntry
 {
     uint64_t end {};
     Module* module {};
+    // added to an ip of the application to get the address in the load
+    // space the module's state was created for
+    uint64_t bias {};
+};
+
+// Modules are shared by all applications, a resolved address is keyed by
+// the module state and the rebased ip so that other applications mapping
+// the same library at a different address reuse it.
+struct ModuleAddress
+{
+    backtrace_state* state {};
+    uint64_t ip {};
+
+    bool operator==(const ModuleAddress& other) const
+    {
+        return state == other.state && ip == other.ip;
+    }
+};
+
+struct SharedAddress
+{
+    std::optional<Address<int32_t>> resolved;
+    // application addresses waiting for the resolver
+    std::vector<InstructionPointer> waiting;
 };
 
 struct Hashable
@@ -128,6 +175,15 @@ public:
     }
 };
 
+template<>
+struct hash<ModuleAddress>
+{
+public:
+    size_t operator()(const ModuleAddress& addr) const
+    {
+        return reinterpret_cast<size_t>(addr.state) ^ static_cast<size_t>(addr.ip);
+    }
+};
 
 } // namespace std
 
@@ -138,13 +194,43 @@ struct Application
     std::string exe;
     std::string cwd;
     std::vector<Library> libraries;
-    uint32_t startTimestamp {};
-    uint32_t lastTimestamp {};
+    // libraries that have been turned into modules
+    size_t librariesProcessed {};
+    TimestampMode timestampMode { TimestampMode::Milliseconds };
+    // CLOCK_MONOTONIC nanoseconds when the application started, 0 if the
+    // preload didn't say
+    uint64_t startTimestamp {};
+    // nanoseconds since startTimestamp
+    uint64_t lastTimestamp {};
+    // nanoseconds from the first application's start to this one's, the
+    // daemon puts all of them on the same timeline
+    uint64_t timeOffset {};
+    // bases for the deltas in TimestampMode::Nanoseconds, per writing thread
+    std::unordered_map<uint32_t, uint64_t> threadTimestamps;
+    uint64_t pageFaultTimestamp {};
+    uint64_t sampleRate {};
     uint64_t mallocSize {};
+    // sized operator delete calls with a different size than the allocation
+    uint64_t sizeMismatches {};
+    // the preload said goodbye, if it didn't the application crashed
+    bool exited {};
+    // records the preload dropped per RecordType, snapshots are only
+    // approximate once anything was
+    std::map<uint8_t, uint64_t> dropped;
+    // the latest HookStats totals, indexed by HookStats::Counter
+    std::vector<uint64_t> hookStats;
     MmapTracker mmaps;
+    // sorted on place, the ranges never overlap
     std::vector<PageFault> pageFaults;
+    uint64_t pageFaultSize {};
     std::unordered_set<Malloc> mallocs;
+    // keyed on the stack index
+    std::unordered_map<int32_t, Callsite> callsites;
+    // the working set interval the preload is in the middle of sending,
+    // keyed on the stack index
+    std::unordered_map<int32_t, WorkingSet> workingSet;
     std::unordered_set<int32_t> pendingStacks;
+    std::vector<int32_t> stackIds;
     std::map<uint64_t, ModuleEntry> moduleCache;
     std::vector<std::shared_ptr<Module>> modules;
 };
@@ -155,15 +241,23 @@ class Parser
 public:
     struct Options {
         std::string output;
-        uint8_t appId { 0xFF }; //all
+        // only the application with this id is written out, 0 is all
+        uint8_t appId { 0 };
         std::map<std::string, std::string> symbolMap;
         size_t fileSize { std::numeric_limits<size_t>::max() };
         size_t maxEventCount { std::numeric_limits<size_t>::max() };
         size_t resolverThreads { 2 };
         uint32_t timeSkipPerTimeStamp { 0 };
         uint64_t threshold { 0 };
+        // flight recorder, the output is only written when triggered and
+        // the Memory and Snapshot records are limited to the last seconds
+        // or bytes before that. 0 is no limit, both 0 is off.
+        uint64_t flightRecorderTime { 0 };
+        uint64_t flightRecorderSize { 0 };
         bool gzip { true };
         bool html { true };
+
+        bool includesApp(uint8_t id) const { return appId == 0 || appId == id; }
    };
     Parser(const Options& options);
     ~Parser();
@@ -176,16 +270,20 @@ public:
     uint64_t currentMallocBytes() const {
         uint64_t result = 0;
         for(auto app = mApplications.begin(); app != mApplications.end(); ++app) {
-            if(mOptions.appId & app->first)
+            if(mOptions.includesApp(app->first))
                 result += app->second.mallocSize;
         }
         return result;
     }
+    // kill -USR2, see Options::flightRecorderTime. Wakes up the parse
+    // thread, the dump happens after the packet it's busy with.
+    void requestFlightRecorderDump();
+
     uint64_t currentPageFaultBytes() const {
         uint64_t result = 0;
         for(auto app = mApplications.begin(); app != mApplications.end(); ++app) {
-            if(mOptions.appId & app->first)
-                result += app->second.pageFaults.size() * Limits::PageSize;
+            if(mOptions.includesApp(app->first))
+                result += app->second.pageFaultSize;
         }
         return result;
     }
@@ -196,7 +294,18 @@ private:
     Frame<int32_t> convertFrame(Frame<std::string> &&frame);
     void emitStack(Application &app, int32_t idx);
     void emitAddress(Address<std::string> &&addr);
-    void emitSnapshot(uint32_t now);
+    void emitStackAddr(const InstructionPointer& ip, const Address<int32_t>& addr);
+    void emitSnapshot(uint64_t now);
+    void emitWorkingSet(Application& app, uint64_t now);
+
+    bool flightRecorderEnabled() const { return mOptions.flightRecorderTime > 0 || mOptions.flightRecorderSize > 0; }
+    void holdTimeline(uint64_t now);
+    void releaseTimeline();
+    void triggerFlightRecorder(const char* reason);
+    void checkFlightRecorderRequest();
+    void replaceApplication(uint8_t appId);
+    void unloadLibrary(Application& app, Library& lib);
+    void openOutput();
 
     static std::string visualizerDirectory();
     static std::string readFile(const std::string& fn);
@@ -211,9 +320,17 @@ private:
     Indexer<Hashable> mHashIndexer;
     Indexer<std::string> mStringIndexer;
     std::unordered_map<InstructionPointer, std::optional<Address<int32_t>>> mAddressCache;
+    std::unordered_map<ModuleAddress, SharedAddress> mModuleAddresses;
+    // addresses handed to the resolver and the module addresses they
+    // resolve, in the order they were handed over. A recycled appId can
+    // ask for the same address again before the old answer is back.
+    std::unordered_map<InstructionPointer, std::deque<ModuleAddress>> mResolving;
     std::mutex mResolvedAddressesMutex;
     std::vector<Address<std::string>> mResolvedAddresses;
-    uint32_t mLastTimestamp {};
+    // nanoseconds since the first application started
+    uint64_t mLastTimestamp {};
+    // CLOCK_MONOTONIC nanoseconds when the first application started
+    uint64_t mStartTimestamp {};
     size_t mStacksResolved {};
 
     struct {
@@ -227,12 +344,13 @@ private:
         uint32_t peakThreshold { 2500 };
         double upThreshold { 0.2 };
         double downThreshold { 0.05 };
-        uint32_t time {};
-        uint32_t downTime {};
-        uint32_t peakTime {};
+        // milliseconds
+        uint64_t time {};
+        uint64_t downTime {};
+        uint64_t peakTime {};
         uint64_t peakBytes {};
         int64_t combinedBytes() const { return mallocBytes + pageFaultBytes; }
-        bool shouldSend(uint32_t now, uint64_t mallocSize, uint64_t pageFaultSize)
+        bool shouldSend(uint64_t now, uint64_t mallocSize, uint64_t pageFaultSize)
         {
             if (!enabled) {
                 return false;
@@ -281,6 +399,22 @@ private:
     FILE* mFile {};
     FileEmitter mFileEmitter;
 
+    // What the flight recorder holds back. Definitions (stacks, thread
+    // names, applications) are needed by everything after them and are
+    // always kept, the timeline is pruned to the configured window.
+    struct FlightRecord
+    {
+        uint64_t time {};
+        std::vector<uint8_t> data;
+    };
+    struct {
+        bool holding {};
+        std::vector<uint8_t> definitions;
+        std::deque<FlightRecord> timeline;
+        size_t timelineBytes {};
+    } mFlightRecorder;
+    std::atomic<bool> mFlightRecorderRequested {};
+
     std::thread mThread;
     std::mutex mMutex;
     std::condition_variable mCond;
@@ -103,9 +103,9 @@ void ResolverThread::run()
             dest.aid = unresolved.aid;
             dest.ip = unresolved.ip;
             if(unresolved.state->fileline_fn)
-                unresolved.state->fileline_fn(unresolved.state, unresolved.ip, backtrace_callback, backtrace_errorCallback, &dest);
+                unresolved.state->fileline_fn(unresolved.state, unresolved.moduleIp, backtrace_callback, backtrace_errorCallback, &dest);
             if (unresolved.state->syminfo_fn && dest.frame.function.empty())
-                unresolved.state->syminfo_fn(unresolved.state, unresolved.ip, backtrace_symInfoCallback, backtrace_errorCallback, &dest);
+                unresolved.state->syminfo_fn(unresolved.state, unresolved.moduleIp, backtrace_symInfoCallback, backtrace_errorCallback, &dest);
         }
         mParser->onResolvedAddresses(std::move(resolved));
     }
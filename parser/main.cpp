@@ -1,6 +1,7 @@
 #include "Args.h"
 #include "Logger.h"
 #include "Parser.h"
+#include <common/ShmRings.h>
 #include <climits>
 #include <cassert>
 #include <cstdint>
@@ -8,9 +9,18 @@
 #include <cstring>
 #include <ctime>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include <atomic>
+#include <deque>
+#include <thread>
 
 #ifndef PIPE_BUF
 #define PIPE_BUF 4096
@@ -25,6 +35,9 @@ struct Options : public Parser::Options
 {
     std::string input;
     std::string dumpFile;
+    std::string daemonSocket;
+    int shmFd { -1 };
+    int eventFd { -1 };
     bool packetMode {};
 };
 
@@ -56,6 +69,329 @@ uint64_t parseSize(const char* str, bool* okptr = nullptr)
     return arg;
 }
 
+// The producer that took the sequence the parser is waiting for might have
+// died before publishing it. Returns true if the rings should be scanned
+// again, either because the sequence was skipped or because it showed up.
+static bool skipDeadProducer(ShmRings& rings, uint64_t& sequence)
+{
+    auto header = rings.header();
+    auto ringOwner = [&rings, header](uint32_t idx) {
+        return idx == 0
+            ? header->sharedOwner.load(std::memory_order_relaxed)
+            : rings.ring(idx)->owner.load(std::memory_order_relaxed);
+    };
+    // A producer that died taking a sequence doesn't say which one. If no
+    // ring names the sequence and nobody alive is taking one it was that.
+    bool reserving = false;
+    for (uint32_t idx = 0; idx < rings.numRings(); ++idx) {
+        auto ring = rings.ring(idx);
+        uint64_t pending = ring->pending.load(std::memory_order_acquire);
+        const uint32_t owner = ringOwner(idx);
+        const bool alive = owner != 0 && !ShmRings::ownerDead(owner);
+        if (pending == ShmRings::Reserving) {
+            reserving = reserving || alive;
+            continue;
+        }
+        if (pending != sequence + 1)
+            continue;
+        if (alive)
+            return false;
+        // it could have published right before it died
+        ShmRings::PacketHeader hdr;
+        if (rings.peek(idx, &hdr) && hdr.sequence == sequence)
+            return true;
+        // whoever takes the ring over doesn't have to fill in for it now
+        ring->pending.compare_exchange_strong(pending, 0, std::memory_order_relaxed);
+        LOG("shm producer {} died before publishing sequence {}", owner, sequence);
+        ++sequence;
+        return true;
+    }
+    if (reserving)
+        return false;
+    for (uint32_t idx = 0; idx < rings.numRings(); ++idx) {
+        ShmRings::PacketHeader hdr;
+        if (rings.peek(idx, &hdr) && hdr.sequence == sequence)
+            return true;
+    }
+    LOG("shm producer died taking sequence {}", sequence);
+    ++sequence;
+    return true;
+}
+
+// Merges the per-thread rings of the shared memory transport back into
+// sequence order and hands each packet to func until the preload closes
+// the pipe or func returns false.
+template<typename Func>
+void readShm(int shmFd, int eventFd, int pipeFd, Func&& func)
+{
+    struct stat st;
+    if (fstat(shmFd, &st) == -1) {
+        LOG("unable to stat shm fd {}", shmFd);
+        return;
+    }
+    void* mem = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+    if (mem == MAP_FAILED) {
+        LOG("unable to map shm fd {}", shmFd);
+        return;
+    }
+
+    ShmRings rings;
+    if (!rings.attach(mem, st.st_size)) {
+        LOG("invalid shm rings");
+        ::munmap(mem, st.st_size);
+        return;
+    }
+
+    auto header = rings.header();
+    uint8_t packet[PIPE_BUF];
+    uint64_t sequence = 0;
+    uint32_t stalls = 0;
+    bool hungUp = false;
+
+    for (;;) {
+        bool progressed = false;
+        uint64_t lowest = std::numeric_limits<uint64_t>::max();
+        for (uint32_t idx = 0; idx < rings.numRings(); ++idx) {
+            ShmRings::PacketHeader hdr;
+            while (rings.peek(idx, &hdr)) {
+                if (hdr.sequence > sequence) {
+                    lowest = std::min(lowest, hdr.sequence);
+                    break;
+                }
+                if (hdr.size > sizeof(packet)) {
+                    LOG("shm packet too large {} vs {}\n", hdr.size, sizeof(packet));
+                    abort();
+                }
+                rings.read(idx, hdr, packet);
+                if (hdr.sequence == sequence) {
+                    ++sequence;
+                } else {
+                    // its gap was skipped already, it would block the ring otherwise
+                    LOG("shm sequence {} arrived after {}", hdr.sequence, sequence);
+                }
+                progressed = true;
+                // takes the place of a packet whose producer died
+                if (hdr.size == 0)
+                    continue;
+                if (!func(packet, hdr.size)) {
+                    ::munmap(mem, st.st_size);
+                    return;
+                }
+            }
+        }
+        if (progressed) {
+            stalls = 0;
+            continue;
+        }
+
+        const bool pending = lowest != std::numeric_limits<uint64_t>::max();
+        if (pending && hungUp) {
+            // nobody is left to publish the missing sequences
+            LOG("shm sequence gap {} -> {}", sequence, lowest);
+            sequence = lowest;
+            continue;
+        }
+        // a producer that's merely slow is waited for however long it takes
+        if (pending && stalls > 0 && skipDeadProducer(rings, sequence)) {
+            stalls = 0;
+            continue;
+        }
+        if (hungUp) {
+            break;
+        }
+
+        header->consumerWaiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // a producer might have published between the scan and us announcing
+        // that we're about to sleep
+        bool ready = false;
+        for (uint32_t idx = 0; idx < rings.numRings() && !ready; ++idx) {
+            ShmRings::PacketHeader hdr;
+            ready = rings.peek(idx, &hdr) && hdr.sequence == sequence;
+        }
+        if (ready) {
+            header->consumerWaiting.store(0, std::memory_order_relaxed);
+            continue;
+        }
+
+        pollfd evt[] = {
+            { .fd = eventFd, .events = POLLIN, .revents = 0 },
+            { .fd = pipeFd, .events = POLLIN, .revents = 0 }
+        };
+        int r;
+        EINTRWRAP(r, ::poll(evt, 2, pending ? 1 : 100));
+        header->consumerWaiting.store(0, std::memory_order_relaxed);
+        if (r == -1) {
+            LOG("shm poll failed {}", errno);
+            break;
+        }
+        // producers waiting for space keep waking us up, a timeout isn't
+        // needed to count as stalled
+        stalls = pending ? stalls + 1 : 0;
+
+        if (evt[0].revents & POLLIN) {
+            uint64_t value;
+            [[maybe_unused]] const auto e = ::read(eventFd, &value, sizeof(value));
+        }
+        if (evt[1].revents & (POLLIN | POLLHUP)) {
+            // nothing but the shutdown is expected on the pipe in shm mode
+            ssize_t p;
+            EINTRWRAP(p, ::read(pipeFd, packet, sizeof(packet)));
+            if (p <= 0) {
+                hungUp = true;
+            } else if (!func(packet, static_cast<uint32_t>(p))) {
+                break;
+            }
+        }
+    }
+
+    ::munmap(mem, st.st_size);
+}
+
+// Accepts preloads on a unix socket and hands every packet to func until
+// SIGINT or SIGTERM. Each connection gets its own appId so that one parser
+// can hold many applications. SIGINT and SIGTERM have to be blocked by the
+// caller.
+//
+// There are only 253 appIds to go around, forked children take one each as
+// well. An id comes back when the connection its packets came through is
+// gone, an Exit isn't enough since a failed exec carries on after it. The
+// parser replaces the application that had it. A forked child writes to
+// its parent's connection so its id is held until the parent's is closed.
+// Past 253 at the same time new processes are refused and forked children
+// are reported as their parent.
+template<typename Func>
+void readDaemon(const std::string& path, Func&& func)
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        LOG("daemon socket path too long {}", path);
+        return;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    const int signalFd = ::signalfd(-1, &mask, SFD_CLOEXEC);
+    if (signalFd == -1) {
+        LOG("unable to create signalfd {}", errno);
+        return;
+    }
+
+    const int listenFd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listenFd == -1) {
+        LOG("unable to create daemon socket {}", errno);
+        ::close(signalFd);
+        return;
+    }
+    ::unlink(path.c_str());
+    if (::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 || ::listen(listenFd, SOMAXCONN) == -1) {
+        LOG("unable to listen on {} {}", path, errno);
+        ::close(listenFd);
+        ::close(signalFd);
+        return;
+    }
+    LOG("daemon listening on {}", path);
+
+    // 1 and 2 are the ids of standalone ELF and WASM applications. Freed ids
+    // are handed out again oldest first, whatever the parser still has to
+    // resolve for the previous application is long done by then.
+    std::deque<uint8_t> freeAppIds;
+    for (uint32_t id = 3; id <= UINT8_MAX; ++id) {
+        freeAppIds.push_back(static_cast<uint8_t>(id));
+    }
+    bool appIdsInUse[UINT8_MAX + 1] {};
+    auto releaseAppId = [&](uint8_t appId) {
+        if (appIdsInUse[appId]) {
+            appIdsInUse[appId] = false;
+            freeAppIds.push_back(appId);
+        }
+    };
+    std::vector<pollfd> fds = {
+        { .fd = listenFd, .events = POLLIN, .revents = 0 },
+        { .fd = signalFd, .events = POLLIN, .revents = 0 }
+    };
+    // per entry in fds, the applications whose packets come through it.
+    // A forked child writes to its parent's connection, the one it got its
+    // id from is closed right away.
+    std::vector<std::vector<uint8_t>> connectionApps(fds.size());
+    uint8_t packet[PIPE_BUF];
+    bool done = false;
+    int e;
+
+    while (!done) {
+        int r;
+        EINTRWRAP(r, ::poll(fds.data(), fds.size(), -1));
+        if (r == -1) {
+            LOG("daemon poll failed {}", errno);
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            LOG("daemon shutting down");
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            EINTRWRAP(fd, ::accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC));
+            if (fd != -1) {
+                // 0 tells the preload that we're out of ids
+                uint8_t appId = 0;
+                if (!freeAppIds.empty()) {
+                    appId = freeAppIds.front();
+                    freeAppIds.pop_front();
+                    appIdsInUse[appId] = true;
+                } else {
+                    LOG("daemon is out of appIds, refusing a connection. At most {} applications can be tracked at the same time", UINT8_MAX - 2);
+                }
+                EINTRWRAP(r, ::write(fd, &appId, sizeof(appId)));
+                if (appId != 0 && r == sizeof(appId)) {
+                    LOG("daemon accepted app {}", appId);
+                    fds.push_back({ .fd = fd, .events = POLLIN, .revents = 0 });
+                    connectionApps.emplace_back();
+                } else {
+                    if (appId != 0)
+                        releaseAppId(appId);
+                    EINTRWRAP(e, ::close(fd));
+                }
+            }
+        }
+        for (size_t idx = 2; idx < fds.size() && !done;) {
+            if (!(fds[idx].revents & (POLLIN | POLLHUP | POLLERR))) {
+                ++idx;
+                continue;
+            }
+            ssize_t p;
+            EINTRWRAP(p, ::read(fds[idx].fd, packet, sizeof(packet)));
+            if (p > 0) {
+                auto& apps = connectionApps[idx];
+                if (p >= 2 && packet[0] == static_cast<uint8_t>(RecordType::Start)) {
+                    apps.push_back(packet[1]);
+                } else if (p >= 3 && packet[0] == static_cast<uint8_t>(RecordType::Fork)) {
+                    apps.push_back(packet[2]);
+                }
+                done = !func(packet, static_cast<uint32_t>(p));
+                ++idx;
+            } else {
+                // everything that wrote to it is gone
+                for (const uint8_t appId : connectionApps[idx]) {
+                    releaseAppId(appId);
+                }
+                EINTRWRAP(e, ::close(fds[idx].fd));
+                fds.erase(fds.begin() + idx);
+                connectionApps.erase(connectionApps.begin() + idx);
+            }
+        }
+    }
+
+    for (const auto& fd : fds) {
+        EINTRWRAP(e, ::close(fd.fd));
+    }
+    ::unlink(path.c_str());
+}
+
 bool parse(Options &&options)
 {
     bool threshold = false;
@@ -87,7 +423,36 @@ bool parse(Options &&options)
     if (!options.packetMode && options.timeSkipPerTimeStamp == 0) {
         options.timeSkipPerTimeStamp = 100;
     }
+    if (!options.daemonSocket.empty()) {
+        // the signals are read from a signalfd, the parser threads have to
+        // inherit the mask
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    }
+    // kill -USR2 writes out what the flight recorder has. A handler can't
+    // wake the parse thread so a thread of its own waits for the signal,
+    // everyone else has to have it blocked.
+    const bool flightRecorder = options.flightRecorderTime > 0 || options.flightRecorderSize > 0;
+    sigset_t usr2;
+    sigemptyset(&usr2);
+    sigaddset(&usr2, SIGUSR2);
+    if (flightRecorder) {
+        pthread_sigmask(SIG_BLOCK, &usr2, nullptr);
+    }
     Parser parser(options);
+    std::atomic<bool> stopSignalThread {};
+    std::thread signalThread;
+    if (flightRecorder) {
+        signalThread = std::thread([&]() {
+            int sig;
+            while (sigwait(&usr2, &sig) == 0 && !stopSignalThread.load(std::memory_order_relaxed)) {
+                parser.requestFlightRecorderDump();
+            }
+        });
+    }
 
     // mFileSize = size;
     // mMaxEvents = maxEvents;
@@ -98,53 +463,80 @@ bool parse(Options &&options)
     size_t totalRead = 0;
     uint32_t packetSize;
     uint8_t packet[PIPE_BUF];
-    size_t eventIdx;
-    for (eventIdx = 0; eventIdx<options.maxEventCount; ++eventIdx) {
-        if (options.packetMode) {
-            packetSize = ::read(infd, packet, PIPE_BUF);
-            LOG("got packet {}", packetSize);
-
-            if (!packetSize) {
-                break;
-            }
-            totalRead += packetSize;
-
+    size_t eventIdx = 0;
+    if (!options.daemonSocket.empty()) {
+        readDaemon(options.daemonSocket, [&](const uint8_t* daemonPacket, uint32_t daemonPacketSize) {
+            totalRead += daemonPacketSize;
             if (outfile) {
-                ::fwrite(&packetSize, sizeof(packetSize), 1, outfile);
-                ::fwrite(packet, packetSize, 1, outfile);
-                continue;
-            }
-        } else {
-            ssize_t r;
-            EINTRWRAP(r, ::read(infd, &packetSize, sizeof(packetSize)));
-            if (r == 0) {
-                LOG("EOF");
-                break;
+                ::fwrite(&daemonPacketSize, sizeof(daemonPacketSize), 1, outfile);
+                ::fwrite(daemonPacket, daemonPacketSize, 1, outfile);
+            } else {
+                // there's no single process to stop at the threshold
+                parser.feed(daemonPacket, daemonPacketSize);
             }
-            if (r != sizeof(packetSize)) {
-                LOG("read ps size != than {}, {}\n", sizeof(packetSize), r);
-                abort();
-            }
-            if (packetSize > PIPE_BUF) {
-                LOG("packet too large {} vs {}\n", packetSize, PIPE_BUF);
-                abort();
+            return ++eventIdx < options.maxEventCount;
+        });
+    } else if (options.shmFd != -1) {
+        readShm(options.shmFd, options.eventFd, infd, [&](const uint8_t* shmPacket, uint32_t shmPacketSize) {
+            totalRead += shmPacketSize;
+            if (outfile) {
+                ::fwrite(&shmPacketSize, sizeof(shmPacketSize), 1, outfile);
+                ::fwrite(shmPacket, shmPacketSize, 1, outfile);
+            } else if (!parser.feed(shmPacket, shmPacketSize)) {
+                // threshold reached
+                threshold = true;
+                return false;
             }
-            totalRead += r;
-            EINTRWRAP(r, ::read(infd, packet, packetSize));
-            if (r != static_cast<ssize_t>(packetSize)) {
-                LOG("packet mismatch {} {} @ {}", r, packetSize, totalRead);
-                break;
+            return ++eventIdx < options.maxEventCount;
+        });
+    } else {
+        for (; eventIdx<options.maxEventCount; ++eventIdx) {
+            if (options.packetMode) {
+                packetSize = ::read(infd, packet, PIPE_BUF);
+                LOG("got packet {}", packetSize);
+
+                if (!packetSize) {
+                    break;
+                }
+                totalRead += packetSize;
+
+                if (outfile) {
+                    ::fwrite(&packetSize, sizeof(packetSize), 1, outfile);
+                    ::fwrite(packet, packetSize, 1, outfile);
+                    continue;
+                }
+            } else {
+                ssize_t r;
+                EINTRWRAP(r, ::read(infd, &packetSize, sizeof(packetSize)));
+                if (r == 0) {
+                    LOG("EOF");
+                    break;
+                }
+                if (r != sizeof(packetSize)) {
+                    LOG("read ps size != than {}, {}\n", sizeof(packetSize), r);
+                    abort();
+                }
+                if (packetSize > PIPE_BUF) {
+                    LOG("packet too large {} vs {}\n", packetSize, PIPE_BUF);
+                    abort();
+                }
+                totalRead += r;
+                EINTRWRAP(r, ::read(infd, packet, packetSize));
+                if (r != static_cast<ssize_t>(packetSize)) {
+                    LOG("packet mismatch {} {} @ {}", r, packetSize, totalRead);
+                    break;
+                }
+                if (packetSize > 0 && (packet[0] == static_cast<uint8_t>(RecordType::Invalid) || packet[0] > static_cast<uint8_t>(RecordType::Max))) {
+                    LOG("invalid packet? {}", packet[0]);
+                    break;
+                }
+                totalRead += r;
             }
-            if (packetSize > 0 && (packet[0] == static_cast<uint8_t>(RecordType::Invalid) || packet[0] > static_cast<uint8_t>(RecordType::Max))) {
-                LOG("invalid packet? {}", packet[0]);
+            if (!parser.feed(packet, packetSize)) {
+                // threshold reached
+                threshold = true;
                 break;
             }
-            totalRead += r;
-        }
-        if (!parser.feed(packet, packetSize)) {
-            // threshold reached
-            threshold = true;
-            break;
         }
     }
 
@@ -164,6 +556,12 @@ bool parse(Options &&options)
     //         parser.stringCount(), parser.stringHits(), parser.stringMisses(),
     //         parser.stackCount(), parser.stackHits(), parser.stackMisses());
 
+    if (signalThread.joinable()) {
+        stopSignalThread.store(true, std::memory_order_relaxed);
+        pthread_kill(signalThread.native_handle(), SIGUSR2);
+        signalThread.join();
+    }
+
     return !threshold;
 }
 } // anonymous namespace
@@ -184,6 +582,15 @@ int main(int argc, char** argv)
         options.packetMode = args.value<bool>("packet-mode");
     }
 
+    if (args.has<std::string>("daemon")) {
+        options.daemonSocket = args.value<std::string>("daemon");
+    }
+
+    if (args.has<int32_t>("shm-fd") && args.has<int32_t>("event-fd")) {
+        options.shmFd = args.value<int32_t>("shm-fd");
+        options.eventFd = args.value<int32_t>("event-fd");
+    }
+
     if (args.has<std::string>("log-file")) {
         Logger::create(args.value<std::string>("log-file"));
     }
@@ -220,21 +627,31 @@ int main(int argc, char** argv)
         options.threshold = parseSize(args.value<std::string>("threshold").c_str());
     }
 
+    if (args.has<int64_t>("flight-recorder")) {
+        options.flightRecorderTime = args.value<int64_t>("flight-recorder");
+    }
+
+    if (args.has<std::string>("flight-recorder-size")) {
+        options.flightRecorderSize = parseSize(args.value<std::string>("flight-recorder-size").c_str());
+    }
+
     pid_t pid = 0;
     if (args.has<pid_t>("pid")) {
         pid = args.value<pid_t>("pid");
     }
+    // name the daemon's output after the daemon itself
+    const pid_t outputPid = pid == 0 && !options.daemonSocket.empty() ? getpid() : pid;
 
     if (args.has<std::string>("output")) {
         options.output = args.value<std::string>("output");
     } else {
         char buf[128];
         if (options.html) {
-            snprintf(buf, sizeof(buf), "mtrackp.%u.html", pid);
+            snprintf(buf, sizeof(buf), "mtrackp.%u.html", outputPid);
         } else if (options.gzip) {
-            snprintf(buf, sizeof(buf), "mtrackp.%u.out.gz", pid);
+            snprintf(buf, sizeof(buf), "mtrackp.%u.out.gz", outputPid);
         } else {
-            snprintf(buf, sizeof(buf), "mtrackp.%u.out", pid);
+            snprintf(buf, sizeof(buf), "mtrackp.%u.out", outputPid);
         }
         options.output = buf;
     }
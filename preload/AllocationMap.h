@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Lock free open addressing map from live allocations to the stack id and
+// size they were allocated with, so that a free can be charged to the right
+// call site without talking to the parser. Like PointerSet the storage is
+// handed in by the caller and has to be zero filled.
+class AllocationMap
+{
+public:
+    AllocationMap(void* mem, size_t capacity);
+
+    static size_t mappingSize(size_t capacity);
+
+    bool insert(uintptr_t ptr, uint32_t stack, uint64_t size);
+    bool remove(uintptr_t ptr, uint32_t* stack, uint64_t* size);
+
+private:
+    size_t slot(uintptr_t ptr) const;
+
+    enum : uintptr_t { Empty = 0, Tombstone = 1 };
+    enum { MaxProbes = 64 };
+
+    // stack and size are only read by whoever frees ptr, and that can't
+    // happen before the allocation was returned, so they don't need to be
+    // published together with the pointer
+    struct Entry
+    {
+        std::atomic<uintptr_t> ptr;
+        std::atomic<uint32_t> stack;
+        std::atomic<uint64_t> size;
+    };
+
+    Entry* mEntries { nullptr };
+    size_t mMask { 0 };
+};
+
+inline AllocationMap::AllocationMap(void* mem, size_t capacity)
+    : mEntries(static_cast<Entry*>(mem)), mMask(capacity - 1)
+{
+}
+
+inline size_t AllocationMap::mappingSize(size_t capacity)
+{
+    return capacity * sizeof(Entry);
+}
+
+inline size_t AllocationMap::slot(uintptr_t ptr) const
+{
+    // malloc pointers are at least 16 byte aligned
+    return static_cast<size_t>((static_cast<uint64_t>(ptr >> 4) * 0x9E3779B97F4A7C15ull) >> 20) & mMask;
+}
+
+inline bool AllocationMap::insert(uintptr_t ptr, uint32_t stack, uint64_t size)
+{
+    const size_t start = slot(ptr);
+    for (size_t i = 0; i < MaxProbes; ++i) {
+        auto& e = mEntries[(start + i) & mMask];
+        uintptr_t cur = e.ptr.load(std::memory_order_relaxed);
+        if ((cur == Empty || cur == Tombstone)
+            && e.ptr.compare_exchange_strong(cur, ptr, std::memory_order_relaxed)) {
+            e.stack.store(stack, std::memory_order_relaxed);
+            e.size.store(size, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool AllocationMap::remove(uintptr_t ptr, uint32_t* stack, uint64_t* size)
+{
+    const size_t start = slot(ptr);
+    for (size_t i = 0; i < MaxProbes; ++i) {
+        auto& e = mEntries[(start + i) & mMask];
+        uintptr_t cur = e.ptr.load(std::memory_order_relaxed);
+        if (cur == Empty)
+            return false;
+        if (cur == ptr) {
+            *stack = e.stack.load(std::memory_order_relaxed);
+            *size = e.size.load(std::memory_order_relaxed);
+            return e.ptr.compare_exchange_strong(cur, Tombstone, std::memory_order_relaxed);
+        }
+    }
+    return false;
+}
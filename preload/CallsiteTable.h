@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Per call site allocation counters for the aggregated mode, indexed by
+// the ids handed out by StackTable. The counters are deltas since the last
+// flush, the parser adds them up. The storage is handed in by the caller and
+// has to be zero filled, only the pages of stacks that allocate get touched.
+class CallsiteTable
+{
+public:
+    CallsiteTable(void* mem, size_t capacity);
+
+    static size_t mappingSize(size_t capacity);
+
+    // stack ids beyond the capacity can't be counted
+    bool contains(uint32_t stack) const { return stack < mCapacity; }
+
+    void allocated(uint32_t stack, uint64_t size);
+    void freed(uint32_t stack, uint64_t size);
+
+    // Calls func(stack, bytes, count, allocations) for every call site up
+    // to and including maxStack that changed since the last flush and
+    // resets it.
+    template<typename Func>
+    void flush(uint32_t maxStack, Func&& func);
+
+private:
+    struct Entry
+    {
+        std::atomic<int64_t> bytes;
+        std::atomic<int64_t> count;
+        std::atomic<uint64_t> allocations;
+    };
+
+    Entry* mEntries { nullptr };
+    size_t mCapacity { 0 };
+};
+
+inline CallsiteTable::CallsiteTable(void* mem, size_t capacity)
+    : mEntries(static_cast<Entry*>(mem)), mCapacity(capacity)
+{
+}
+
+inline size_t CallsiteTable::mappingSize(size_t capacity)
+{
+    return capacity * sizeof(Entry);
+}
+
+inline void CallsiteTable::allocated(uint32_t stack, uint64_t size)
+{
+    auto& e = mEntries[stack];
+    e.bytes.fetch_add(static_cast<int64_t>(size), std::memory_order_relaxed);
+    e.count.fetch_add(1, std::memory_order_relaxed);
+    e.allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void CallsiteTable::freed(uint32_t stack, uint64_t size)
+{
+    auto& e = mEntries[stack];
+    e.bytes.fetch_sub(static_cast<int64_t>(size), std::memory_order_relaxed);
+    e.count.fetch_sub(1, std::memory_order_relaxed);
+}
+
+template<typename Func>
+inline void CallsiteTable::flush(uint32_t maxStack, Func&& func)
+{
+    const size_t end = maxStack < mCapacity ? maxStack + 1 : mCapacity;
+    for (size_t i = 0; i < end; ++i) {
+        auto& e = mEntries[i];
+        // an allocation and its free in the same interval leave bytes and
+        // count at 0 but are still churn
+        if (e.allocations.load(std::memory_order_relaxed) == 0 && e.count.load(std::memory_order_relaxed) == 0)
+            continue;
+        const uint64_t allocations = e.allocations.exchange(0, std::memory_order_relaxed);
+        const int64_t bytes = e.bytes.exchange(0, std::memory_order_relaxed);
+        const int64_t count = e.count.exchange(0, std::memory_order_relaxed);
+        if (allocations == 0 && bytes == 0 && count == 0)
+            continue;
+        func(static_cast<uint32_t>(i), bytes, count, allocations);
+    }
+}
@@ -1,12 +1,17 @@
 #pragma once
 
 #include "NoHook.h"
+#include "ShmTransport.h"
 #include "Spinlock.h"
 #include <common/Emitter.h>
+#include <common/HookStats.h>
+#include <common/RecordType.h>
 #include <atomic>
+#include <cerrno>
 #include <climits>
 #include <cstdint>
 #include <cstdio>
+#include <poll.h>
 #include <unistd.h>
 
 #ifndef PIPE_BUF
@@ -16,9 +21,24 @@
 class PipeEmitter : public Emitter
 {
 public:
+    // Droppable packets are thrown away instead of waiting for the parser
+    // when the transport is full and the overload policy is Drop. They have
+    // to start with their RecordType and appId.
+    enum class Delivery {
+        Always,
+        Droppable
+    };
+
+    // With Drop the pipe has to be non-blocking, packets that always have
+    // to be delivered poll for space instead.
+    enum class OverloadPolicy {
+        Block,
+        Drop
+    };
+
     PipeEmitter() = default;
-    PipeEmitter(int pipe)
-        : mPipe(pipe)
+    PipeEmitter(int pipe, Delivery delivery = Delivery::Always)
+        : mPipe(pipe), mDelivery(delivery)
     {
     }
 
@@ -27,28 +47,142 @@ public:
         mPipe = pipe;
     }
 
+    // when set, packets go to the shared memory rings instead of the pipe
+    static void setShmTransport(ShmTransport* transport)
+    {
+        sShmTransport = transport;
+    }
+
+    static void setOverloadPolicy(OverloadPolicy policy)
+    {
+        sOverloadPolicy = policy;
+    }
+
+    // MTRACK_STATS, counts the packets and the time spent writing them
+    static void setHookStats(HookStats* stats)
+    {
+        sHookStats = stats;
+    }
+
     virtual void writeBytes(const void* data, size_t size, WriteType type) override;
 
+    // whether the last packet was dropped, timestamp deltas have to start
+    // over from an absolute one after that
+    bool dropped() const { return mDropped; }
+
 private:
+    bool write(bool droppable);
+    void drop();
+    void sendDrops(uint8_t appId);
+
+    // PIPE_BUF sized per thread scratch buffer, defined in Preload.cpp. The
+    // emitters on a thread can nest (stack definitions are sent while the
+    // arguments of the record referring to them are evaluated) but each
+    // packet is completed before the next one starts so they can share it.
+    static uint8_t* threadBuffer();
+
+    static inline ShmTransport* sShmTransport = nullptr;
+    static inline OverloadPolicy sOverloadPolicy = OverloadPolicy::Block;
+    static inline HookStats* sHookStats = nullptr;
+    // per RecordType, sent as Dropped records once there's room again
+    static inline std::atomic<uint64_t> sDropped[static_cast<size_t>(RecordType::Max) + 1] {};
+    static inline std::atomic<bool> sDropsPending = false;
+
     NoHook mNoHook;
     int mPipe { -1 };
+    Delivery mDelivery { Delivery::Always };
+    bool mDropped { false };
 
-    uint8_t mBuf[PIPE_BUF];
+    uint8_t* mBuf { threadBuffer() };
     size_t mOffset { 0 };
 };
 
 void PipeEmitter::writeBytes(const void* data, size_t size, WriteType type)
 {
-    if (mOffset + size > sizeof(mBuf)) {
-        fprintf(stderr, "packet too large %zu (%zu + %zu) > %zu\n", mOffset + size, mOffset, size, sizeof(mBuf));
+    if (mOffset + size > PIPE_BUF) {
+        fprintf(stderr, "packet too large %zu (%zu + %zu) > %zu\n", mOffset + size, mOffset, size, static_cast<size_t>(PIPE_BUF));
         abort();
     }
     ::memcpy(mBuf + mOffset, data, size);
     mOffset += size;
     if (type == WriteType::Last) {
-        if (::write(mPipe, mBuf, mOffset) != static_cast<ssize_t>(mOffset)) {
-            fprintf(stderr, "Failed to write %zu bytes to pipe %m\n", mOffset);
+        const bool droppable = mDelivery == Delivery::Droppable && sOverloadPolicy == OverloadPolicy::Drop;
+        if (sHookStats != nullptr) {
+            const uint64_t start = HookStats::now();
+            mDropped = !write(droppable);
+            sHookStats->addTime(HookStats::WriteNs, start);
+            if (!mDropped) {
+                sHookStats->add(HookStats::Packets, 1);
+                sHookStats->add(HookStats::Bytes, mOffset);
+                sHookStats->add(HookStats::Events + mBuf[0], 1);
+            }
+        } else {
+            mDropped = !write(droppable);
+        }
+        if (mDropped) {
+            drop();
+        } else if (droppable && sDropsPending.load(std::memory_order_relaxed)) {
+            sendDrops(mBuf[1]);
         }
         mOffset = 0;
     }
 }
+
+// Returns false if a droppable packet didn't fit
+inline bool PipeEmitter::write(bool droppable)
+{
+    if (sShmTransport != nullptr) {
+        if (droppable)
+            return sShmTransport->tryWrite(mBuf, static_cast<uint32_t>(mOffset));
+        sShmTransport->write(mBuf, static_cast<uint32_t>(mOffset));
+        return true;
+    }
+
+    for (;;) {
+        // packets are at most PIPE_BUF so they're written completely or not at all
+        const ssize_t w = ::write(mPipe, mBuf, mOffset);
+        if (w == static_cast<ssize_t>(mOffset))
+            return true;
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w == -1 && errno == EAGAIN) {
+            if (droppable)
+                return false;
+            pollfd evt = { .fd = mPipe, .events = POLLOUT, .revents = 0 };
+            ::poll(&evt, 1, -1);
+            continue;
+        }
+        fprintf(stderr, "Failed to write %zu bytes to pipe %m\n", mOffset);
+        return true;
+    }
+}
+
+inline void PipeEmitter::drop()
+{
+    sDropped[mBuf[0]].fetch_add(1, std::memory_order_relaxed);
+    sDropsPending.store(true, std::memory_order_relaxed);
+}
+
+// Sent after a droppable packet made it, so there was room a moment ago. If
+// it's full again the counts are put back for the next time.
+inline void PipeEmitter::sendDrops(uint8_t appId)
+{
+    sDropsPending.store(false, std::memory_order_relaxed);
+    for (size_t type = 0; type <= static_cast<size_t>(RecordType::Max); ++type) {
+        if (sDropped[type].load(std::memory_order_relaxed) == 0)
+            continue;
+        const uint64_t count = sDropped[type].exchange(0, std::memory_order_relaxed);
+        if (count == 0)
+            continue;
+        mBuf[0] = static_cast<uint8_t>(RecordType::Dropped);
+        mBuf[1] = appId;
+        mBuf[2] = static_cast<uint8_t>(type);
+        ::memcpy(mBuf + 3, &count, sizeof(count));
+        mOffset = 3 + sizeof(count);
+        if (!write(true)) {
+            sDropped[type].fetch_add(count, std::memory_order_relaxed);
+            sDropsPending.store(true, std::memory_order_relaxed);
+            return;
+        }
+    }
+}
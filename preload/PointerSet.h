@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Lock free open addressing set of pointers, used to remember which
+// allocations were sampled so that frees of everything else can be dropped
+// without talking to the parser. The storage is handed in by the caller
+// since we can't allocate from inside the hooks, it has to be zero filled
+// (a fresh anonymous mapping) so that untouched slots read as Empty.
+class PointerSet
+{
+public:
+    PointerSet(void* mem, size_t capacity);
+
+    static size_t mappingSize(size_t capacity);
+
+    bool insert(uintptr_t ptr);
+    bool remove(uintptr_t ptr);
+
+private:
+    size_t slot(uintptr_t ptr) const;
+
+    enum : uintptr_t { Empty = 0, Tombstone = 1 };
+    enum { MaxProbes = 64 };
+
+    std::atomic<uintptr_t>* mSlots { nullptr };
+    size_t mMask { 0 };
+};
+
+inline PointerSet::PointerSet(void* mem, size_t capacity)
+    : mSlots(static_cast<std::atomic<uintptr_t>*>(mem)), mMask(capacity - 1)
+{
+    static_assert(sizeof(std::atomic<uintptr_t>) == sizeof(uintptr_t));
+}
+
+inline size_t PointerSet::mappingSize(size_t capacity)
+{
+    return capacity * sizeof(std::atomic<uintptr_t>);
+}
+
+inline size_t PointerSet::slot(uintptr_t ptr) const
+{
+    // malloc pointers are at least 16 byte aligned
+    return static_cast<size_t>((static_cast<uint64_t>(ptr >> 4) * 0x9E3779B97F4A7C15ull) >> 20) & mMask;
+}
+
+inline bool PointerSet::insert(uintptr_t ptr)
+{
+    const size_t start = slot(ptr);
+    for (size_t i = 0; i < MaxProbes; ++i) {
+        auto& s = mSlots[(start + i) & mMask];
+        uintptr_t cur = s.load(std::memory_order_relaxed);
+        if (cur == ptr)
+            return true;
+        if ((cur == Empty || cur == Tombstone)
+            && s.compare_exchange_strong(cur, ptr, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool PointerSet::remove(uintptr_t ptr)
+{
+    const size_t start = slot(ptr);
+    for (size_t i = 0; i < MaxProbes; ++i) {
+        auto& s = mSlots[(start + i) & mMask];
+        uintptr_t cur = s.load(std::memory_order_relaxed);
+        if (cur == Empty)
+            return false;
+        if (cur == ptr)
+            return s.compare_exchange_strong(cur, Tombstone, std::memory_order_relaxed);
+    }
+    return false;
+}
@@ -5,10 +5,16 @@
 #endif
 
 #include "Preload.h"
+#include "AllocationMap.h"
+#include "CallsiteTable.h"
 #include "NoHook.h"
 #include "PipeEmitter.h"
+#include "PointerSet.h"
+#include "ShmTransport.h"
 #include "Spinlock.h"
 #include "Stack.h"
+#include "StackTable.h"
+#include <common/HookStats.h>
 #include <common/MmapTracker.h>
 #include <common/RecordType.h>
 #include <common/Limits.h>
@@ -20,18 +26,26 @@
 #include <linux/userfaultfd.h>
 #include <poll.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <execinfo.h>
 #include <pthread.h>
 
+#include <algorithm>
+#include <climits>
+#include <cmath>
 #include <cstdarg>
+#include <cstddef>
 #include <atomic>
 #include <mutex>
+#include <new>
 #include <thread>
 #include <tuple>
 
@@ -54,6 +68,14 @@
         VAR = BLOCK;                            \
     } while (VAR == -1 && errno == EINTR)
 
+#ifdef MTRACK_ATTACH
+// dlopened by mtrack_attach after libc, there is no next object to look
+// the real functions up in but we're not in the global scope either
+static void* const NextObject = RTLD_DEFAULT;
+#else
+static void* const NextObject = RTLD_NEXT;
+#endif
+
 typedef void* (*MmapSig)(void*, size_t, int, int, int, off_t);
 typedef void* (*Mmap64Sig)(void*, size_t, int, int, int, __off64_t);
 typedef void* (*MremapSig)(void*, size_t, size_t, int, ...);
@@ -70,6 +92,9 @@ typedef void* (*ReallocSig)(void*, size_t);
 typedef void* (*ReallocArraySig)(void*, size_t, size_t);
 typedef int (*Posix_MemalignSig)(void **, size_t, size_t);
 typedef void* (*Aligned_AllocSig)(size_t, size_t);
+typedef int (*ExecveSig)(const char*, char* const[], char* const[]);
+typedef int (*ExecvSig)(const char*, char* const[]);
+typedef int (*FexecveSig)(int, char* const[], char* const[]);
 
 namespace {
 inline uint64_t alignToPage(uint64_t size)
@@ -82,6 +107,14 @@ inline uint64_t alignToSize(uint64_t size, uint64_t align)
     return size + (((~size) + 1) & (align - 1));
 }
 
+inline uint64_t nextPowerOfTwo(uint64_t value)
+{
+    uint64_t ret = 1;
+    while (ret < value)
+        ret <<= 1;
+    return ret;
+}
+
 inline uint64_t mmap_ptr_cast(void *ptr)
 {
     const uint64_t ret = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr));
@@ -148,23 +181,193 @@ struct Callbacks
     ReallocArraySig reallocarray { nullptr };
     Posix_MemalignSig posix_memalign { nullptr };
     Aligned_AllocSig aligned_alloc { nullptr };
+    ExecveSig execve { nullptr };
+    ExecvSig execv { nullptr };
+    ExecvSig execvp { nullptr };
+    ExecveSig execvpe { nullptr };
+    FexecveSig fexecve { nullptr };
 } callbacks;
 
 Allocator<4096> allocator;
 
+// MTRACK_STATS, the shared stats page
+HookStats* hookStats = nullptr;
+
+// SharedSpinlock that counts how long the hooks wait for it when
+// MTRACK_STATS is on, uncontended acquisitions aren't timed
+class TrackerLock
+{
+public:
+    void lock()
+    {
+        if (hookStats == nullptr) {
+            mLock.lock();
+        } else if (!mLock.try_lock()) {
+            const uint64_t start = HookStats::now();
+            mLock.lock();
+            waited(start);
+        }
+    }
+    void unlock() { mLock.unlock(); }
+
+    void lock_shared()
+    {
+        if (hookStats == nullptr) {
+            mLock.lock_shared();
+        } else if (!mLock.try_lock_shared()) {
+            const uint64_t start = HookStats::now();
+            mLock.lock_shared();
+            waited(start);
+        }
+    }
+    bool try_lock_shared() { return mLock.try_lock_shared(); }
+    void unlock_shared() { mLock.unlock_shared(); }
+
+private:
+    static void waited(uint64_t start)
+    {
+        hookStats->add(HookStats::LockWaits, 1);
+        hookStats->addTime(HookStats::LockWaitNs, start);
+    }
+
+    SharedSpinlock mLock;
+};
+
 struct Data {
-    int faultFd {};
+    enum { MaxFaultThreads = 64 };
+
+    // MTRACK_FAULT_THREADS, every fault thread has its own userfaultfd and
+    // mappings are spread over them by address, see faultFdIndex(). The
+    // first one is handled by thread, which also does everything else.
+    int faultFds[MaxFaultThreads] {};
+    uint32_t faultThreadCount { 1 };
+    std::thread faultThreads[MaxFaultThreads - 1];
+    // written once to stop faultThreads
+    int faultQuitFd { -1 };
     pid_t pid {};
+    // the process that appId belongs to. vfork children share Data but not
+    // the pid, neither do forked children that are reported as their parent
+    pid_t ownPid {};
     std::thread thread;
     uint8_t appId { 1 };
     uint32_t started { 0 };
+    uint64_t startedNs { 0 };
+    TimestampMode timestampMode { TimestampMode::Milliseconds };
     std::atomic_flag isShutdown = ATOMIC_FLAG_INIT;
     std::atomic<bool> modulesDirty = true;
 
+    // modules that have been sent to the parser, sorted on addr, nameHash
+    struct LoadedModule {
+        uint64_t addr;
+        uint64_t nameHash;
+        uintptr_t start, end;
+        uint32_t generation;
+    };
+    Spinlock modulesLock;
+    std::vector<LoadedModule> loadedModules;
+    uint32_t modulesGeneration { 0 };
+    unsigned long long modulesAdds { 0 }, modulesSubs { 0 };
+
     int pfThreadPipe[2] { -1, -1 };
     int emitPipe[2] { -1, -1 };
-
-    Spinlock mmapTrackerLock;
+    int shmEventFd { -1 };
+
+    ShmTransport* shmTransport { nullptr };
+    StackTable* stackTable { nullptr };
+
+    // forked children get their appId from the daemon if there is one,
+    // otherwise from a counter shared by every process forked off this one
+    char* daemonPath { nullptr };
+    std::atomic<uint32_t>* nextAppId { nullptr };
+
+    // the preload's own anonymous mappings, left out of the baseline
+    struct {
+        uintptr_t start, end;
+    } ownMappings[4] {};
+
+    uint64_t sampleRate { 0 };
+    PointerSet* sampledPointers { nullptr };
+    std::atomic<bool> filterFrees { false };
+
+    // MTRACK_AGGREGATE, allocations are counted per call site in process
+    // and only the changes are sent every aggregateInterval milliseconds
+    CallsiteTable* callsites { nullptr };
+    AllocationMap* allocations { nullptr };
+    uint32_t aggregateInterval { 0 };
+
+    // MTRACK_STATS, the totals of hookStats are sent every statsInterval
+    // milliseconds
+    uint32_t statsInterval { 0 };
+
+    // MTRACK_FAULT_BLOCK, page faults are filled in this many bytes at a
+    // time, a power of two
+    uint64_t faultBlock { Limits::PageSize };
+
+    // MTRACK_FAULT_STACKS, what page faults are attributed to. Unwinding
+    // the faulting thread means a signal round trip to it for every fault,
+    // the other modes reuse stacks the tracker already has.
+    enum class FaultStacks {
+        // every fault is unwound
+        Exact,
+        // the stack of the mmap that created the mapping
+        Mmap,
+        // the first fault of an mmap call site is unwound, the faults after
+        // it reuse its stack
+        First,
+        // like First but every faultSampleRate'th fault is unwound again
+        Sample
+    } faultStacks { FaultStacks::Exact };
+    uint32_t faultSampleRate { 0 };
+    std::atomic<uint64_t> faultSamples { 0 };
+
+    // the last unwound fault stack per mmap call site, a direct mapped
+    // cache only the fault threads use
+    enum { FaultStackCacheBits = 12 };
+    struct FaultStack {
+        uint64_t key;
+        uint32_t stack;
+    } faultStackCache[1 << FaultStackCacheBits] {};
+    Spinlock faultStackLock;
+
+    // MTRACK_PAGE_SCAN=<interval ms>, there's no userfaultfd and the pages
+    // of the tracked mappings that are resident are read from
+    // /proc/self/pagemap every interval instead, see scanPages()
+    uint32_t pageScanInterval { 0 };
+    struct ScannedRun {
+        uintptr_t start, end;
+        int32_t stack;
+    };
+    // the resident runs the parser was sent, sorted and only touched by
+    // the scan
+    Spinlock pageScanLock;
+    std::vector<ScannedRun> scannedPages;
+    // ranges the hooks told the parser are gone since the last scan, more
+    // than MaxForgottenRanges forgets everything
+    enum { MaxForgottenRanges = 256 };
+    Spinlock pageForgetLock;
+    struct {
+        uintptr_t start, end;
+    } forgottenRanges[MaxForgottenRanges] {};
+    uint32_t forgottenCount { 0 };
+
+    // MTRACK_WORKING_SET=<interval ms>, the pages of the tracked mappings
+    // that were written (soft-dirty) or, when the idle page bitmap can be
+    // used, accessed are counted every interval, see scanWorkingSet()
+    uint32_t workingSetInterval { 0 };
+    int pageIdleFd { -1 };
+    // the first scan only clears the bits
+    bool workingSetPrimed { false };
+
+    // MTRACK_STACK_DEPTH and MTRACK_STACK_SKIP per RecordType, the skipped
+    // frames come on top of the preload's own
+    struct StackLimit {
+        unsigned skip;
+        unsigned depth;
+    } stackLimits[static_cast<size_t>(RecordType::Max) + 1] {};
+
+    // only used to look up the flags of a mapping in mprotect, those can
+    // run concurrently and only mmap, munmap and mremap are exclusive
+    TrackerLock mmapTrackerLock;
     MmapTracker mmapTracker;
 } *data = nullptr;
 
@@ -175,6 +378,24 @@ inline uint32_t timestamp()
     clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
     return static_cast<uint32_t>((ts.tv_sec * 1000) + (ts.tv_nsec / 1000000)) - data->started;
 }
+
+// CLOCK_MONOTONIC is serviced by the vDSO, no syscall
+inline uint64_t timestampNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (static_cast<uint64_t>(ts.tv_sec) * 1000000000ull) + static_cast<uint64_t>(ts.tv_nsec) - data->startedNs;
+}
+
+// Nanosecond timestamps relative to the previous one sent by the same
+// writer, see TimestampMode
+inline Emitter::VarInt timestampDelta(uint64_t* last)
+{
+    const uint64_t now = timestampNs();
+    const uint64_t value = *last == 0 ? ((now << 1) | 1) : ((now - *last) << 1);
+    *last = now;
+    return Emitter::VarInt(value);
+}
 }
 
 namespace {
@@ -188,38 +409,48 @@ struct TLSData
 {
     bool hooked = true;
     bool inMallocFree = false;
+    // gettid is a syscall, cached the first time the thread needs it and
+    // reset in the child after a fork
+    uint32_t tid = 0;
+    uint64_t lastTimestamp = 0;
+    int64_t sampleBytes = 0;
+    uint64_t sampleSeed = 0;
+    Stack::Cache stackCache {};
+    // packets are put together here before they're written
+    uint8_t emitBuffer[PIPE_BUF] {};
 };
 
-struct TLSInit
-{
-    TLSInit();
-
-    pthread_key_t tlsKey;
-};
+// The preload is loaded at startup so the static TLS block always has room
+// for this, initial-exec makes every access a plain thread pointer relative
+// load without going through __tls_get_addr. It has to be constant
+// initialized since there is no safe point to run constructors from. The
+// attach build is dlopened into a running process, the static TLS block
+// has no room left by then.
+#ifdef MTRACK_ATTACH
+constinit thread_local TLSData tls {};
+#else
+constinit thread_local TLSData tls __attribute__((tls_model("initial-exec"))) {};
+#endif
 
-TLSInit::TLSInit()
+static inline TLSData* tlsData()
 {
-    pthread_key_create(&tlsKey, nullptr);
+    return &tls;
 }
 
-static TLSData* tlsData()
+static inline uint32_t threadId()
 {
-    static TLSInit tlsInit;
-
-    void* ptr = pthread_getspecific(tlsInit.tlsKey);
-    if (ptr == nullptr) {
-        static MallocSig realMalloc = nullptr;
-        if (realMalloc == nullptr) {
-            realMalloc = reinterpret_cast<MallocSig>(dlsym(RTLD_NEXT, "malloc"));
-        }
-        ptr = realMalloc(sizeof(TLSData));
-        new (ptr) TLSData();
-        pthread_setspecific(tlsInit.tlsKey, ptr);
+    if (tls.tid == 0) {
+        tls.tid = static_cast<uint32_t>(syscall(SYS_gettid));
     }
-    return static_cast<TLSData*>(ptr);
+    return tls.tid;
 }
 } // anonymous namespace
 
+uint8_t* PipeEmitter::threadBuffer()
+{
+    return tls.emitBuffer;
+}
+
 NoHook::NoHook()
     : wasHooked(::tlsData()->hooked)
 {
@@ -252,136 +483,1128 @@ private:
     const bool mPrev;
 };
 
+enum class HookState : uint8_t {
+    Unhooked,
+    Dormant,
+    Tracking
+};
+
 static std::once_flag hookOnce = {};
+static std::atomic<HookState> hookState = HookState::Unhooked;
+
+// set by mtrack_attach, the hooks start out dormant until the GOTs point
+// at them and the baseline is sent
+#ifdef MTRACK_ATTACH
+static bool attaching = false;
+#else
+static constexpr bool attaching = false;
+#endif
+
+// called at the start of every hook, once hooking has finished this is a
+// single relaxed load. call_once takes care of the ordering for the threads
+// that get there before Hooks::hook sets the state.
+static inline void ensureHooked()
+{
+    if (__builtin_expect(hookState.load(std::memory_order_relaxed) == HookState::Unhooked, false)) {
+        std::call_once(hookOnce, Hooks::hook);
+    }
+}
+
+// Checked before anything else in the hooks, a dormant preload goes
+// straight to the real functions. Only true once hooked so the callbacks
+// are valid.
+static inline bool dormant()
+{
+    return hookState.load(std::memory_order_relaxed) == HookState::Dormant;
+}
+
+// Poisson byte sampling, every allocated byte has the same 1/sampleRate
+// chance of being picked and an allocation is reported if it contains a
+// picked byte. The distance between picked bytes is exponentially
+// distributed so each thread only needs to count down to the next one.
+static int64_t nextSampleInterval(TLSData* tls)
+{
+    if (tls->sampleSeed == 0) {
+        tls->sampleSeed = (static_cast<uint64_t>(threadId()) << 32) ^ reinterpret_cast<uintptr_t>(tls) ^ 0x2545F4914F6CDD1Dull;
+    }
+    // xorshift64
+    uint64_t x = tls->sampleSeed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    tls->sampleSeed = x;
+    const double u = (static_cast<double>(x >> 11) + 1.0) * (1.0 / 9007199254740992.0);
+    return static_cast<int64_t>(-std::log(u) * static_cast<double>(data->sampleRate)) + 1;
+}
+
+static bool sampleMalloc(size_t size)
+{
+    if (data->sampleRate == 0)
+        return true;
+    auto tls = ::tlsData();
+    if (tls->sampleSeed == 0) {
+        tls->sampleBytes = nextSampleInterval(tls);
+    }
+    tls->sampleBytes -= static_cast<int64_t>(size);
+    if (tls->sampleBytes > 0)
+        return false;
+    tls->sampleBytes = nextSampleInterval(tls);
+    return true;
+}
+
+static inline const Data::StackLimit& stackLimit(RecordType type)
+{
+    return data->stackLimits[static_cast<size_t>(type)];
+}
+
+// "<n>" applies to every record type, "<type>=<n>" only to the named one,
+// several are separated by commas. MTRACK_STACK_DEPTH=32,mmap=128 keeps 32
+// frames for everything but mmap.
+static void parseStackLimits(const char* value, unsigned Data::StackLimit::*field)
+{
+    const char* cur = value;
+    while (*cur) {
+        const char* end = strchrnul(cur, ',');
+        const char* eq = static_cast<const char*>(memchr(cur, '=', end - cur));
+        if (eq == nullptr) {
+            const auto n = static_cast<unsigned>(strtoul(cur, nullptr, 10));
+            for (auto& limit : data->stackLimits) {
+                limit.*field = n;
+            }
+        } else {
+            bool found = false;
+            for (size_t type = 1; type <= static_cast<size_t>(RecordType::Max); ++type) {
+                const char* name = recordTypeToString(static_cast<RecordType>(type));
+                if (strlen(name) == static_cast<size_t>(eq - cur) && !strncasecmp(name, cur, eq - cur)) {
+                    data->stackLimits[type].*field = static_cast<unsigned>(strtoul(eq + 1, nullptr, 10));
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                safePrint("unknown record type in stack limits\n");
+            }
+        }
+        cur = *end ? end + 1 : end;
+    }
+}
+
+static uint32_t stackId(const Stack& stack)
+{
+    return data->stackTable->index(stack.data(), stack.size(), [&stack](uint32_t id) {
+        PipeEmitter emitter(data->emitPipe[1]);
+        emitter.emit(RecordType::StackDefinition, data->appId, id, stack);
+    });
+}
+
+// allocations the aggregated mode couldn't attribute since one of its
+// tables was full, reported as dropped Malloc records
+static std::atomic<uint64_t> untrackedAllocations = 0;
+
+// Sends the call sites that changed since the last flush, as many to an
+// Aggregate record as fit in a packet
+static void flushCallsites()
+{
+    enum {
+        EntrySize = sizeof(uint32_t) + sizeof(int64_t) + sizeof(int64_t) + sizeof(uint64_t),
+        MaxEntries = 128
+    };
+    static_assert(EntrySize * MaxEntries + 32 <= PIPE_BUF);
+
+    PipeEmitter emitter(data->emitPipe[1]);
+    uint8_t buf[EntrySize * MaxEntries];
+    uint32_t entries = 0;
+    const uint64_t now = timestampNs();
+    auto send = [&]() {
+        emitter.emit(RecordType::Aggregate, data->appId, now, Emitter::Data(buf, entries * EntrySize));
+        entries = 0;
+    };
+    data->callsites->flush(data->stackTable->count(), [&](uint32_t stack, int64_t bytes, int64_t count, uint64_t allocations) {
+        uint8_t* entry = buf + (entries * EntrySize);
+        memcpy(entry, &stack, sizeof(stack));
+        memcpy(entry + 4, &bytes, sizeof(bytes));
+        memcpy(entry + 12, &count, sizeof(count));
+        memcpy(entry + 20, &allocations, sizeof(allocations));
+        if (++entries == MaxEntries)
+            send();
+    });
+    if (entries > 0)
+        send();
+
+    const uint64_t untracked = untrackedAllocations.exchange(0, std::memory_order_relaxed);
+    if (untracked > 0) {
+        emitter.emit(RecordType::Dropped, data->appId, static_cast<uint8_t>(RecordType::Malloc), untracked);
+    }
+}
+
+// Sends the totals of the stats page, the parser keeps the latest
+static void sendHookStats()
+{
+    uint64_t totals[HookStats::Count];
+    for (uint32_t i = 0; i < HookStats::Count; ++i) {
+        totals[i] = hookStats->total(i);
+    }
+    PipeEmitter emitter(data->emitPipe[1]);
+    emitter.emit(RecordType::HookStats, data->appId, timestampNs(), Emitter::Data(totals, sizeof(totals)));
+}
 
-static int dl_iterate_phdr_callback(struct dl_phdr_info* info, size_t /*size*/, void* /*data*/)
+struct ModuleUpdate
 {
+    bool first { true };
+    bool unchanged { false };
+};
+
+static inline uint64_t moduleNameHash(const char* name)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ull;
+    while (*name) {
+        hash = (hash ^ static_cast<uint8_t>(*name++)) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static int dl_iterate_phdr_callback(struct dl_phdr_info* info, size_t size, void* d)
+{
+    auto update = static_cast<ModuleUpdate*>(d);
+    if (update->first) {
+        update->first = false;
+        // the loader counts loads and unloads, nothing to do if those didn't move
+        if (size >= offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+            if (info->dlpi_adds == data->modulesAdds && info->dlpi_subs == data->modulesSubs) {
+                update->unchanged = true;
+                return 1;
+            }
+            data->modulesAdds = info->dlpi_adds;
+            data->modulesSubs = info->dlpi_subs;
+        }
+    }
+
     const char* fileName = info->dlpi_name;
     if (!fileName || !fileName[0]) {
         fileName = "s";
     }
 
+    const Data::LoadedModule key = { static_cast<uint64_t>(info->dlpi_addr), moduleNameHash(fileName), 0, 0, 0 };
+    auto& loaded = data->loadedModules;
+    auto it = std::lower_bound(loaded.begin(), loaded.end(), key, [](const auto& a, const auto& b) {
+        return std::tie(a.addr, a.nameHash) < std::tie(b.addr, b.nameHash);
+    });
+    if (it != loaded.end() && it->addr == key.addr && it->nameHash == key.nameHash) {
+        // already sent
+        it->generation = data->modulesGeneration;
+        return 0;
+    }
+
     PipeEmitter emitter(data->emitPipe[1]);
     emitter.emit(RecordType::Library, data->appId, Emitter::String(fileName), static_cast<uint64_t>(info->dlpi_addr));
 
+    uintptr_t start = UINTPTR_MAX, end = 0;
     for (int i = 0; i < info->dlpi_phnum; i++) {
         const auto& phdr = info->dlpi_phdr[i];
         if (phdr.p_type == PT_LOAD) {
             emitter.emit(RecordType::LibraryHeader, data->appId, static_cast<uint64_t>(phdr.p_vaddr), static_cast<uint64_t>(phdr.p_memsz));
+            start = std::min<uintptr_t>(start, info->dlpi_addr + phdr.p_vaddr);
+            end = std::max<uintptr_t>(end, info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz);
+            if (phdr.p_flags & PF_X) {
+                Stack::addModule(info->dlpi_addr + phdr.p_vaddr, info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz);
+            }
         }
     }
 
+    loaded.insert(it, { key.addr, key.nameHash, start, end, data->modulesGeneration });
     return 0;
 }
 
+// Sends the modules loaded or unloaded since the last time dlopen or
+// dlclose marked them dirty.
+static void updateModules()
+{
+    if (!data->modulesDirty.load(std::memory_order_acquire))
+        return;
+
+    ScopedSpinlock lock(data->modulesLock);
+    if (!data->modulesDirty.load(std::memory_order_acquire))
+        return;
+    // cleared before the walk so a dlopen racing with it marks them again
+    data->modulesDirty.store(false, std::memory_order_release);
+
+    ModuleUpdate update;
+    ++data->modulesGeneration;
+    dl_iterate_phdr(dl_iterate_phdr_callback, &update);
+    if (hookStats != nullptr)
+        hookStats->add(HookStats::ModuleScans, 1);
+    if (update.unchanged)
+        return;
+
+    PipeEmitter emitter(data->emitPipe[1]);
+    auto& loaded = data->loadedModules;
+    for (auto it = loaded.begin(); it != loaded.end();) {
+        if (it->generation != data->modulesGeneration) {
+            emitter.emit(RecordType::LibraryUnload, data->appId, it->addr);
+            Stack::removeModules(it->start, it->end);
+            it = loaded.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Which fault thread handles the faults of a mapping at addr. Hashed in 2MB
+// blocks so the arenas and stacks of different threads tend to end up with
+// different fault threads while a mapping that grows stays with one.
+static inline uint32_t faultFdIndex(uintptr_t addr)
+{
+    const uint64_t hash = (static_cast<uint64_t>(addr) >> 21) * 0x9e3779b97f4a7c15ull;
+    return static_cast<uint32_t>(hash >> 32) % data->faultThreadCount;
+}
+
+// Registers the range with the userfaultfd of its fault thread. Parts of it
+// can already be registered with another one after an mprotect or mremap
+// merged mappings, the kernel says EBUSY then and the others are tried.
+static int registerFaultRange(uintptr_t start, size_t length)
+{
+    if (data->pageScanInterval != 0)
+        return 0;
+    const uint32_t first = faultFdIndex(start);
+    for (uint32_t i = 0; i < data->faultThreadCount; ++i) {
+        uffdio_register reg = {
+            .range = {
+                .start = static_cast<__u64>(start),
+                .len = alignToPage(length)
+            },
+            .mode = UFFDIO_REGISTER_MODE_MISSING,
+            .ioctls = 0
+        };
+        if (ioctl(data->faultFds[(first + i) % data->faultThreadCount], UFFDIO_REGISTER, &reg) == 0)
+            return 0;
+        if (errno != EBUSY)
+            break;
+    }
+    return -1;
+}
+
+static void registerFaults(void* addr, size_t length)
+{
+    if (registerFaultRange(reinterpret_cast<uintptr_t>(addr), length) == -1) {
+        printf("register failed (1) %m\n");
+        return;
+    }
+
+    // if (reg.ioctls != UFFD_API_RANGE_IOCTLS) {
+    //     printf("no range (1) 0x%llx\n", reg.ioctls);
+    //     return;
+    // }
+}
+
+static void unregisterFaults(uintptr_t start, uintptr_t end)
+{
+    if (data->pageScanInterval != 0)
+        return;
+    uffdio_range range = {
+        .start = start,
+        .len = end - start
+    };
+    // the range might have been registered in parts with different
+    // userfaultfds, see registerFaultRange
+    for (uint32_t i = 0; i < data->faultThreadCount; ++i) {
+        ioctl(data->faultFds[i], UFFDIO_UNREGISTER, &range);
+    }
+}
+
+// Calls func(start, end, prot) for the private anonymous mappings in
+// /proc/self/maps. Only read(2) so it doesn't allocate.
+template<typename Func>
+static void readAnonymousMaps(Func&& func)
+{
+    int fd;
+    EINTRWRAP(fd, ::open("/proc/self/maps", O_RDONLY | O_CLOEXEC));
+    if (fd == -1)
+        return;
+
+    char buf[4096];
+    size_t used = 0;
+    for (;;) {
+        ssize_t r;
+        EINTRWRAP(r, ::read(fd, buf + used, sizeof(buf) - used - 1));
+        if (r <= 0)
+            break;
+        used += r;
+        buf[used] = '\0';
+
+        char* line = buf;
+        char* eol;
+        while ((eol = strchr(line, '\n')) != nullptr) {
+            *eol = '\0';
+            // start-end perms offset dev inode [path]
+            char* cur;
+            const uintptr_t start = strtoull(line, &cur, 16);
+            const uintptr_t end = strtoull(cur + 1, &cur, 16);
+            const char* perms = cur + 1;
+            cur += 6;
+            strtoull(cur, &cur, 16);
+            while (*cur == ' ')
+                ++cur;
+            while (*cur && *cur != ' ')
+                ++cur;
+            const auto inode = strtoull(cur, &cur, 10);
+            while (*cur == ' ')
+                ++cur;
+            if (perms[3] == 'p' && inode == 0 && *cur == '\0') {
+                func(start, end, (perms[0] == 'r' ? PROT_READ : 0) | (perms[1] == 'w' ? PROT_WRITE : 0) | (perms[2] == 'x' ? PROT_EXEC : 0));
+            }
+            line = eol + 1;
+        }
+        used = buf + used - line;
+        memmove(buf, line, used);
+    }
+
+    int e;
+    EINTRWRAP(e, ::close(fd));
+}
+
+// Called after the parser was sent the removal of [start, end) by a hook,
+// the scan mustn't think it still knows those pages or a new mapping in the
+// same place would never be reported
+static void forgetScannedPages(uintptr_t start, uintptr_t end)
+{
+    if (data->pageScanInterval == 0)
+        return;
+    ScopedSpinlock lock(data->pageForgetLock);
+    if (data->forgottenCount < Data::MaxForgottenRanges) {
+        data->forgottenRanges[data->forgottenCount].start = start;
+        data->forgottenRanges[data->forgottenCount].end = end;
+    }
+    if (data->forgottenCount <= Data::MaxForgottenRanges)
+        ++data->forgottenCount;
+}
+
+// Turning tracking off unregisters the mappings from the userfaultfd so
+// page faults don't go through the fault thread either. Turning it on sends
+// a Tracking record, the parser forgets everything it knew about the
+// application's memory since whatever happened while dormant is unknown,
+// and then a baseline of the current anonymous mappings and modules. The
+// writable ones are registered with the userfaultfd like new mappings,
+// except for thread stacks. A fault's stack is unwound by the faulting
+// thread in a signal handler, on a stack that would fault again.
+static void setTracking(bool enable)
+{
+    NoHook nohook;
+
+    {
+        ScopedSpinlock lock(data->mmapTrackerLock);
+        const auto state = enable ? HookState::Tracking : HookState::Dormant;
+        if (hookState.load(std::memory_order_relaxed) == state)
+            return;
+
+        PipeEmitter emitter(data->emitPipe[1]);
+        if (!enable) {
+            hookState.store(state, std::memory_order_relaxed);
+            data->mmapTracker.forEach([](uintptr_t start, uintptr_t end, int32_t prot, int32_t /*flags*/, int32_t /*stack*/) {
+                if ((prot & (PROT_READ | PROT_WRITE)) == (PROT_READ | PROT_WRITE)) {
+                    unregisterFaults(start, end);
+                }
+            });
+            emitter.emit(RecordType::Tracking, data->appId, static_cast<uint8_t>(0));
+            return;
+        }
+
+        emitter.emit(RecordType::Tracking, data->appId, static_cast<uint8_t>(1));
+        forgetScannedPages(0, UINTPTR_MAX);
+        data->mmapTracker.clear();
+        if (data->callsites != nullptr) {
+            // frees that happened while dormant weren't seen, start over
+            // with zero filled tables
+            for (size_t i = 2; i < 4; ++i) {
+                const auto& own = data->ownMappings[i];
+                callbacks.madvise(reinterpret_cast<void*>(own.start), own.end - own.start, MADV_DONTNEED);
+            }
+        }
+        uintptr_t guardEnd = 0;
+        readAnonymousMaps([&emitter, &guardEnd](uintptr_t start, uintptr_t end, int prot) {
+            // thread stacks have their guard pages right below them
+            const bool stack = start == guardEnd;
+            if (prot == PROT_NONE)
+                guardEnd = end;
+            for (const auto& own : data->ownMappings) {
+                if (start < own.end && own.start < end)
+                    return;
+            }
+            const int flags = MAP_PRIVATE | MAP_ANONYMOUS | (stack ? MAP_STACK : 0);
+            data->mmapTracker.mmap(start, end - start, prot, flags, 0);
+            emitter.emit(RecordType::Mmap, data->appId, static_cast<uint64_t>(start), static_cast<uint64_t>(end - start),
+                         prot, flags, static_cast<uint32_t>(0), static_cast<uint32_t>(0));
+            if ((prot & (PROT_READ | PROT_WRITE)) == (PROT_READ | PROT_WRITE) && !stack) {
+                registerFaults(reinterpret_cast<void*>(start), end - start);
+            }
+        });
+        hookState.store(state, std::memory_order_relaxed);
+    }
+
+    // modules are incremental, whatever was loaded or unloaded while
+    // dormant is sent now
+    data->modulesDirty.store(true, std::memory_order_release);
+    updateModules();
+}
+
+// The end of the block of pages to fill in for a fault at page, cut off at
+// the end of the mapping. Just the page if the mapping can't be looked up
+// right now, a hook might be holding the tracker lock for a while.
+static uint64_t faultBlockEnd(uint64_t page)
+{
+    const uint64_t pageEnd = page + Limits::PageSize;
+    if (!data->mmapTrackerLock.try_lock_shared())
+        return pageEnd;
+    uint64_t end = pageEnd;
+    if (const auto mmap = data->mmapTracker.lookup(page)) {
+        end = std::min<uint64_t>((page & ~(data->faultBlock - 1)) + data->faultBlock, mmap->end);
+    }
+    data->mmapTrackerLock.unlock_shared();
+    return std::max(end, pageEnd);
+}
+
+// Fills [page, end) with zero pages without waking the threads waiting for
+// them. Stops at the first page that's already there. Returns the number of
+// bytes filled, -1 if the userfaultfd is broken.
+static int64_t zeroFaults(int fd, uint64_t page, uint64_t end)
+{
+    uffdio_zeropage zero = {
+        .range = {
+            .start = page,
+            .len = end - page
+        },
+        .mode = UFFDIO_ZEROPAGE_MODE_DONTWAKE,
+        .zeropage = 0
+    };
+    if (ioctl(fd, UFFDIO_ZEROPAGE, &zero) == 0)
+        return static_cast<int64_t>(end - page);
+    if (errno == EAGAIN && zero.zeropage > 0)
+        return zero.zeropage;
+    if (errno == EEXIST)
+        return 0;
+    if (end - page > Limits::PageSize) {
+        // the block reached into a part the kernel has as a different
+        // mapping, mprotect can split them without the tracker knowing
+        return zeroFaults(fd, page, page + Limits::PageSize);
+    }
+    return -1;
+}
+
+// The stack id a page fault of ptid at page is attributed to, depending on
+// MTRACK_FAULT_STACKS
+static uint32_t faultStack(uint64_t page, uint32_t ptid)
+{
+    const auto& limit = stackLimit(RecordType::PageFault);
+    if (data->faultStacks == Data::FaultStacks::Exact)
+        return stackId(Stack(2 + limit.skip, limit.depth, ptid));
+
+    // same as faultBlockEnd, a hook might hold the lock for a while. The
+    // fault is unwound then, as it is for a mapping the tracker doesn't
+    // know.
+    bool found = false;
+    int32_t mmapStack = 0;
+    uint64_t key = 0;
+    if (data->mmapTrackerLock.try_lock_shared()) {
+        if (const auto mmap = data->mmapTracker.lookup(page)) {
+            found = true;
+            mmapStack = mmap->stack;
+            // mappings from before tracking started have no stack, those
+            // are told apart by their page aligned start instead
+            key = mmapStack != 0 ? (static_cast<uint64_t>(mmapStack) << 1) | 1 : mmap->start;
+        }
+        data->mmapTrackerLock.unlock_shared();
+    }
+    if (!found)
+        return stackId(Stack(2 + limit.skip, limit.depth, ptid));
+    if (data->faultStacks == Data::FaultStacks::Mmap)
+        return static_cast<uint32_t>(mmapStack);
+
+    const bool sample = data->faultStacks == Data::FaultStacks::Sample
+        && data->faultSamples.fetch_add(1, std::memory_order_relaxed) % data->faultSampleRate == 0;
+    auto& cached = data->faultStackCache[(key * 0x9e3779b97f4a7c15ull) >> (64 - Data::FaultStackCacheBits)];
+    if (!sample) {
+        ScopedSpinlock lock(data->faultStackLock);
+        if (cached.key == key)
+            return cached.stack;
+    }
+    const uint32_t stack = stackId(Stack(2 + limit.skip, limit.depth, ptid));
+    ScopedSpinlock lock(data->faultStackLock);
+    cached.key = key;
+    cached.stack = stack;
+    return stack;
+}
+
+// Reads a message from the userfaultfd fd and handles it. Returns false if
+// fd broke, it's closed and set to -1 then.
+static bool handleFault(int& fd, PipeEmitter& emitter, PipeEmitter& faultEmitter, uint64_t* lastFaultTimestamp)
+{
+    // the page fault round trip is counted from here to the ioctl
+    // that lets the faulting thread continue
+    const uint64_t faultStart = hookStats != nullptr ? HookStats::now() : 0;
+    uffd_msg fault_msg = {};
+    const auto r = read(fd, &fault_msg, sizeof(fault_msg));
+    if (r == sizeof(fault_msg)) {
+        // printf("- fault thread 3 0x%x\n", fault_msg.event);
+        switch (fault_msg.event) {
+        case UFFD_EVENT_PAGEFAULT: {
+            const auto place = static_cast<uint64_t>(fault_msg.arg.pagefault.address);
+            const auto ptid = static_cast<uint32_t>(fault_msg.arg.pagefault.feat.ptid);
+            const uint64_t page = place & ~(Limits::PageSize - 1);
+            // printf("  - pagefault %u\n", ptid);
+            // the record has to be sent before the faulting thread
+            // continues, otherwise an munmap from it could get to the
+            // parser first
+            auto emitFault = [&](uint32_t pages) {
+                if (data->timestampMode == TimestampMode::Nanoseconds) {
+                    // the parser has a single base for the deltas of an
+                    // application's page faults, with several fault threads
+                    // sending them they have to be absolute
+                    if (data->faultThreadCount > 1)
+                        *lastFaultTimestamp = 0;
+                    faultEmitter.emit(RecordType::PageFault, data->appId, timestampDelta(lastFaultTimestamp), page, pages, ptid, faultStack(page, ptid));
+                    if (faultEmitter.dropped())
+                        *lastFaultTimestamp = 0;
+                } else {
+                    faultEmitter.emit(RecordType::PageFault, data->appId, timestamp(), page, pages, ptid, faultStack(page, ptid));
+                }
+            };
+            if (data->faultBlock == Limits::PageSize) {
+                emitFault(1);
+                uffdio_zeropage zero = {
+                    .range = {
+                        .start = page,
+                        .len = Limits::PageSize
+                    },
+                    .mode = 0,
+                    .zeropage = 0
+                };
+                const auto ir = ioctl(fd, UFFDIO_ZEROPAGE, &zero);
+                if (ir == -1 && errno != EEXIST) {
+                    // boo
+                    close(fd);
+                    fd = -1;
+                    printf("- pagefault error 3 %d %d %m\n", ir, errno);
+                    return false;
+                }
+            } else {
+                // the rest of the fault's block is filled in too and
+                // counts as faulted from here on whether or not the
+                // application gets to touch it. Filling doesn't wake
+                // the thread so the record still goes first.
+                const int64_t filled = zeroFaults(fd, page, faultBlockEnd(page));
+                if (filled == -1) {
+                    close(fd);
+                    fd = -1;
+                    printf("- pagefault error 3 %m\n");
+                    return false;
+                }
+                if (filled > 0)
+                    emitFault(static_cast<uint32_t>(filled / Limits::PageSize));
+                uffdio_range wake = {
+                    .start = page,
+                    .len = filled > 0 ? static_cast<uint64_t>(filled) : Limits::PageSize
+                };
+                ioctl(fd, UFFDIO_WAKE, &wake);
+            }
+            if (hookStats != nullptr) {
+                hookStats->add(HookStats::PageFaults, 1);
+                hookStats->addTime(HookStats::PageFaultNs, faultStart);
+            }
+            // printf("  - handled pagefault\n");
+            break; }
+        case UFFD_EVENT_REMAP: {
+            const auto from = static_cast<uint64_t>(fault_msg.arg.remap.from);
+            const auto to = static_cast<uint64_t>(fault_msg.arg.remap.to);
+            const auto len = static_cast<uint64_t>(fault_msg.arg.remap.len);
+            emitter.emit(RecordType::PageRemap, data->appId, from, to, len);
+            break; }
+        case UFFD_EVENT_REMOVE:
+        case UFFD_EVENT_UNMAP: {
+            const auto start = static_cast<uint64_t>(fault_msg.arg.remove.start);
+            const auto end = static_cast<uint64_t>(fault_msg.arg.remove.end);
+            emitter.emit(RecordType::PageRemove, data->appId, start, end);
+            break; }
+        }
+    } else if (r != -1 || (errno != EWOULDBLOCK && errno != EAGAIN)) {
+        // read error
+        close(fd);
+        fd = -1;
+        printf("- pagefault error 2\n");
+        return false;
+    }
+    return true;
+}
+
+// Calls func(start, end, run) for the parts of the runs in a that aren't
+// covered by b, both sorted without overlaps
+template<typename Func>
+static void forEachUncovered(const std::vector<Data::ScannedRun>& a, const std::vector<Data::ScannedRun>& b, Func&& func)
+{
+    size_t first = 0;
+    for (const auto& run : a) {
+        while (first < b.size() && b[first].end <= run.start)
+            ++first;
+        uintptr_t cur = run.start;
+        for (size_t i = first; cur < run.end; ++i) {
+            if (i == b.size() || b[i].start >= run.end) {
+                func(cur, run.end, run);
+                break;
+            }
+            if (b[i].start > cur)
+                func(cur, b[i].start, run);
+            cur = std::max(cur, b[i].end);
+        }
+    }
+}
+
+// bits of the /proc/self/pagemap entries
+enum : uint64_t {
+    PagemapPresent = 1ull << 63,
+    PagemapExclusive = 1ull << 56,
+    PagemapSoftDirty = 1ull << 55,
+    PagemapPfnMask = (1ull << 55) - 1
+};
+
+// The tracked read/write mappings, page aligned. The hooks can't wait for
+// this to allocate while it holds the tracker lock, the vector is made big
+// enough before the lock is taken.
+static void readWriteMappings(std::vector<Data::ScannedRun>& regions)
+{
+    data->mmapTrackerLock.lock_shared();
+    const size_t count = data->mmapTracker.size();
+    data->mmapTrackerLock.unlock_shared();
+    regions.reserve(count + 64);
+    data->mmapTrackerLock.lock_shared();
+    data->mmapTracker.forEach([&regions](uintptr_t start, uintptr_t end, int32_t prot, int32_t /*flags*/, int32_t stack) {
+        if ((prot & (PROT_READ | PROT_WRITE)) == (PROT_READ | PROT_WRITE) && regions.size() < regions.capacity())
+            regions.push_back({ start, start + alignToPage(end - start), stack });
+    });
+    data->mmapTrackerLock.unlock_shared();
+}
+
+// Calls func(page, entry) for the /proc/self/pagemap entry of every page
+// in [start, end)
+template<typename Func>
+static void forEachPagemapEntry(int fd, uintptr_t start, uintptr_t end, Func&& func)
+{
+    uint64_t entries[512];
+    for (uintptr_t page = start; page < end;) {
+        const size_t pages = std::min<size_t>(std::size(entries), (end - page) / Limits::PageSize);
+        ssize_t r;
+        EINTRWRAP(r, ::pread(fd, entries, pages * sizeof(uint64_t), (page / Limits::PageSize) * sizeof(uint64_t)));
+        if (r <= 0)
+            break;
+        const size_t read = static_cast<size_t>(r) / sizeof(uint64_t);
+        for (size_t i = 0; i < read; ++i, page += Limits::PageSize) {
+            func(page, entries[i]);
+        }
+    }
+}
+
+// MTRACK_PAGE_SCAN, finds the resident pages of the tracked read/write
+// mappings in /proc/self/pagemap and sends what changed since the last scan
+// as PageFault and PageRemove records. The present bit doesn't need any
+// privileges, only the page frame numbers do. New pages are attributed to
+// the stack of their mapping.
+static void scanPages(PipeEmitter& emitter, uint64_t* lastFaultTimestamp)
+{
+    ScopedSpinlock scanLock(data->pageScanLock);
+    auto& scanned = data->scannedPages;
+
+    decltype(data->forgottenRanges) forgotten;
+    uint32_t forgottenCount;
+    {
+        ScopedSpinlock lock(data->pageForgetLock);
+        forgottenCount = data->forgottenCount;
+        memcpy(forgotten, data->forgottenRanges, sizeof(forgotten));
+        data->forgottenCount = 0;
+    }
+    // runs the parser might have been sent after the hook removed them are
+    // removed again
+    if (forgottenCount > Data::MaxForgottenRanges) {
+        forgotten[0].start = 0;
+        forgotten[0].end = UINTPTR_MAX;
+        forgottenCount = 1;
+    }
+    if (forgottenCount > 0) {
+        std::vector<Data::ScannedRun> gone;
+        gone.reserve(forgottenCount);
+        for (uint32_t i = 0; i < forgottenCount; ++i) {
+            gone.push_back({ forgotten[i].start, forgotten[i].end, 0 });
+        }
+        std::sort(gone.begin(), gone.end(), [](const auto& a, const auto& b) {
+            return a.start < b.start;
+        });
+        // merge, the same range can be forgotten more than once
+        size_t merged = 0;
+        for (size_t i = 1; i < gone.size(); ++i) {
+            if (gone[i].start <= gone[merged].end) {
+                gone[merged].end = std::max(gone[merged].end, gone[i].end);
+            } else {
+                gone[++merged] = gone[i];
+            }
+        }
+        gone.resize(merged + 1);
+        std::vector<Data::ScannedRun> kept;
+        kept.reserve(scanned.size() + gone.size());
+        forEachUncovered(scanned, gone, [&kept](uintptr_t start, uintptr_t end, const Data::ScannedRun& run) {
+            kept.push_back({ start, end, run.stack });
+        });
+        forEachUncovered(scanned, kept, [&emitter](uintptr_t start, uintptr_t end, const Data::ScannedRun&) {
+            emitter.emit(RecordType::PageRemove, data->appId, static_cast<uint64_t>(start), static_cast<uint64_t>(end));
+        });
+        scanned = std::move(kept);
+    }
+
+    if (dormant())
+        return;
+
+    std::vector<Data::ScannedRun> regions;
+    readWriteMappings(regions);
+
+    int fd;
+    EINTRWRAP(fd, ::open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC));
+    if (fd == -1)
+        return;
+
+    std::vector<Data::ScannedRun> resident;
+    resident.reserve(scanned.size() + 64);
+    for (const auto& region : regions) {
+        uintptr_t runStart = 0;
+        forEachPagemapEntry(fd, region.start, region.end, [&](uintptr_t page, uint64_t entry) {
+            // swapped out pages don't count
+            const bool present = entry & PagemapPresent;
+            if (present && runStart == 0) {
+                runStart = page;
+            } else if (!present && runStart != 0) {
+                resident.push_back({ runStart, page, region.stack });
+                runStart = 0;
+            }
+        });
+        if (runStart != 0)
+            resident.push_back({ runStart, region.end, region.stack });
+    }
+    int e;
+    EINTRWRAP(e, ::close(fd));
+
+    forEachUncovered(resident, scanned, [&emitter, lastFaultTimestamp](uintptr_t start, uintptr_t end, const Data::ScannedRun& run) {
+        const auto pages = static_cast<uint32_t>((end - start) / Limits::PageSize);
+        const auto stack = static_cast<uint32_t>(run.stack);
+        if (data->timestampMode == TimestampMode::Nanoseconds) {
+            emitter.emit(RecordType::PageFault, data->appId, timestampDelta(lastFaultTimestamp), static_cast<uint64_t>(start), pages, static_cast<uint32_t>(0), stack);
+        } else {
+            emitter.emit(RecordType::PageFault, data->appId, timestamp(), static_cast<uint64_t>(start), pages, static_cast<uint32_t>(0), stack);
+        }
+    });
+    forEachUncovered(scanned, resident, [&emitter](uintptr_t start, uintptr_t end, const Data::ScannedRun&) {
+        emitter.emit(RecordType::PageRemove, data->appId, static_cast<uint64_t>(start), static_cast<uint64_t>(end));
+    });
+    scanned = std::move(resident);
+}
+
+// MTRACK_WORKING_SET, counts the resident pages of every tracked read/write
+// mapping that were used since the last scan and sends them as WorkingSet
+// records, then starts the next interval. Written pages are the ones with
+// the soft-dirty bit, which /proc/self/clear_refs clears for the whole
+// process. Reads are only seen if the idle page bitmap could be opened,
+// which takes CAP_SYS_ADMIN for the page frame numbers as well, and only
+// for pages that aren't shared.
+static void scanWorkingSet()
+{
+    if (dormant())
+        return;
+
+    enum {
+        EntrySize = sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint32_t),
+        MaxEntries = 128
+    };
+    static_assert(EntrySize * MaxEntries + 32 <= PIPE_BUF);
+
+    std::vector<Data::ScannedRun> regions;
+    readWriteMappings(regions);
+
+    int fd;
+    EINTRWRAP(fd, ::open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC));
+    if (fd == -1)
+        return;
+
+    // an idle bit is set by writing it, and cleared by the kernel when the
+    // page is accessed. The pages of a mapping are collected and sorted on
+    // their frame so that the bitmap is read and written a run of words at
+    // a time instead of a word per page. Zero bits are ignored by the
+    // kernel, the words can be written back with only our bits set.
+    struct IdlePage {
+        uint64_t pfn;
+        bool dirty;
+    };
+    std::vector<IdlePage> idlePages;
+    auto countIdle = [&idlePages](uint32_t& hot, uint32_t& cold) {
+        enum { MaxWords = 512 };
+        std::sort(idlePages.begin(), idlePages.end(), [](const IdlePage& a, const IdlePage& b) {
+            return a.pfn < b.pfn;
+        });
+        uint64_t bits[MaxWords];
+        uint64_t mask[MaxWords];
+        for (size_t i = 0; i < idlePages.size();) {
+            const uint64_t firstWord = idlePages[i].pfn / 64;
+            size_t end = i + 1;
+            while (end < idlePages.size() && idlePages[end].pfn / 64 - firstWord < MaxWords)
+                ++end;
+            const size_t words = idlePages[end - 1].pfn / 64 - firstWord + 1;
+            const off_t offset = static_cast<off_t>(firstWord * sizeof(uint64_t));
+            ssize_t r;
+            EINTRWRAP(r, ::pread(data->pageIdleFd, bits, words * sizeof(uint64_t), offset));
+            const size_t read = r > 0 ? static_cast<size_t>(r) / sizeof(uint64_t) : 0;
+            memset(mask, 0, words * sizeof(uint64_t));
+            for (; i < end; ++i) {
+                const size_t word = idlePages[i].pfn / 64 - firstWord;
+                const uint64_t bit = 1ull << (idlePages[i].pfn % 64);
+                const bool wasIdle = word < read && (bits[word] & bit);
+                if (idlePages[i].dirty || !wasIdle) {
+                    ++hot;
+                } else {
+                    ++cold;
+                }
+                mask[word] |= bit;
+            }
+            EINTRWRAP(r, ::pwrite(data->pageIdleFd, mask, words * sizeof(uint64_t), offset));
+        }
+        idlePages.clear();
+    };
+
+    PipeEmitter emitter(data->emitPipe[1]);
+    uint8_t buf[EntrySize * MaxEntries];
+    uint32_t entries = 0;
+    const uint64_t now = timestampNs();
+    auto send = [&](bool done) {
+        emitter.emit(RecordType::WorkingSet, data->appId, now, static_cast<uint8_t>(done), Emitter::Data(buf, entries * EntrySize));
+        entries = 0;
+    };
+    const bool primed = data->workingSetPrimed;
+    for (const auto& region : regions) {
+        uint32_t hot = 0, cold = 0;
+        forEachPagemapEntry(fd, region.start, region.end, [&](uintptr_t /*page*/, uint64_t entry) {
+            if (!(entry & PagemapPresent))
+                return;
+            const bool dirty = entry & PagemapSoftDirty;
+            const uint64_t pfn = entry & PagemapPfnMask;
+            // the idle bit of a frame is shared by everything mapping it,
+            // the zero page that UFFDIO_ZEROPAGE fills in is never idle.
+            // Only the soft-dirty bit says something about shared pages.
+            if (data->pageIdleFd != -1 && pfn != 0 && (entry & PagemapExclusive)) {
+                idlePages.push_back({ pfn, dirty });
+            } else if (dirty) {
+                ++hot;
+            } else {
+                ++cold;
+            }
+        });
+        if (!idlePages.empty())
+            countIdle(hot, cold);
+        if (!primed || hot + cold == 0)
+            continue;
+        const auto stack = static_cast<uint32_t>(region.stack);
+        const auto start = static_cast<uint64_t>(region.start);
+        const auto end = static_cast<uint64_t>(region.end);
+        uint8_t* entry = buf + (entries * EntrySize);
+        memcpy(entry, &stack, sizeof(stack));
+        memcpy(entry + 4, &start, sizeof(start));
+        memcpy(entry + 12, &end, sizeof(end));
+        memcpy(entry + 20, &hot, sizeof(hot));
+        memcpy(entry + 24, &cold, sizeof(cold));
+        if (++entries == MaxEntries)
+            send(false);
+    }
+    if (primed)
+        send(true);
+    int e;
+    EINTRWRAP(e, ::close(fd));
+
+    EINTRWRAP(fd, ::open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC));
+    ssize_t w = -1;
+    if (fd != -1) {
+        EINTRWRAP(w, ::write(fd, "4", 1));
+        EINTRWRAP(e, ::close(fd));
+    }
+    if (w != 1) {
+        printf("can't clear the soft-dirty bits, no working set %m\n");
+        data->workingSetInterval = 0;
+        return;
+    }
+    data->workingSetPrimed = true;
+}
+
 static void hookThread()
 {
     ::tlsData()->hooked = false;
 
     PipeEmitter emitter(data->emitPipe[1]);
+    PipeEmitter faultEmitter(data->emitPipe[1], PipeEmitter::Delivery::Droppable);
+    uint64_t lastFaultTimestamp = 0;
+
+    int timeout = 1000;
+    if (data->callsites != nullptr)
+        timeout = std::min(timeout, static_cast<int>(data->aggregateInterval));
+    if (hookStats != nullptr)
+        timeout = std::min(timeout, static_cast<int>(data->statsInterval));
+    if (data->pageScanInterval != 0)
+        timeout = std::min(timeout, static_cast<int>(data->pageScanInterval));
+    if (data->workingSetInterval != 0)
+        timeout = std::min(timeout, static_cast<int>(data->workingSetInterval));
+    uint64_t lastFlush = 0, lastStats = 0, lastScan = 0, lastWorkingSet = 0;
+    auto maybeFlush = [&]() {
+        if (data->callsites == nullptr && hookStats == nullptr && data->pageScanInterval == 0 && data->workingSetInterval == 0)
+            return;
+        const uint64_t now = timestampNs();
+        if (data->callsites != nullptr && now - lastFlush >= data->aggregateInterval * 1000000ull) {
+            lastFlush = now;
+            flushCallsites();
+        }
+        if (hookStats != nullptr && now - lastStats >= data->statsInterval * 1000000ull) {
+            lastStats = now;
+            sendHookStats();
+        }
+        if (data->pageScanInterval != 0 && now - lastScan >= data->pageScanInterval * 1000000ull) {
+            lastScan = now;
+            scanPages(emitter, &lastFaultTimestamp);
+        }
+        if (data->workingSetInterval != 0 && now - lastWorkingSet >= data->workingSetInterval * 1000000ull) {
+            lastWorkingSet = now;
+            scanWorkingSet();
+        }
+    };
 
     pollfd evt[] = {
-        { .fd = data->faultFd, .events = POLLIN, .revents = 0 },
+        { .fd = data->faultFds[0], .events = POLLIN, .revents = 0 },
         { .fd = data->pfThreadPipe[0], .events = POLLIN, .revents = 0 }
     };
     for (;;) {
         // printf("- top of fault thread\n");
-        switch (poll(evt, 2, 1000)) {
+        switch (poll(evt, 2, timeout)) {
         case -1:
             return;
         case 0:
+            maybeFlush();
             continue;
         default:
             break;
         }
 
+        maybeFlush();
+
         // printf("- fault thread 0\n");
-        if (data->modulesDirty.load(std::memory_order_acquire)) {
-            dl_iterate_phdr(dl_iterate_phdr_callback, nullptr);
-            data->modulesDirty.store(false, std::memory_order_release);
-        }
+        updateModules();
 
         // printf("- fault thread 1 %d %d\n", evt[0].revents, evt[1].revents);
 
         if (evt[0].revents & (POLLERR | POLLHUP)) {
             // done?
-            close(data->faultFd);
-            data->faultFd = -1;
+            close(data->faultFds[0]);
+            data->faultFds[0] = -1;
             printf("- pagefault error 1\n");
             return;
         }
         // printf("- fault thread 2\n");
-        if (evt[0].revents & POLLIN) {
-            uffd_msg fault_msg = {};
-            const auto r = read(data->faultFd, &fault_msg, sizeof(fault_msg));
-            if (r == sizeof(fault_msg)) {
-                // printf("- fault thread 3 0x%x\n", fault_msg.event);
-                switch (fault_msg.event) {
-                case UFFD_EVENT_PAGEFAULT: {
-                    const auto place = static_cast<uint64_t>(fault_msg.arg.pagefault.address);
-                    const auto ptid = static_cast<uint32_t>(fault_msg.arg.pagefault.feat.ptid);
-                    // printf("  - pagefault %u\n", ptid);
-                    emitter.emit(RecordType::PageFault, data->appId, timestamp(), place, ptid, Stack(2, ptid));
-                    uffdio_zeropage zero = {
-                        .range = {
-                            .start = place & ~(Limits::PageSize - 1),
-                            .len = Limits::PageSize
-                        },
-                        .mode = 0,
-                        .zeropage = 0
-                    };
-                    const auto ir = ioctl(data->faultFd, UFFDIO_ZEROPAGE, &zero);
-                    if (ir == -1 && errno != EEXIST) {
-                        // boo
-                        close(data->faultFd);
-                        data->faultFd = -1;
-                        printf("- pagefault error 3 %d %d %m\n", ir, errno);
-                        return;
-                    }
-                    // printf("  - handled pagefault\n");
-                    break; }
-                case UFFD_EVENT_REMAP: {
-                    const auto from = static_cast<uint64_t>(fault_msg.arg.remap.from);
-                    const auto to = static_cast<uint64_t>(fault_msg.arg.remap.to);
-                    const auto len = static_cast<uint64_t>(fault_msg.arg.remap.len);
-                    emitter.emit(RecordType::PageRemap, data->appId, from, to, len);
-                    break; }
-                case UFFD_EVENT_REMOVE:
-                case UFFD_EVENT_UNMAP: {
-                    const auto start = static_cast<uint64_t>(fault_msg.arg.remove.start);
-                    const auto end = static_cast<uint64_t>(fault_msg.arg.remove.end);
-                    emitter.emit(RecordType::PageRemove, data->appId, start, end);
-                    break; }
+        if ((evt[0].revents & POLLIN) && !handleFault(data->faultFds[0], emitter, faultEmitter, &lastFaultTimestamp))
+            return;
+        if (evt[1].revents & POLLIN) {
+            // 'q' to quit, 't' from the toggle signal handler
+            bool quit = false;
+            char cmd;
+            while (::read(data->pfThreadPipe[0], &cmd, sizeof(cmd)) == sizeof(cmd)) {
+                if (cmd == 'q') {
+                    quit = true;
+                } else if (cmd == 't') {
+                    setTracking(dormant());
                 }
-            } else if (r != -1 || (errno != EWOULDBLOCK && errno != EAGAIN)) {
-                // read error
-                close(data->faultFd);
-                data->faultFd = -1;
-                printf("- pagefault error 2\n");
-                return;
             }
-        }
-        if (evt[1].revents & POLLIN) {
-            break;
+            if (quit) {
+                if (data->callsites != nullptr)
+                    flushCallsites();
+                if (hookStats != nullptr)
+                    sendHookStats();
+                break;
+            }
         }
         // printf("- fault thread 4\n");
     }
     printf("- end of fault thread\n");
 }
 
+// The fault threads after the first only handle their own userfaultfd
+static void faultThread(uint32_t idx)
+{
+    ::tlsData()->hooked = false;
+
+    PipeEmitter emitter(data->emitPipe[1]);
+    PipeEmitter faultEmitter(data->emitPipe[1], PipeEmitter::Delivery::Droppable);
+    uint64_t lastFaultTimestamp = 0;
+
+    int& fd = data->faultFds[idx];
+    pollfd evt[] = {
+        { .fd = fd, .events = POLLIN, .revents = 0 },
+        { .fd = data->faultQuitFd, .events = POLLIN, .revents = 0 }
+    };
+    for (;;) {
+        if (poll(evt, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (evt[1].revents & POLLIN)
+            return;
+
+        // the stack of the fault might be in a module that hasn't been sent
+        updateModules();
+
+        if (evt[0].revents & (POLLERR | POLLHUP)) {
+            close(fd);
+            fd = -1;
+            printf("- pagefault error 1\n");
+            return;
+        }
+        if ((evt[0].revents & POLLIN) && !handleFault(fd, emitter, faultEmitter, &lastFaultTimestamp))
+            return;
+    }
+}
+
+static void startFaultThreads()
+{
+    for (uint32_t i = 1; i < data->faultThreadCount; ++i) {
+        new (&data->faultThreads[i - 1]) std::thread(faultThread, i);
+    }
+}
+
 static void hookCleanup()
 {
     // might be a race here if the process exits really quickly
     if (!data->isShutdown.test_and_set()) {
-        if (data->faultFd == -1) {
-            close(data->faultFd);
-            data->faultFd = -1;
+        if (data->faultFds[0] == -1) {
+            close(data->faultFds[0]);
+            data->faultFds[0] = -1;
         }
         int w;
         EINTRWRAP(w, ::write(data->pfThreadPipe[1], "q", 1));
         data->thread.join();
+        if (data->faultQuitFd != -1) {
+            const uint64_t quit = 1;
+            EINTRWRAP(w, ::write(data->faultQuitFd, &quit, sizeof(quit)));
+            for (uint32_t i = 1; i < data->faultThreadCount; ++i) {
+                data->faultThreads[i - 1].join();
+            }
+        }
     }
     NoHook noHook;
+    if (getpid() == data->ownPid) {
+        // tells the parser this wasn't a crash
+        PipeEmitter emitter(data->emitPipe[1]);
+        emitter.emit(RecordType::Exit, data->appId);
+    }
+    if (hookStats != nullptr) {
+        char path[64];
+        HookStats::path(path, sizeof(path), getpid());
+        ::unlink(path);
+    }
     Data *d = data;
     data = nullptr;
 
@@ -390,109 +1613,485 @@ static void hookCleanup()
         EINTRWRAP(e, ::close(d->emitPipe[1]));
         d->emitPipe[1] = -1;
     }
-    printf("Calling waitpid %d\n", d->pid);
-    int r;
-    int wstatus = 0;
-    EINTRWRAP(r, ::waitpid(d->pid, &wstatus, 0));
-    printf("Waitpid returned %d -> %d (%d)\n", r, wstatus, WEXITSTATUS(wstatus));
+    const auto stackCache = Stack::cacheStats();
+    if (stackCache.hits + stackCache.misses > 0) {
+        printf("Stack cache hits %llu/%llu, reused %llu of %llu frames\n",
+               static_cast<unsigned long long>(stackCache.hits),
+               static_cast<unsigned long long>(stackCache.hits + stackCache.misses),
+               static_cast<unsigned long long>(stackCache.framesReused),
+               static_cast<unsigned long long>(stackCache.framesReused + stackCache.framesWalked));
+    }
+    if (d->pid != 0) {
+        printf("Calling waitpid %d\n", d->pid);
+        int r;
+        int wstatus = 0;
+        EINTRWRAP(r, ::waitpid(d->pid, &wstatus, 0));
+        printf("Waitpid returned %d -> %d (%d)\n", r, wstatus, WEXITSTATUS(wstatus));
+    }
     delete d;
 }
 
+static int createFaultFd()
+{
+    const int fd = syscall(SYS_userfaultfd, O_NONBLOCK);
+    if (fd == -1)
+        return -1;
+
+    uffdio_api api = {
+        .api = UFFD_API,
+        .features = UFFD_FEATURE_THREAD_ID,
+        .ioctls = 0
+    };
+    if (ioctl(fd, UFFDIO_API, &api) || api.api != UFFD_API) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Creates a userfaultfd per fault thread and the eventfd that stops them
+static bool createFaultFds()
+{
+    if (data->pageScanInterval != 0) {
+        data->faultFds[0] = -1;
+        return true;
+    }
+    for (uint32_t i = 0; i < data->faultThreadCount; ++i) {
+        data->faultFds[i] = createFaultFd();
+        if (data->faultFds[i] == -1)
+            return false;
+    }
+    if (data->faultThreadCount > 1) {
+        data->faultQuitFd = eventfd(0, EFD_CLOEXEC);
+        if (data->faultQuitFd == -1)
+            return false;
+    }
+    return true;
+}
+
+static void closeFaultFds()
+{
+    int e;
+    for (uint32_t i = 0; i < data->faultThreadCount; ++i) {
+        if (data->faultFds[i] != -1)
+            EINTRWRAP(e, ::close(data->faultFds[i]));
+    }
+    if (data->faultQuitFd != -1) {
+        EINTRWRAP(e, ::close(data->faultQuitFd));
+        data->faultQuitFd = -1;
+    }
+}
+
+static int connectDaemon(const char* path, uint8_t* appId)
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    const int fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    int e;
+    EINTRWRAP(e, ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)));
+    if (e == 0) {
+        // the daemon hands out the appId for this process, 0 means it's full
+        *appId = 0;
+        EINTRWRAP(e, ::read(fd, appId, sizeof(*appId)));
+        if (e == sizeof(*appId) && *appId != 0) {
+            return fd;
+        }
+    }
+    EINTRWRAP(e, ::close(fd));
+    return -1;
+}
+
+static uint8_t reserveAppId()
+{
+    if (data->daemonPath != nullptr) {
+        // the connection is only used to get an id, the child keeps
+        // writing to the socket it inherited
+        uint8_t appId = 0;
+        const int fd = connectDaemon(data->daemonPath, &appId);
+        if (fd == -1)
+            return 0;
+        int e;
+        EINTRWRAP(e, ::close(fd));
+        return appId;
+    }
+    const auto appId = data->nextAppId->fetch_add(1, std::memory_order_relaxed);
+    return appId <= UINT8_MAX ? static_cast<uint8_t>(appId) : 0;
+}
+
+// Nothing may hold the locks while the process is copied, the forking
+// thread is the only one that exists in the child.
+static void hookForkPrepare()
+{
+    if (data == nullptr)
+        return;
+    // before the locks, defining a stack sends it
+    if (data->stackTable != nullptr)
+        data->stackTable->beginFork();
+    data->pageScanLock.lock();
+    data->modulesLock.lock();
+    data->mmapTrackerLock.lock();
+    data->faultStackLock.lock();
+    data->pageForgetLock.lock();
+}
+
+static void hookForkParent()
+{
+    if (data == nullptr)
+        return;
+    data->pageForgetLock.unlock();
+    data->faultStackLock.unlock();
+    data->mmapTrackerLock.unlock();
+    data->modulesLock.unlock();
+    data->pageScanLock.unlock();
+    if (data->stackTable != nullptr)
+        data->stackTable->endFork();
+}
+
+// The child keeps writing to the pipe, socket or rings it inherited so its
+// Fork record is ordered after everything the parent sent before the fork.
+// The parser starts the child off with a copy of the parent's state. vfork
+// and posix_spawn children share the parent's memory and don't run this.
+static void hookForkChild()
+{
+    // the forking thread is the only one left and it has a new tid
+    tls.tid = 0;
+    tls.lastTimestamp = 0;
+
+    if (data == nullptr)
+        return;
+    hookForkParent();
+
+    NoHook nohook;
+
+    // the parser is not our child
+    data->pid = 0;
+
+    // the child's soft-dirty bits weren't cleared by its own scan
+    data->workingSetPrimed = false;
+
+    // the stats page is the parent's
+    if (hookStats != nullptr) {
+        hookStats = nullptr;
+        PipeEmitter::setHookStats(nullptr);
+        Stack::setHookStats(nullptr);
+    }
+
+    // the child writes to rings of its own even when it's reported as its parent
+    if (data->shmTransport != nullptr) {
+        data->shmTransport->forked();
+    }
+
+    const auto appId = reserveAppId();
+    if (appId == 0) {
+        // and it doesn't send an Exit, ownPid stays the parent's
+        safePrint("no appId for the forked child, it is reported as its parent\n");
+        return;
+    }
+    data->ownPid = getpid();
+
+    const auto parentAppId = data->appId;
+    data->appId = appId;
+    {
+        PipeEmitter emitter(data->emitPipe[1]);
+        emitter.emit(RecordType::Fork, parentAppId, appId, static_cast<uint32_t>(getpid()));
+    }
+
+    // the child has no fault threads and its mappings lost their
+    // userfaultfd registration
+    int e;
+    closeFaultFds();
+    EINTRWRAP(e, ::close(data->pfThreadPipe[0]));
+    EINTRWRAP(e, ::close(data->pfThreadPipe[1]));
+    if (!createFaultFds()) {
+        safePrint("could not initialize userfaultfd in the forked child\n");
+        abort();
+    }
+    if (::pipe2(data->pfThreadPipe, O_NONBLOCK) == -1) {
+        safePrint("no pfThreadPipe in the forked child\n");
+        abort();
+    }
+    if (!dormant()) {
+        // the stacks from the baseline aren't registered, see setTracking
+        data->mmapTracker.forEach([](uintptr_t start, uintptr_t end, int32_t prot, int32_t flags, int32_t /*stack*/) {
+            if ((prot & (PROT_READ | PROT_WRITE)) == (PROT_READ | PROT_WRITE) && !(flags & MAP_STACK)) {
+                registerFaults(reinterpret_cast<void*>(start), end - start);
+            }
+        });
+    }
+
+    // the handles refer to the parent's fault threads, they can't be joined
+    new (&data->thread) std::thread(hookThread);
+    startFaultThreads();
+}
+
 void Hooks::hook()
 {
     unsetenv("LD_PRELOAD");
 
-    callbacks.mmap = reinterpret_cast<MmapSig>(dlsym(RTLD_NEXT, "mmap"));
+    callbacks.mmap = reinterpret_cast<MmapSig>(dlsym(NextObject, "mmap"));
     if (callbacks.mmap == nullptr) {
         safePrint("no mmap\n");
         abort();
     }
-    callbacks.mmap64 = reinterpret_cast<Mmap64Sig>(dlsym(RTLD_NEXT, "mmap64"));
+    callbacks.mmap64 = reinterpret_cast<Mmap64Sig>(dlsym(NextObject, "mmap64"));
     if (callbacks.mmap64 == nullptr) {
         safePrint("no mmap64\n");
         abort();
     }
-    callbacks.munmap = reinterpret_cast<MunmapSig>(dlsym(RTLD_NEXT, "munmap"));
+    callbacks.munmap = reinterpret_cast<MunmapSig>(dlsym(NextObject, "munmap"));
     if (callbacks.munmap == nullptr) {
         safePrint("no munmap\n");
         abort();
     }
-    callbacks.mremap = reinterpret_cast<MremapSig>(dlsym(RTLD_NEXT, "mremap"));
+    callbacks.mremap = reinterpret_cast<MremapSig>(dlsym(NextObject, "mremap"));
     if (callbacks.mremap == nullptr) {
         safePrint("no mremap\n");
         abort();
     }
-    callbacks.madvise = reinterpret_cast<MadviseSig>(dlsym(RTLD_NEXT, "madvise"));
+    callbacks.madvise = reinterpret_cast<MadviseSig>(dlsym(NextObject, "madvise"));
     if (callbacks.madvise == nullptr) {
         safePrint("no madvise\n");
         abort();
     }
-    callbacks.mprotect = reinterpret_cast<MprotectSig>(dlsym(RTLD_NEXT, "mprotect"));
+    callbacks.mprotect = reinterpret_cast<MprotectSig>(dlsym(NextObject, "mprotect"));
     if (callbacks.mprotect == nullptr) {
         safePrint("no mprotect\n");
         abort();
     }
-    callbacks.dlopen = reinterpret_cast<DlOpenSig>(dlsym(RTLD_NEXT, "dlopen"));
+    callbacks.dlopen = reinterpret_cast<DlOpenSig>(dlsym(NextObject, "dlopen"));
     if (callbacks.dlopen == nullptr) {
         safePrint("no dlopen\n");
         abort();
     }
-    callbacks.dlclose = reinterpret_cast<DlCloseSig>(dlsym(RTLD_NEXT, "dlclose"));
+    callbacks.dlclose = reinterpret_cast<DlCloseSig>(dlsym(NextObject, "dlclose"));
     if (callbacks.dlclose == nullptr) {
         safePrint("no dlclose\n");
         abort();
     }
-    callbacks.pthread_setname_np = reinterpret_cast<PthreadSetnameSig>(dlsym(RTLD_NEXT, "pthread_setname_np"));
+    callbacks.pthread_setname_np = reinterpret_cast<PthreadSetnameSig>(dlsym(NextObject, "pthread_setname_np"));
     if (callbacks.pthread_setname_np == nullptr) {
         safePrint("no pthread_setname_np\n");
         abort();
     }
 
-    callbacks.malloc = reinterpret_cast<MallocSig>(dlsym(RTLD_NEXT, "malloc"));
+    callbacks.malloc = reinterpret_cast<MallocSig>(dlsym(NextObject, "malloc"));
     if (callbacks.malloc == nullptr) {
         safePrint("no malloc\n");
         abort();
     }
 
-    callbacks.free = reinterpret_cast<FreeSig>(dlsym(RTLD_NEXT, "free"));
+    callbacks.free = reinterpret_cast<FreeSig>(dlsym(NextObject, "free"));
     if (callbacks.free == nullptr) {
         safePrint("no free\n");
         abort();
     }
 
-    callbacks.calloc = reinterpret_cast<CallocSig>(dlsym(RTLD_NEXT, "calloc"));
+    callbacks.calloc = reinterpret_cast<CallocSig>(dlsym(NextObject, "calloc"));
     if (callbacks.calloc == nullptr) {
         safePrint("no calloc\n");
         abort();
     }
 
-    callbacks.realloc = reinterpret_cast<ReallocSig>(dlsym(RTLD_NEXT, "realloc"));
+    callbacks.realloc = reinterpret_cast<ReallocSig>(dlsym(NextObject, "realloc"));
     if (callbacks.realloc == nullptr) {
         safePrint("no realloc\n");
         abort();
     }
 
-    callbacks.posix_memalign = reinterpret_cast<Posix_MemalignSig>(dlsym(RTLD_NEXT, "posix_memalign"));
+    callbacks.posix_memalign = reinterpret_cast<Posix_MemalignSig>(dlsym(NextObject, "posix_memalign"));
     if (callbacks.posix_memalign == nullptr) {
         safePrint("no posix_memalign\n");
         abort();
     }
 
-    callbacks.aligned_alloc = reinterpret_cast<Aligned_AllocSig>(dlsym(RTLD_NEXT, "aligned_alloc"));
+    callbacks.aligned_alloc = reinterpret_cast<Aligned_AllocSig>(dlsym(NextObject, "aligned_alloc"));
     if (callbacks.aligned_alloc == nullptr) {
         safePrint("no aligned_alloc\n");
         abort();
     }
 
-    callbacks.reallocarray = reinterpret_cast<ReallocArraySig>(dlsym(RTLD_NEXT, "reallocarray"));
+    callbacks.reallocarray = reinterpret_cast<ReallocArraySig>(dlsym(NextObject, "reallocarray"));
+
+    // libc's own exec functions call execve internally, every one of them
+    // is hooked so that an exec isn't mistaken for a crash
+    callbacks.execve = reinterpret_cast<ExecveSig>(dlsym(NextObject, "execve"));
+    callbacks.execv = reinterpret_cast<ExecvSig>(dlsym(NextObject, "execv"));
+    callbacks.execvp = reinterpret_cast<ExecvSig>(dlsym(NextObject, "execvp"));
+    callbacks.execvpe = reinterpret_cast<ExecveSig>(dlsym(NextObject, "execvpe"));
+    callbacks.fexecve = reinterpret_cast<FexecveSig>(dlsym(NextObject, "fexecve"));
+    if (!callbacks.execve || !callbacks.execv || !callbacks.execvp || !callbacks.execvpe || !callbacks.fexecve) {
+        safePrint("no exec\n");
+        abort();
+    }
 
     data = new Data();
+    data->ownPid = getpid();
 
-    if (::pipe2(data->emitPipe, O_DIRECT) == -1) {
+    // whatever gets exec'ed doesn't keep the parser waiting for the pipe
+    // to close, the parser's own end is dup'ed onto its stdin
+    if (::pipe2(data->emitPipe, O_DIRECT | O_CLOEXEC) == -1) {
         safePrint("no emitPipe\n");
         abort();
     }
 
+    {
+        enum { StackTableCapacity = 1024 * 1024 };
+        const auto size = StackTable::mappingSize(StackTableCapacity);
+        void* mem = callbacks.mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED) {
+            safePrint("no stack table\n");
+            abort();
+        }
+        data->stackTable = new StackTable(mem, StackTableCapacity);
+        data->ownMappings[0] = { reinterpret_cast<uintptr_t>(mem), reinterpret_cast<uintptr_t>(mem) + size };
+    }
+
+    // MTRACK_AGGREGATE=<flush interval in ms>, sampling doesn't apply since
+    // the parser can't scale sums of sampled sizes back up
+    const auto aggregate = getenv("MTRACK_AGGREGATE");
+    if (aggregate != nullptr && strtoul(aggregate, nullptr, 10) > 0) {
+        // one counter per stack id, the allocation map has room for as many
+        // live allocations as the sampled pointer set
+        enum { CallsiteCapacity = 1024 * 1024, AllocationCapacity = 1024 * 1024 };
+        const auto callsitesSize = CallsiteTable::mappingSize(CallsiteCapacity);
+        const auto allocationsSize = AllocationMap::mappingSize(AllocationCapacity);
+        void* callsitesMem = callbacks.mmap(nullptr, callsitesSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        void* allocationsMem = callbacks.mmap(nullptr, allocationsSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (callsitesMem != MAP_FAILED && allocationsMem != MAP_FAILED) {
+            data->callsites = new CallsiteTable(callsitesMem, CallsiteCapacity);
+            data->allocations = new AllocationMap(allocationsMem, AllocationCapacity);
+            data->aggregateInterval = static_cast<uint32_t>(strtoul(aggregate, nullptr, 10));
+            data->ownMappings[2] = { reinterpret_cast<uintptr_t>(callsitesMem), reinterpret_cast<uintptr_t>(callsitesMem) + callsitesSize };
+            data->ownMappings[3] = { reinterpret_cast<uintptr_t>(allocationsMem), reinterpret_cast<uintptr_t>(allocationsMem) + allocationsSize };
+        } else {
+            safePrint("no aggregation tables\n");
+        }
+    }
+
+    // MTRACK_STATS=<interval in ms>, the counters are in a file in /dev/shm
+    // for other processes to read while this one runs
+    const auto stats = getenv("MTRACK_STATS");
+    if (stats != nullptr && strtoul(stats, nullptr, 10) > 0) {
+        char path[64];
+        HookStats::path(path, sizeof(path), getpid());
+        void* mem = MAP_FAILED;
+        // /dev/shm is world writable, what's there from a process that had
+        // the pid before goes and anything planted in its place since makes
+        // the open fail instead of following it
+        ::unlink(path);
+        int fd;
+        EINTRWRAP(fd, ::open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644));
+        if (fd != -1) {
+            if (::ftruncate(fd, sizeof(HookStats)) == 0)
+                mem = callbacks.mmap(nullptr, sizeof(HookStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            int e;
+            EINTRWRAP(e, ::close(fd));
+        }
+        if (mem != MAP_FAILED) {
+            hookStats = static_cast<HookStats*>(mem);
+            hookStats->init(getpid());
+            data->statsInterval = static_cast<uint32_t>(strtoul(stats, nullptr, 10));
+            PipeEmitter::setHookStats(hookStats);
+            Stack::setHookStats(hookStats);
+        } else {
+            safePrint("no stats page\n");
+        }
+    }
+
+    const auto sampleRate = data->callsites == nullptr ? getenv("MTRACK_SAMPLE_RATE") : nullptr;
+    if (sampleRate != nullptr) {
+        data->sampleRate = strtoull(sampleRate, nullptr, 10);
+        if (data->sampleRate > 0) {
+            // plenty for the live sampled allocations, pages are only
+            // touched as the set fills up
+            enum { SampledPointersCapacity = 1024 * 1024 };
+            const auto size = PointerSet::mappingSize(SampledPointersCapacity);
+            void* mem = callbacks.mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (mem != MAP_FAILED) {
+                data->sampledPointers = new PointerSet(mem, SampledPointersCapacity);
+                data->ownMappings[1] = { reinterpret_cast<uintptr_t>(mem), reinterpret_cast<uintptr_t>(mem) + size };
+                data->filterFrees.store(true, std::memory_order_release);
+            }
+        }
+    }
+
+    for (auto& limit : data->stackLimits) {
+        limit = { 0, Stack::MaxDepth };
+    }
+    const auto stackDepth = getenv("MTRACK_STACK_DEPTH");
+    if (stackDepth != nullptr) {
+        parseStackLimits(stackDepth, &Data::StackLimit::depth);
+    }
+    const auto stackSkip = getenv("MTRACK_STACK_SKIP");
+    if (stackSkip != nullptr) {
+        parseStackLimits(stackSkip, &Data::StackLimit::skip);
+    }
+
+    // MTRACK_FAULT_BLOCK=<bytes>, optionally with a k or m suffix
+    const auto faultBlock = getenv("MTRACK_FAULT_BLOCK");
+    if (faultBlock != nullptr) {
+        char* suffix;
+        uint64_t block = strtoull(faultBlock, &suffix, 10);
+        if (*suffix == 'k' || *suffix == 'K') {
+            block <<= 10;
+        } else if (*suffix == 'm' || *suffix == 'M') {
+            block <<= 20;
+        }
+        data->faultBlock = std::max(nextPowerOfTwo(block), Limits::PageSize);
+    }
+
+    // MTRACK_FAULT_THREADS=<n>, page faults are handled by n threads
+    const auto faultThreads = getenv("MTRACK_FAULT_THREADS");
+    if (faultThreads != nullptr) {
+        data->faultThreadCount = std::clamp<uint32_t>(strtoul(faultThreads, nullptr, 10), 1, Data::MaxFaultThreads);
+    }
+
+    // MTRACK_PAGE_SCAN=<interval ms>, resident pages are found by scanning
+    // /proc/self/pagemap instead of with a userfaultfd
+    const auto pageScan = getenv("MTRACK_PAGE_SCAN");
+    if (pageScan != nullptr) {
+        data->pageScanInterval = strtoul(pageScan, nullptr, 10);
+        if (data->pageScanInterval != 0)
+            data->faultThreadCount = 1;
+    }
+
+    // MTRACK_FAULT_STACKS=exact|mmap|first|sample=<n>
+    const auto faultStacks = getenv("MTRACK_FAULT_STACKS");
+    if (faultStacks != nullptr) {
+        if (!strcasecmp(faultStacks, "mmap")) {
+            data->faultStacks = Data::FaultStacks::Mmap;
+        } else if (!strcasecmp(faultStacks, "first")) {
+            data->faultStacks = Data::FaultStacks::First;
+        } else if (!strncasecmp(faultStacks, "sample=", 7)) {
+            data->faultSampleRate = strtoul(faultStacks + 7, nullptr, 10);
+            data->faultStacks = data->faultSampleRate > 1 ? Data::FaultStacks::Sample : Data::FaultStacks::Exact;
+        }
+    }
+
+    // MTRACK_WORKING_SET=<interval ms>
+    const auto workingSet = getenv("MTRACK_WORKING_SET");
+    if (workingSet != nullptr) {
+        data->workingSetInterval = strtoul(workingSet, nullptr, 10);
+        if (data->workingSetInterval != 0) {
+            // only root gets to use it, the soft-dirty bits are enough
+            // otherwise
+            EINTRWRAP(data->pageIdleFd, ::open("/sys/kernel/mm/page_idle/bitmap", O_RDWR | O_CLOEXEC));
+        }
+    }
+
+    const auto timestamps = getenv("MTRACK_TIMESTAMPS");
+    if (timestamps != nullptr && !strcasecmp(timestamps, "ns")) {
+        data->timestampMode = TimestampMode::Nanoseconds;
+    }
+
     const auto maybeNoMmap = getenv("MTRACK_NO_MMAP_STACKS");
     if (maybeNoMmap != nullptr) {
         if (!strncasecmp(maybeNoMmap, "true", 4) || !strncmp(maybeNoMmap, "1", 1)) {
@@ -500,11 +2099,84 @@ void Hooks::hook()
         }
     }
 
+#if defined(__x86_64__) || defined(__aarch64__) || defined(__i386__)
+    bool fastUnwind = true;
+    const auto maybeNoFastUnwind = getenv("MTRACK_NO_FAST_UNWIND");
+    if (maybeNoFastUnwind != nullptr) {
+        if (!strncasecmp(maybeNoFastUnwind, "true", 4) || !strncmp(maybeNoFastUnwind, "1", 1)) {
+            fastUnwind = false;
+        }
+    }
+    Stack::setFastUnwind(fastUnwind);
+#endif
+
+    int daemonFd = -1;
+    const auto daemon = getenv("MTRACK_DAEMON");
+    if (daemon != nullptr) {
+        daemonFd = connectDaemon(daemon, &data->appId);
+        if (daemonFd == -1) {
+            safePrint("could not connect to the mtrack daemon, starting a parser\n");
+        } else {
+            data->daemonPath = strdup(daemon);
+        }
+    }
+    if (daemonFd == -1) {
+        void* mem = callbacks.mmap(nullptr, sizeof(std::atomic<uint32_t>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            safePrint("no appId counter\n");
+            abort();
+        }
+        // 1 is this process and 2 is WASM, like with the daemon forked
+        // children start at 3
+        data->nextAppId = new (mem) std::atomic<uint32_t>(3);
+    }
+
+    int shmFd = -1;
+    const auto transport = getenv("MTRACK_TRANSPORT");
+    // the daemon only reads from its socket
+    if (daemonFd == -1 && transport != nullptr && !strcasecmp(transport, "shm")) {
+        uint32_t numRings = 64;
+        uint64_t ringSize = 1024 * 1024;
+        const auto rings = getenv("MTRACK_SHM_RINGS");
+        if (rings != nullptr) {
+            numRings = std::max<uint32_t>(strtoul(rings, nullptr, 10), 1);
+        }
+        const auto size = getenv("MTRACK_SHM_RING_SIZE");
+        if (size != nullptr) {
+            // a ring has to fit at least a couple of maximum sized packets
+            ringSize = nextPowerOfTwo(std::max<uint64_t>(strtoull(size, nullptr, 10), 65536));
+        }
+
+        const auto mappingSize = ShmRings::mappingSize(numRings, ringSize);
+        shmFd = memfd_create("mtrack", 0);
+        if (shmFd == -1 || ftruncate(shmFd, mappingSize) == -1) {
+            safePrint("no shm memfd\n");
+            abort();
+        }
+        void* mem = callbacks.mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+        if (mem == MAP_FAILED) {
+            safePrint("no shm mapping\n");
+            abort();
+        }
+        data->shmEventFd = eventfd(0, EFD_NONBLOCK);
+        if (data->shmEventFd == -1) {
+            safePrint("no shm eventfd\n");
+            abort();
+        }
+        data->shmTransport = new ShmTransport(mem, numRings, ringSize, data->shmEventFd);
+        PipeEmitter::setShmTransport(data->shmTransport);
+    }
+
     const auto ppid = getpid();
 
     int e;
-    pid_t pid = fork();
-    if (pid == 0) {
+    if (daemonFd != -1) {
+        // packets go to the daemon, the socket keeps their boundaries like the pipe does
+        EINTRWRAP(e, ::close(data->emitPipe[0]));
+        EINTRWRAP(e, ::close(data->emitPipe[1]));
+        data->emitPipe[0] = -1;
+        data->emitPipe[1] = daemonFd;
+    } else if (pid_t pid = fork(); pid == 0) {
         // child
 
         // ignore sigint, the parent will tell the child when it's time to quit
@@ -527,6 +2199,7 @@ void Hooks::hook()
             std::string self;
             dl_iterate_phdr([](struct dl_phdr_info* info, size_t /*size*/, void* d) {
                 if (strstr(info->dlpi_name, "libmtrack_preload") != nullptr
+                    || strstr(info->dlpi_name, "libmtrack_attach_preload") != nullptr
                     || strstr(info->dlpi_name, "libmtrack32_preload") != nullptr
                     || strstr(info->dlpi_name, "libmtrack64_preload") != nullptr) {
                     *reinterpret_cast<std::string*>(d) = std::string(info->dlpi_name);
@@ -554,7 +2227,7 @@ void Hooks::hook()
             parser = self.substr(0, slash + 1) + "bin/mtrack_parser";
         }
 
-        char* args[14] = {};
+        char* args[22] = {};
         size_t argIdx = 0;
         args[argIdx++] = strdup(parser.c_str());
         args[argIdx++] = strdup("--packet-mode");
@@ -582,38 +2255,55 @@ void Hooks::hook()
             args[argIdx++] = strdup("--threshold");
             args[argIdx++] = strdup(threshold);
         }
+        const char* flightRecorder = getenv("MTRACK_FLIGHT_RECORDER");
+        if (flightRecorder) {
+            args[argIdx++] = strdup("--flight-recorder");
+            args[argIdx++] = strdup(flightRecorder);
+        }
+        const char* flightRecorderSize = getenv("MTRACK_FLIGHT_RECORDER_SIZE");
+        if (flightRecorderSize) {
+            args[argIdx++] = strdup("--flight-recorder-size");
+            args[argIdx++] = strdup(flightRecorderSize);
+        }
+        if (shmFd != -1) {
+            snprintf(buf, sizeof(buf), "%d", shmFd);
+            args[argIdx++] = strdup("--shm-fd");
+            args[argIdx++] = strdup(buf);
+            snprintf(buf, sizeof(buf), "%d", data->shmEventFd);
+            args[argIdx++] = strdup("--event-fd");
+            args[argIdx++] = strdup(buf);
+        }
         snprintf(buf, sizeof(buf), "%u", ppid);
         args[argIdx++] = strdup("--pid");
         args[argIdx++] = strdup(buf);
         args[argIdx++] = nullptr;
         char* envs[1] = {};
         envs[0] = nullptr;
-        const int ret = execve(parser.c_str(), args, envs);
+        const int ret = callbacks.execve(parser.c_str(), args, envs);
         fprintf(stderr, "unable to execve '%s' %d %m\n", parser.c_str(), ret);
         abort();
     } else {
         data->pid = pid;
         // parent
         EINTRWRAP(e, ::close(data->emitPipe[0]));
+        if (shmFd != -1) {
+            // the mapping stays valid
+            EINTRWRAP(e, ::close(shmFd));
+        }
     }
 
-    data->faultFd = syscall(SYS_userfaultfd, O_NONBLOCK);
-    if (data->faultFd == -1) {
-        safePrint("could not initialize userfaultfd\nyou might have to run sysctl -w vm.unprivileged_userfaultfd=1\n");
-        abort();
+    // Malloc, Free and PageFault records are dropped instead of blocking the
+    // application while the parser can't keep up, everything else waits
+    const auto overload = getenv("MTRACK_OVERLOAD");
+    if (overload != nullptr && !strcasecmp(overload, "drop")) {
+        const int fl = fcntl(data->emitPipe[1], F_GETFL);
+        if (fl != -1 && fcntl(data->emitPipe[1], F_SETFL, fl | O_NONBLOCK) != -1) {
+            PipeEmitter::setOverloadPolicy(PipeEmitter::OverloadPolicy::Drop);
+        }
     }
 
-    uffdio_api api = {
-        .api = UFFD_API,
-        .features = UFFD_FEATURE_THREAD_ID,
-        .ioctls = 0
-    };
-    if (ioctl(data->faultFd, UFFDIO_API, &api)) {
-        safePrint("no ioctl api\n");
-        abort();
-    }
-    if (api.api != UFFD_API) {
-        safePrint("no api api\n");
+    if (!createFaultFds()) {
+        safePrint("could not initialize userfaultfd\nyou might have to run sysctl -w vm.unprivileged_userfaultfd=1 or use MTRACK_PAGE_SCAN\n");
         abort();
     }
 
@@ -623,11 +2313,16 @@ void Hooks::hook()
     }
 
     PipeEmitter emitter(data->emitPipe[1]);
-    emitter.emit(RecordType::Start, data->appId, ApplicationType::ELF, 0);
+    // the clock isn't started yet, these are absolute. The parser puts
+    // applications sharing a daemon on one timeline with the start time
+    data->started = timestamp();
+    data->startedNs = timestampNs();
+    emitter.emit(RecordType::Start, data->appId, ApplicationType::ELF, data->timestampMode, data->startedNs, data->sampleRate);
 
     data->thread = std::thread(hookThread);
-    data->started = timestamp();
+    startFaultThreads();
     atexit(hookCleanup);
+    pthread_atfork(hookForkPrepare, hookForkParent, hookForkChild);
 
     // record the executable file
     char buf1[512];
@@ -650,82 +2345,309 @@ void Hooks::hook()
         emitter.emit(RecordType::WorkingDirectory, data->appId, Emitter::String(buf2));
     }
 
+    // a process that's asked to terminate didn't crash. The Exit record
+    // is written by hand, a packet that fits in the pipe is safe to write
+    // from a handler. The shm rings aren't but the pipe is read either way.
+    for (const int sig : { SIGTERM, SIGINT, SIGHUP }) {
+        struct sigaction old = {};
+        if (sigaction(sig, nullptr, &old) == -1 || old.sa_handler != SIG_DFL || (old.sa_flags & SA_SIGINFO))
+            continue;
+        struct sigaction sa = {};
+        sa.sa_handler = [](int signo) {
+            const int err = errno;
+            if (data != nullptr && getpid() == data->ownPid) {
+                const uint8_t exitPacket[] = { static_cast<uint8_t>(RecordType::Exit), data->appId };
+                [[maybe_unused]] const auto w = ::write(data->emitPipe[1], exitPacket, sizeof(exitPacket));
+            }
+            errno = err;
+            raise(signo);
+        };
+        sa.sa_flags = SA_RESETHAND;
+        sigemptyset(&sa.sa_mask);
+        sigaction(sig, &sa, nullptr);
+    }
+
+    const auto toggleSignal = getenv("MTRACK_TOGGLE_SIGNAL");
+    if (toggleSignal != nullptr) {
+        // the fault thread does the work, only write(2) is safe in here
+        struct sigaction sa = {};
+        sa.sa_handler = [](int) {
+            const int err = errno;
+            if (data != nullptr) {
+                [[maybe_unused]] const auto w = ::write(data->pfThreadPipe[1], "t", 1);
+            }
+            errno = err;
+        };
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(atoi(toggleSignal), &sa, nullptr);
+    }
+
+    // a dormant process has still sent Start, the executable and the
+    // working directory, enabling it sends the rest
+    bool startDormant = false;
+    const auto maybeDormant = getenv("MTRACK_DORMANT");
+    if (maybeDormant != nullptr) {
+        startDormant = !strncasecmp(maybeDormant, "true", 4) || !strncmp(maybeDormant, "1", 1);
+    }
+    if (startDormant || attaching) {
+        emitter.emit(RecordType::Tracking, data->appId, static_cast<uint8_t>(0));
+    }
+    hookState.store(startDormant || attaching ? HookState::Dormant : HookState::Tracking, std::memory_order_release);
+
     safePrint("hook.\n");
 }
 
-static void trackMmap(void* addr, size_t length, int prot, int flags)
+#ifdef MTRACK_ATTACH
+// The attached preload isn't interposed, instead the GOT entries the other
+// modules call these functions through are pointed at it. The dynamic
+// linker is left alone, it has to keep using the real malloc.
+static const char* const gotHookNames[] = {
+    "mmap", "mmap64", "munmap", "mremap", "madvise", "mprotect", "dlopen", "dlclose", "pthread_setname_np",
+    "malloc", "free", "calloc", "realloc", "reallocarray", "posix_memalign", "aligned_alloc",
+    "_Znwm", "_Znam", "_ZnwmRKSt9nothrow_t", "_ZnamRKSt9nothrow_t",
+    "_ZnwmSt11align_val_t", "_ZnamSt11align_val_t", "_ZnwmSt11align_val_tRKSt9nothrow_t", "_ZnamSt11align_val_tRKSt9nothrow_t",
+    "_ZdlPv", "_ZdaPv", "_ZdlPvRKSt9nothrow_t", "_ZdaPvRKSt9nothrow_t", "_ZdlPvm", "_ZdaPvm",
+    "_ZdlPvSt11align_val_t", "_ZdaPvSt11align_val_t", "_ZdlPvSt11align_val_tRKSt9nothrow_t", "_ZdaPvSt11align_val_tRKSt9nothrow_t",
+    "_ZdlPvmSt11align_val_t", "_ZdaPvmSt11align_val_t",
+    "execve", "execv", "execvp", "execvpe", "fexecve", "execl", "execlp", "execle"
+};
+
+struct GotPatcher
 {
-    // printf("-maping %p %zu flags 0x%x priv/anon %d\n", addr, length, flags, (flags & (MAP_PRIVATE | MAP_ANONYMOUS)) == (MAP_PRIVATE | MAP_ANONYMOUS));
+    const char* self {};
+    void* hooks[sizeof(gotHookNames) / sizeof(gotHookNames[0])] {};
+    uintptr_t writablePage {};
+
+    void patch(const dl_phdr_info* info, const ElfW(Rela)* relocs, size_t size, const ElfW(Sym)* symtab, const char* strtab)
     {
-        ScopedSpinlock lock(data->mmapTrackerLock);
-        data->mmapTracker.mmap(addr, length, prot, flags, 0);
+        for (size_t i = 0; i < size / sizeof(ElfW(Rela)); ++i) {
+            const auto type = ELF64_R_TYPE(relocs[i].r_info);
+#if defined(__x86_64__)
+            if (type != R_X86_64_JUMP_SLOT && type != R_X86_64_GLOB_DAT)
+                continue;
+#elif defined(__aarch64__)
+            if (type != R_AARCH64_JUMP_SLOT && type != R_AARCH64_GLOB_DAT)
+                continue;
+#else
+#error "Unsupported architecture"
+#endif
+            const char* name = strtab + symtab[ELF64_R_SYM(relocs[i].r_info)].st_name;
+            for (size_t h = 0; h < sizeof(gotHookNames) / sizeof(gotHookNames[0]); ++h) {
+                if (hooks[h] == nullptr || strcmp(name, gotHookNames[h]) != 0)
+                    continue;
+                auto slot = reinterpret_cast<void**>(info->dlpi_addr + relocs[i].r_offset);
+                const uintptr_t page = reinterpret_cast<uintptr_t>(slot) & ~(Limits::PageSize - 1);
+                if (page != writablePage) {
+                    // full RELRO leaves the GOT read only
+                    callbacks.mprotect(reinterpret_cast<void*>(page), Limits::PageSize, PROT_READ | PROT_WRITE);
+                    writablePage = page;
+                }
+                *slot = hooks[h];
+                break;
+            }
+        }
     }
-    // printf("1--\n");
-    // for (const auto& item : data->mmapRanges) {
-    //     printf(" - %p(%p) %zu\n", std::get<0>(item), reinterpret_cast<uint8_t*>(std::get<0>(item)) + std::get<1>(item), std::get<1>(item));
-    // }
+};
 
-    if ((prot & (PROT_READ | PROT_WRITE)) == (PROT_READ | PROT_WRITE)) {
-        // printf("ball %zu 0x%x 0x%x\n", length, prot, flags);
-        uffdio_register reg = {
-            .range = {
-                .start = reinterpret_cast<__u64>(addr),
-                .len = alignToPage(length)
-            },
-            .mode = UFFDIO_REGISTER_MODE_MISSING,
-            .ioctls = 0
-        };
+static void patchModules()
+{
+    static Spinlock lock;
+    ScopedSpinlock locker(lock);
+    NoHook nohook;
 
-        if (ioctl(data->faultFd, UFFDIO_REGISTER, &reg) == -1) {
-            printf("register failed (1) %m\n");
-            return;
+    Dl_info selfInfo;
+    if (!dladdr(reinterpret_cast<void*>(&patchModules), &selfInfo))
+        return;
+    // looking them up in our own handle gets ours rather than libc's
+    void* self = callbacks.dlopen(selfInfo.dli_fname, RTLD_NOW | RTLD_NOLOAD);
+    if (self == nullptr)
+        return;
+    GotPatcher patcher;
+    patcher.self = selfInfo.dli_fname;
+    for (size_t h = 0; h < sizeof(gotHookNames) / sizeof(gotHookNames[0]); ++h) {
+        patcher.hooks[h] = dlsym(self, gotHookNames[h]);
+    }
+    callbacks.dlclose(self);
+
+    dl_iterate_phdr([](struct dl_phdr_info* info, size_t /*size*/, void* p) {
+        auto patcher = static_cast<GotPatcher*>(p);
+        if (!strcmp(info->dlpi_name, patcher->self) || strstr(info->dlpi_name, "/ld-linux") != nullptr
+            || strstr(info->dlpi_name, "linux-vdso") != nullptr) {
+            return 0;
         }
+        for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i) {
+            if (info->dlpi_phdr[i].p_type != PT_DYNAMIC)
+                continue;
+            // glibc relocates most of the pointers in the dynamic section,
+            // some architectures keep it read only and don't
+            auto pointer = [info](ElfW(Addr) addr) {
+                return addr < info->dlpi_addr ? addr + info->dlpi_addr : addr;
+            };
+            const ElfW(Sym)* symtab = nullptr;
+            const char* strtab = nullptr;
+            const ElfW(Rela)* jmprel = nullptr;
+            const ElfW(Rela)* rela = nullptr;
+            size_t jmprelSize = 0, relaSize = 0;
+            for (auto dyn = reinterpret_cast<const ElfW(Dyn)*>(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr); dyn->d_tag != DT_NULL; ++dyn) {
+                switch (dyn->d_tag) {
+                case DT_SYMTAB: symtab = reinterpret_cast<const ElfW(Sym)*>(pointer(dyn->d_un.d_ptr)); break;
+                case DT_STRTAB: strtab = reinterpret_cast<const char*>(pointer(dyn->d_un.d_ptr)); break;
+                case DT_JMPREL: jmprel = reinterpret_cast<const ElfW(Rela)*>(pointer(dyn->d_un.d_ptr)); break;
+                case DT_PLTRELSZ: jmprelSize = dyn->d_un.d_val; break;
+                case DT_RELA: rela = reinterpret_cast<const ElfW(Rela)*>(pointer(dyn->d_un.d_ptr)); break;
+                case DT_RELASZ: relaSize = dyn->d_un.d_val; break;
+                }
+            }
+            if (symtab == nullptr || strtab == nullptr)
+                break;
+            if (jmprel != nullptr)
+                patcher->patch(info, jmprel, jmprelSize, symtab, strtab);
+            if (rela != nullptr)
+                patcher->patch(info, rela, relaSize, symtab, strtab);
+            break;
+        }
+        return 0;
+    }, &patcher);
+}
+#endif
+
+static void trackMmap(void* addr, size_t length, int prot, int flags, uint32_t stack)
+{
+    // printf("-maping %p %zu flags 0x%x priv/anon %d\n", addr, length, flags, (flags & (MAP_PRIVATE | MAP_ANONYMOUS)) == (MAP_PRIVATE | MAP_ANONYMOUS));
+    {
+        ScopedSpinlock lock(data->mmapTrackerLock);
+        data->mmapTracker.mmap(addr, length, prot, flags, static_cast<int32_t>(stack));
+    }
+    // printf("1--\n");
+    // for (const auto& item : data->mmapRanges) {
+    //     printf(" - %p(%p) %zu\n", std::get<0>(item), reinterpret_cast<uint8_t*>(std::get<0>(item)) + std::get<1>(item), std::get<1>(item));
+    // }
 
-        // if (reg.ioctls != UFFD_API_RANGE_IOCTLS) {
-        //     printf("no range (1) 0x%llx\n", reg.ioctls);
-        //     return;
-        // }
+    if ((prot & (PROT_READ | PROT_WRITE)) == (PROT_READ | PROT_WRITE)) {
+        // printf("ball %zu 0x%x 0x%x\n", length, prot, flags);
+        registerFaults(addr, length);
     }
 }
 
 static void reportMalloc(void* ptr, size_t size)
 {
+    if (!sampleMalloc(size))
+        return;
+
     NoHook nohook;
 
-    if (data->modulesDirty.load(std::memory_order_acquire)) {
-        dl_iterate_phdr(dl_iterate_phdr_callback, nullptr);
-        data->modulesDirty.store(false, std::memory_order_release);
+    if (data->callsites != nullptr) {
+        updateModules();
+        const auto& limit = stackLimit(RecordType::Malloc);
+        const uint32_t stack = stackId(Stack(3 + limit.skip, limit.depth, &::tlsData()->stackCache));
+        if (data->callsites->contains(stack) && data->allocations->insert(reinterpret_cast<uintptr_t>(ptr), stack, size)) {
+            data->callsites->allocated(stack, size);
+        } else {
+            untrackedAllocations.fetch_add(1, std::memory_order_relaxed);
+        }
+        return;
+    }
+
+    if (data->filterFrees.load(std::memory_order_relaxed)
+        && !data->sampledPointers->insert(reinterpret_cast<uintptr_t>(ptr))) {
+        // the set is full, we can't tell sampled frees apart anymore
+        data->filterFrees.store(false, std::memory_order_relaxed);
     }
 
-    PipeEmitter emitter(data->emitPipe[1]);
+    updateModules();
+
+    const auto& limit = stackLimit(RecordType::Malloc);
+    PipeEmitter emitter(data->emitPipe[1], PipeEmitter::Delivery::Droppable);
+    if (data->timestampMode == TimestampMode::Nanoseconds) {
+        emitter.emit(RecordType::Malloc,
+                     data->appId,
+                     static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr)),
+                     static_cast<uint64_t>(size),
+                     threadId(),
+                     timestampDelta(&::tlsData()->lastTimestamp),
+                     stackId(Stack(3 + limit.skip, limit.depth, &::tlsData()->stackCache)));
+        if (emitter.dropped())
+            ::tlsData()->lastTimestamp = 0;
+        return;
+    }
     emitter.emit(RecordType::Malloc,
                  data->appId,
                  timestamp(),
                  static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr)),
                  static_cast<uint64_t>(size),
-                 static_cast<uint32_t>(syscall(SYS_gettid)),
-                 Stack(3));
+                 threadId(),
+                 stackId(Stack(3 + limit.skip, limit.depth, &::tlsData()->stackCache)));
 }
 
-static void reportFree(void* ptr)
+// size is only known for sized operator delete, it's sent as a SizedFree
+// so the parser can check it against the allocation
+static void reportFree(void* ptr, size_t size = 0)
 {
+    if (data->callsites != nullptr) {
+        uint32_t stack;
+        uint64_t allocated;
+        if (data->allocations->remove(reinterpret_cast<uintptr_t>(ptr), &stack, &allocated)) {
+            data->callsites->freed(stack, allocated);
+        }
+        return;
+    }
+
+    if (data->filterFrees.load(std::memory_order_relaxed)
+        && !data->sampledPointers->remove(reinterpret_cast<uintptr_t>(ptr))) {
+        return;
+    }
+
     NoHook nohook;
 
-    if (data->modulesDirty.load(std::memory_order_acquire)) {
-        dl_iterate_phdr(dl_iterate_phdr_callback, nullptr);
-        data->modulesDirty.store(false, std::memory_order_release);
+    updateModules();
+
+    PipeEmitter emitter(data->emitPipe[1], PipeEmitter::Delivery::Droppable);
+    if (size > 0) {
+        if (data->timestampMode == TimestampMode::Nanoseconds) {
+            emitter.emit(RecordType::SizedFree, data->appId, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr)),
+                         Emitter::VarInt(size), threadId(), timestampDelta(&::tlsData()->lastTimestamp));
+            if (emitter.dropped())
+                ::tlsData()->lastTimestamp = 0;
+        } else {
+            emitter.emit(RecordType::SizedFree, data->appId, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr)),
+                         Emitter::VarInt(size));
+        }
+        return;
+    }
+    if (data->timestampMode == TimestampMode::Nanoseconds) {
+        emitter.emit(RecordType::Free, data->appId, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr)),
+                     threadId(), timestampDelta(&::tlsData()->lastTimestamp));
+        if (emitter.dropped())
+            ::tlsData()->lastTimestamp = 0;
+        return;
     }
+    emitter.emit(RecordType::Free, data->appId, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr)));
+}
 
+// Sent before the exec, the parser would take the pipe closing without an
+// Exit for a crash. If the exec fails the process is still tracked but it
+// won't be reported as having crashed.
+static void emitExec()
+{
+    // vfork children and forked children without an appId aren't the
+    // process that appId belongs to
+    if (data == nullptr || getpid() != data->ownPid)
+        return;
+    NoHook noHook;
     PipeEmitter emitter(data->emitPipe[1]);
-    emitter.emit(RecordType::Free, data->appId, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr)));
+    emitter.emit(RecordType::Exit, data->appId);
 }
 
 extern "C" {
 void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
 {
+    if (dormant())
+        return callbacks.mmap(addr, length, prot, flags, fd, offset);
+
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
 
     // printf("mmap?? %p\n", addr);
@@ -737,33 +2659,38 @@ void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
 
     NoHook nohook;
 
+    // the mapping keeps the stack for page faults attributed to it
+    updateModules();
+    const auto& limit = stackLimit(RecordType::Mmap);
+    const uint32_t stack = stackId(Stack(2 + limit.skip, limit.depth, &::tlsData()->stackCache));
+
     if (!mallocFree.wasInMallocFree()
         && (flags & (MAP_PRIVATE | MAP_ANONYMOUS)) == (MAP_PRIVATE | MAP_ANONYMOUS)
         && fd == -1) {
-        trackMmap(ret, length, prot, flags);
+        trackMmap(ret, length, prot, flags, stack);
 
         if (flags & MAP_FIXED) {
             PipeEmitter emitter(data->emitPipe[1]);
             emitter.emit(RecordType::PageRemove, data->appId, mmap_ptr_cast(addr), mmap_ptr_cast(addr) + alignToPage(length));
+            forgetScannedPages(mmap_ptr_cast(addr), mmap_ptr_cast(addr) + alignToPage(length));
         }
     }
 
-    if (data->modulesDirty.load(std::memory_order_acquire)) {
-        dl_iterate_phdr(dl_iterate_phdr_callback, nullptr);
-        data->modulesDirty.store(false, std::memory_order_release);
-    }
     PipeEmitter emitter(data->emitPipe[1]);
     emitter.emit(RecordType::Mmap, data->appId,
                  mmap_ptr_cast(ret), alignToPage(length), prot, flags,
-                 static_cast<uint32_t>(syscall(SYS_gettid)), Stack(2));
+                 threadId(), stack);
     return ret;
 }
 
 void* mmap64(void* addr, size_t length, int prot, int flags, int fd, __off64_t pgoffset)
 {
+    if (dormant())
+        return callbacks.mmap64(addr, length, prot, flags, fd, pgoffset);
+
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
 
     // printf("mmap64?? %p\n", addr);
@@ -775,34 +2702,39 @@ void* mmap64(void* addr, size_t length, int prot, int flags, int fd, __off64_t p
 
     NoHook nohook;
 
+    // the mapping keeps the stack for page faults attributed to it
+    updateModules();
+    const auto& limit = stackLimit(RecordType::Mmap);
+    const uint32_t stack = stackId(Stack(2 + limit.skip, limit.depth, &::tlsData()->stackCache));
+
     if (!mallocFree.wasInMallocFree()
         && (flags & (MAP_PRIVATE | MAP_ANONYMOUS)) == (MAP_PRIVATE | MAP_ANONYMOUS)
         && fd == -1) {
-        trackMmap(ret, length, prot, flags);
+        trackMmap(ret, length, prot, flags, stack);
 
         if (flags & MAP_FIXED) {
             PipeEmitter emitter(data->emitPipe[1]);
             emitter.emit(RecordType::PageRemove, data->appId, mmap_ptr_cast(addr), mmap_ptr_cast(addr) + alignToPage(length));
+            forgetScannedPages(mmap_ptr_cast(addr), mmap_ptr_cast(addr) + alignToPage(length));
         }
     }
 
-    if (data->modulesDirty.load(std::memory_order_acquire)) {
-        dl_iterate_phdr(dl_iterate_phdr_callback, nullptr);
-        data->modulesDirty.store(false, std::memory_order_release);
-    }
     PipeEmitter emitter(data->emitPipe[1]);
     emitter.emit(RecordType::Mmap,data->appId,
                  mmap_ptr_cast(ret), alignToPage(length), prot, flags,
-                 static_cast<uint32_t>(syscall(SYS_gettid)), Stack(2));
+                 threadId(), stack);
 
     return ret;
 }
 
 int munmap(void* addr, size_t length)
 {
+    if (dormant())
+        return callbacks.munmap(addr, length);
+
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
 
     if (!::tlsData()->hooked)
@@ -819,20 +2751,27 @@ int munmap(void* addr, size_t length)
     emitter.emit(RecordType::Munmap, data->appId,
                  mmap_ptr_cast(addr), alignToPage(length));
 
-    return callbacks.munmap(addr, length);
+    const int ret = callbacks.munmap(addr, length);
+    forgetScannedPages(mmap_ptr_cast(addr), mmap_ptr_cast(addr) + alignToPage(length));
+    return ret;
 }
 
 int mprotect(void* addr, size_t len, int prot)
 {
+    if (dormant())
+        return callbacks.mprotect(addr, len, prot);
+
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
 
     int flags;
     {
-        ScopedSpinlock lock(data->mmapTrackerLock);
-        flags = data->mmapTracker.mprotect(addr, len, prot);
+        // mprotect can't change the flags and nothing in here looks at
+        // prot, no need to split the mappings
+        ScopedSharedSpinlock lock(data->mmapTrackerLock);
+        flags = data->mmapTracker.flags(addr, len);
         // if (flags == 0) {
         //     printf("for prot %p\n", addr);
         //     data->mmapTracker.forEach([](uintptr_t start, uintptr_t end, int prot, int flags) {
@@ -844,16 +2783,7 @@ int mprotect(void* addr, size_t len, int prot)
 
     // printf("mprotect %p %zu %d %d\n", addr, len, prot, flags);
     if (((prot & (PROT_READ | PROT_WRITE)) == (PROT_READ | PROT_WRITE)) && (flags & (MAP_PRIVATE | MAP_ANONYMOUS)) == (MAP_PRIVATE | MAP_ANONYMOUS)) {
-        uffdio_register reg = {
-            .range = {
-                .start = reinterpret_cast<__u64>(addr),
-                .len = alignToPage(len)
-            },
-            .mode = UFFDIO_REGISTER_MODE_MISSING,
-            .ioctls = 0
-        };
-
-        if (ioctl(data->faultFd, UFFDIO_REGISTER, &reg) == -1)
+        if (registerFaultRange(reinterpret_cast<uintptr_t>(addr), len) == -1)
             return callbacks.mprotect(addr, len, prot);
 
         // ### don't forget me
@@ -898,18 +2828,22 @@ void* mremap(void* addr, size_t old_size, size_t new_size, int flags, ...)
         data->mmapTracker.mremap(addr, ret, old_size, new_size, 0);
     }
 
+    const auto& limit = stackLimit(RecordType::Mremap);
     PipeEmitter emitter(data->emitPipe[1]);
     emitter.emit(RecordType::Mremap, data->appId, mmap_ptr_cast(addr), alignToPage(old_size),
-                 mmap_ptr_cast(ret), alignToPage(new_size), flags, syscall(SYS_gettid), Stack(2));
+                 mmap_ptr_cast(ret), alignToPage(new_size), flags, static_cast<uint64_t>(threadId()), stackId(Stack(2 + limit.skip, limit.depth, &::tlsData()->stackCache)));
 
     return ret;
 }
 
 int madvise(void* addr, size_t length, int advice)
 {
+    if (dormant())
+        return callbacks.madvise(addr, length, advice);
+
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
 
     if (!::tlsData()->hooked)
@@ -918,15 +2852,11 @@ int madvise(void* addr, size_t length, int advice)
     NoHook nohook;
 
     if (advice == MADV_DONTNEED || advice == MADV_REMOVE) {
-        {
-            ScopedSpinlock lock(data->mmapTrackerLock);
-            data->mmapTracker.madvise(addr, length);
-        }
-
-        {
-            PipeEmitter emitter(data->emitPipe[1]);
-            emitter.emit(RecordType::PageRemove, data->appId, mmap_ptr_cast(addr), mmap_ptr_cast(addr) + alignToPage(length));
-        }
+        PipeEmitter emitter(data->emitPipe[1]);
+        emitter.emit(RecordType::PageRemove, data->appId, mmap_ptr_cast(addr), mmap_ptr_cast(addr) + alignToPage(length));
+        const int ret = callbacks.madvise(addr, length, advice);
+        forgetScannedPages(mmap_ptr_cast(addr), mmap_ptr_cast(addr) + alignToPage(length));
+        return ret;
     }
 
     return callbacks.madvise(addr, length, advice);
@@ -936,17 +2866,25 @@ void* dlopen(const char* filename, int flags)
 {
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
     data->modulesDirty.store(true, std::memory_order_release);
+#ifdef MTRACK_ATTACH
+    // the GOT of whatever got loaded points at the real functions
+    void* ret = callbacks.dlopen(filename, flags);
+    if (ret != nullptr && hookState.load(std::memory_order_relaxed) != HookState::Unhooked)
+        patchModules();
+    return ret;
+#else
     return callbacks.dlopen(filename, flags);
+#endif
 }
 
 int dlclose(void* handle)
 {
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
     if (data) {
         data->modulesDirty.store(true, std::memory_order_release);
@@ -954,25 +2892,105 @@ int dlclose(void* handle)
     return callbacks.dlclose(handle);
 }
 
+int execve(const char* path, char* const argv[], char* const envp[])
+{
+    ensureHooked();
+    emitExec();
+    return callbacks.execve(path, argv, envp);
+}
+
+int execv(const char* path, char* const argv[])
+{
+    ensureHooked();
+    emitExec();
+    return callbacks.execv(path, argv);
+}
+
+int execvp(const char* file, char* const argv[])
+{
+    ensureHooked();
+    emitExec();
+    return callbacks.execvp(file, argv);
+}
+
+int execvpe(const char* file, char* const argv[], char* const envp[])
+{
+    ensureHooked();
+    emitExec();
+    return callbacks.execvpe(file, argv, envp);
+}
+
+int fexecve(int fd, char* const argv[], char* const envp[])
+{
+    ensureHooked();
+    emitExec();
+    return callbacks.fexecve(fd, argv, envp);
+}
+
+// the argument lists are collected on the stack like libc does, nothing
+// can be allocated in a vfork child
+#define EXECL_ARGV(arg)                                         \
+    va_list args;                                               \
+    va_start(args, arg);                                        \
+    size_t argc = 1;                                            \
+    {                                                           \
+        va_list count;                                          \
+        va_copy(count, args);                                   \
+        while (va_arg(count, const char*) != nullptr)           \
+            ++argc;                                             \
+        va_end(count);                                          \
+    }                                                           \
+    char* argv[argc + 1];                                       \
+    argv[0] = const_cast<char*>(arg);                           \
+    for (size_t i = 1; i <= argc; ++i)                          \
+        argv[i] = va_arg(args, char*);
+
+int execl(const char* path, const char* arg, ...)
+{
+    EXECL_ARGV(arg);
+    va_end(args);
+    return execv(path, argv);
+}
+
+int execlp(const char* file, const char* arg, ...)
+{
+    EXECL_ARGV(arg);
+    va_end(args);
+    return execvp(file, argv);
+}
+
+int execle(const char* path, const char* arg, ...)
+{
+    EXECL_ARGV(arg);
+    char* const* envp = va_arg(args, char* const*);
+    va_end(args);
+    return execve(path, argv, envp);
+}
+
+#undef EXECL_ARGV
+
 int pthread_setname_np(pthread_t thread, const char* name)
 {
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
     // ### should fix this, this will drop unless we're the same thread
     if (pthread_equal(thread, pthread_self())) {
         PipeEmitter emitter(data->emitPipe[1]);
-        emitter.emit(RecordType::ThreadName, data->appId, static_cast<uint32_t>(syscall(SYS_gettid)), Emitter::String(name));
+        emitter.emit(RecordType::ThreadName, data->appId, threadId(), Emitter::String(name));
     }
     return callbacks.pthread_setname_np(thread, name);
 }
 
 void* malloc(size_t size)
 {
+    if (dormant())
+        return callbacks.malloc(size);
+
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
 
     if (!callbacks.malloc) {
@@ -990,9 +3008,15 @@ void* malloc(size_t size)
 
 void free(void* ptr)
 {
+    if (dormant()) {
+        if (!allocator.hasData(ptr))
+            callbacks.free(ptr);
+        return;
+    }
+
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
 
     if (allocator.hasData(ptr)) {
@@ -1010,9 +3034,12 @@ void free(void* ptr)
 
 void* calloc(size_t nmemb, size_t size)
 {
+    if (dormant())
+        return callbacks.calloc(nmemb, size);
+
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
 
     if (!callbacks.calloc) {
@@ -1030,9 +3057,12 @@ void* calloc(size_t nmemb, size_t size)
 
 void* realloc(void* ptr, size_t size)
 {
+    if (dormant())
+        return callbacks.realloc(ptr, size);
+
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
 
     auto ret = callbacks.realloc(ptr, size);
@@ -1051,9 +3081,12 @@ void* realloc(void* ptr, size_t size)
 
 void* reallocarray(void* ptr, size_t nmemb, size_t size)
 {
+    if (dormant())
+        return callbacks.reallocarray(ptr, nmemb, size);
+
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
 
     auto ret = callbacks.reallocarray(ptr, nmemb, size);
@@ -1072,9 +3105,12 @@ void* reallocarray(void* ptr, size_t nmemb, size_t size)
 
 int posix_memalign(void** memptr, size_t alignment, size_t size)
 {
+    if (dormant())
+        return callbacks.posix_memalign(memptr, alignment, size);
+
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
 
     auto ret = callbacks.posix_memalign(memptr, alignment, size);
@@ -1088,9 +3124,12 @@ int posix_memalign(void** memptr, size_t alignment, size_t size)
 
 void* aligned_alloc(size_t alignment, size_t size)
 {
+    if (dormant())
+        return callbacks.aligned_alloc(alignment, size);
+
     MallocFree mallocFree;
     if (!mallocFree.wasInMallocFree()) {
-        std::call_once(hookOnce, Hooks::hook);
+        ensureHooked();
     }
 
     auto ret = callbacks.aligned_alloc(alignment, size);
@@ -1140,4 +3179,260 @@ void mtrack_enable_snapshots()
         emitter.emit(RecordType::Command, CommandType::EnableSnapshots);
     }
 }
+
+void mtrack_disable_tracking()
+{
+    if (data) {
+        setTracking(false);
+    }
+}
+
+void mtrack_enable_tracking()
+{
+    if (data) {
+        setTracking(true);
+    }
+}
+
+#ifdef MTRACK_ATTACH
+// Called by mtrack_attach on the thread it stopped, right after dlopening
+// the attach build. settings are the MTRACK_ variables from its
+// environment, one NAME=value per line, the process' own environment is
+// whatever it was started with.
+int mtrack_attach(const char* settings)
+{
+    if (hookState.load(std::memory_order_acquire) != HookState::Unhooked)
+        return 0;
+
+    // In a process without libstdc++ of its own operator new is ours, the
+    // settings are parsed without it since it would hook right away
+    attaching = true;
+    for (const char* line = settings; line != nullptr && *line != '\0';) {
+        const char* end = strchrnul(line, '\n');
+        char setting[PATH_MAX + 64];
+        const size_t length = end - line;
+        if (length < sizeof(setting)) {
+            memcpy(setting, line, length);
+            setting[length] = '\0';
+            char* equals = strchr(setting, '=');
+            if (equals != nullptr) {
+                *equals = '\0';
+                setenv(setting, equals + 1, 1);
+            }
+        }
+        line = *end != '\0' ? end + 1 : end;
+    }
+
+    {
+        // and hook() allocating mustn't try to hook again
+        MallocFree mallocFree;
+        ensureHooked();
+    }
+    patchModules();
+
+    // what's mapped and loaded so far is sent as the baseline
+    const auto maybeDormant = getenv("MTRACK_DORMANT");
+    if (maybeDormant == nullptr || (strncasecmp(maybeDormant, "true", 4) && strncmp(maybeDormant, "1", 1))) {
+        setTracking(true);
+    }
+    return 1;
+}
+#endif
 } // extern "C"
+
+// operator new/delete are interposed directly instead of seeing them
+// through libstdc++'s calls to malloc, that keeps the stack depth the same
+// as for malloc and lets sized delete pass the size along. They have to be
+// always_inline so reportMalloc skips the same number of frames.
+static inline size_t alignedNewSize(size_t size, size_t alignment)
+{
+    return alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__ ? alignToSize(size, alignment) : size;
+}
+
+static inline __attribute__((always_inline)) void* newAllocate(size_t size, size_t alignment, bool nothrow)
+{
+    if (size == 0)
+        size = 1;
+
+    void* ret;
+    for (;;) {
+        if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            if (!callbacks.aligned_alloc) {
+                const auto mem = reinterpret_cast<uintptr_t>(allocator.allocate(size + alignment));
+                return reinterpret_cast<void*>(alignToSize(mem, alignment));
+            }
+            ret = callbacks.aligned_alloc(alignment, alignedNewSize(size, alignment));
+        } else {
+            if (!callbacks.malloc) {
+                return allocator.allocate(size);
+            }
+            ret = callbacks.malloc(size);
+        }
+        if (ret)
+            break;
+        const auto handler = std::get_new_handler();
+        if (!handler) {
+            if (nothrow)
+                return nullptr;
+            throw std::bad_alloc();
+        }
+        if (nothrow) {
+            try {
+                handler();
+            } catch (...) {
+                return nullptr;
+            }
+        } else {
+            handler();
+        }
+    }
+    return ret;
+}
+
+static inline __attribute__((always_inline)) void* newImpl(size_t size, size_t alignment, bool nothrow)
+{
+    if (dormant())
+        return newAllocate(size, alignment, nothrow);
+
+    MallocFree mallocFree;
+    if (!mallocFree.wasInMallocFree()) {
+        ensureHooked();
+    }
+
+    void* ret = newAllocate(size, alignment, nothrow);
+    if (!::tlsData()->hooked || !ret)
+        return ret;
+
+    if (size == 0)
+        size = 1;
+
+    if (!mallocFree.wasInMallocFree() && data)
+        reportMalloc(ret, alignedNewSize(size, alignment));
+    return ret;
+}
+
+static inline __attribute__((always_inline)) void deleteImpl(void* ptr, size_t size)
+{
+    if (dormant()) {
+        if (ptr && !allocator.hasData(ptr))
+            callbacks.free(ptr);
+        return;
+    }
+
+    MallocFree mallocFree;
+    if (!mallocFree.wasInMallocFree()) {
+        ensureHooked();
+    }
+
+    if (!ptr || allocator.hasData(ptr)) {
+        return;
+    }
+
+    callbacks.free(ptr);
+
+    if (!::tlsData()->hooked)
+        return;
+
+    if (!mallocFree.wasInMallocFree() && data)
+        reportFree(ptr, size);
+}
+
+void* operator new(size_t size)
+{
+    return newImpl(size, 0, false);
+}
+
+void* operator new[](size_t size)
+{
+    return newImpl(size, 0, false);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return newImpl(size, 0, true);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return newImpl(size, 0, true);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    return newImpl(size, static_cast<size_t>(alignment), false);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    return newImpl(size, static_cast<size_t>(alignment), false);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return newImpl(size, static_cast<size_t>(alignment), true);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return newImpl(size, static_cast<size_t>(alignment), true);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    deleteImpl(ptr, 0);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    deleteImpl(ptr, 0);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    deleteImpl(ptr, 0);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    deleteImpl(ptr, 0);
+}
+
+void operator delete(void* ptr, size_t size) noexcept
+{
+    deleteImpl(ptr, size);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept
+{
+    deleteImpl(ptr, size);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    deleteImpl(ptr, 0);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+    deleteImpl(ptr, 0);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    deleteImpl(ptr, 0);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    deleteImpl(ptr, 0);
+}
+
+void operator delete(void* ptr, size_t size, std::align_val_t alignment) noexcept
+{
+    deleteImpl(ptr, alignedNewSize(size, static_cast<size_t>(alignment)));
+}
+
+void operator delete[](void* ptr, size_t size, std::align_val_t alignment) noexcept
+{
+    deleteImpl(ptr, alignedNewSize(size, static_cast<size_t>(alignment)));
+}
@@ -7,4 +7,6 @@ extern "C" {
 void mtrack_snapshot(const char* name = nullptr, size_t nameSize = 0);
 void mtrack_disable_snapshots();
 void mtrack_enable_snapshots();
+void mtrack_disable_tracking();
+void mtrack_enable_tracking();
 }
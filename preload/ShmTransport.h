@@ -0,0 +1,193 @@
+#pragma once
+
+#include "Spinlock.h"
+#include <common/ShmRings.h>
+#include <atomic>
+#include <cstdint>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Producer side of the shared memory transport. Each thread claims its own
+// ring the first time it emits, so the hot path is a memcpy and a release
+// store. The parser is only woken through the eventfd when it has announced
+// that it is idle.
+class ShmTransport
+{
+public:
+    ShmTransport(void* mem, uint32_t numRings, uint64_t ringSize, int eventFd);
+
+    void write(const void* data, uint32_t size);
+    // doesn't wait for the parser, false if the ring is full
+    bool tryWrite(const void* data, uint32_t size);
+
+    // Called in a forked child, the thread that forked has to claim a ring
+    // of its own rather than writing to the one its parent thread owns.
+    void forked();
+
+private:
+    ShmRings::Ring* threadRing();
+    uint64_t reserve(ShmRings::Ring* ring);
+    void takeOver(ShmRings::Ring* ring);
+    void lockShared();
+    void unlockShared();
+    void waitForSpace();
+    void wake();
+
+    static void releaseRing(void* ring);
+
+private:
+    ShmRings mRings;
+    // between the threads of this process, the Header's lock is between processes
+    Spinlock mSharedLock;
+    pthread_key_t mRingKey {};
+    int mEventFd { -1 };
+    uint32_t mPid { 0 };
+};
+
+inline ShmTransport::ShmTransport(void* mem, uint32_t numRings, uint64_t ringSize, int eventFd)
+    : mEventFd(eventFd), mPid(getpid())
+{
+    mRings.init(mem, numRings, ringSize);
+    pthread_key_create(&mRingKey, releaseRing);
+}
+
+inline void ShmTransport::releaseRing(void* ring)
+{
+    auto r = static_cast<ShmRings::Ring*>(ring);
+    // the shared ring is never owned by anyone
+    if (r->owner.load(std::memory_order_relaxed) != 0)
+        r->owner.store(0, std::memory_order_release);
+}
+
+inline void ShmTransport::forked()
+{
+    pthread_setspecific(mRingKey, nullptr);
+    mPid = getpid();
+    // only the thread that forked made it into the child
+    mSharedLock.unlock();
+}
+
+inline ShmRings::Ring* ShmTransport::threadRing()
+{
+    auto ring = static_cast<ShmRings::Ring*>(pthread_getspecific(mRingKey));
+    if (ring == nullptr) {
+        ring = mRings.claim(static_cast<uint32_t>(syscall(SYS_gettid)));
+        if (ring == nullptr) {
+            // out of rings, share ring 0 with the other latecomers
+            ring = mRings.ring(0);
+        } else {
+            takeOver(ring);
+        }
+        pthread_setspecific(mRingKey, ring);
+    }
+    return ring;
+}
+
+inline void ShmTransport::takeOver(ShmRings::Ring* ring)
+{
+    // the previous producer died in the middle of a packet, an empty one
+    // takes its sequence unless the parser has skipped it already. If it
+    // died taking the sequence it isn't known, the parser skips that one.
+    const uint64_t pending = ring->pending.exchange(0, std::memory_order_relaxed);
+    if (pending != 0 && pending != ShmRings::Reserving) {
+        while (!mRings.write(ring, pending - 1, &pending, 0)) {
+            waitForSpace();
+        }
+    }
+}
+
+// Takes the next sequence for a packet on ring. The ring says so before the
+// sequence is taken, the release makes sure that a parser that has seen any
+// later sequence sees the marker too.
+inline uint64_t ShmTransport::reserve(ShmRings::Ring* ring)
+{
+    ring->pending.store(ShmRings::Reserving, std::memory_order_relaxed);
+    const uint64_t sequence = mRings.header()->sequence.fetch_add(1, std::memory_order_acq_rel);
+    ring->pending.store(sequence + 1, std::memory_order_relaxed);
+    return sequence;
+}
+
+inline void ShmTransport::lockShared()
+{
+    mSharedLock.lock();
+    auto header = mRings.header();
+    for (uint32_t spins = 1;; ++spins) {
+        uint32_t owner = 0;
+        if (header->sharedOwner.compare_exchange_weak(owner, mPid, std::memory_order_acquire, std::memory_order_relaxed))
+            return;
+        if (owner != 0 && (spins % 4096) == 0 && ShmRings::ownerDead(owner)
+            && header->sharedOwner.compare_exchange_strong(owner, mPid, std::memory_order_acquire, std::memory_order_relaxed)) {
+            takeOver(mRings.ring(0));
+            return;
+        }
+        Waiter::pause();
+    }
+}
+
+inline void ShmTransport::unlockShared()
+{
+    mRings.header()->sharedOwner.store(0, std::memory_order_release);
+    mSharedLock.unlock();
+}
+
+inline void ShmTransport::waitForSpace()
+{
+    // the parser might be sleeping with a full ring if it lost a wakeup
+    const uint64_t one = 1;
+    [[maybe_unused]] const auto w = ::write(mEventFd, &one, sizeof(one));
+    sched_yield();
+}
+
+inline void ShmTransport::wake()
+{
+    auto header = mRings.header();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (header->consumerWaiting.load(std::memory_order_relaxed) != 0
+        && header->consumerWaiting.exchange(0, std::memory_order_relaxed) != 0) {
+        const uint64_t one = 1;
+        [[maybe_unused]] const auto w = ::write(mEventFd, &one, sizeof(one));
+    }
+}
+
+inline void ShmTransport::write(const void* data, uint32_t size)
+{
+    // the sequence of ring 0 needs to be taken under the lock so that the
+    // shared ring stays ordered
+    auto ring = threadRing();
+    const bool shared = ring == mRings.ring(0);
+    if (shared)
+        lockShared();
+    const uint64_t sequence = reserve(ring);
+    while (!mRings.write(ring, sequence, data, size)) {
+        waitForSpace();
+    }
+    ring->pending.store(0, std::memory_order_release);
+    if (shared)
+        unlockShared();
+    wake();
+}
+
+inline bool ShmTransport::tryWrite(const void* data, uint32_t size)
+{
+    // the sequence is only taken once the packet is known to fit, the
+    // parser would otherwise wait for the hole. Only this thread writes to
+    // its ring (or holds the lock for ring 0) so the space can't shrink.
+    auto ring = threadRing();
+    const bool shared = ring == mRings.ring(0);
+    if (shared)
+        lockShared();
+    if (!mRings.hasSpace(ring, size)) {
+        if (shared)
+            unlockShared();
+        return false;
+    }
+    const uint64_t sequence = reserve(ring);
+    mRings.write(ring, sequence, data, size);
+    ring->pending.store(0, std::memory_order_release);
+    if (shared)
+        unlockShared();
+    wake();
+    return true;
+}
@@ -2,6 +2,7 @@
 
 #include "Waiter.h"
 #include <cassert>
+#include <cstdint>
 
 class Spinlock
 {
@@ -21,10 +22,11 @@ inline Spinlock::Spinlock()
 {
 }
 
+template<typename Lock = Spinlock>
 class ScopedSpinlock
 {
 public:
-    ScopedSpinlock(Spinlock& lock, bool dolock = true)
+    ScopedSpinlock(Lock& lock, bool dolock = true)
         : mLock(lock), mLocked(false)
     {
         if (dolock) {
@@ -54,6 +56,88 @@ public:
     }
 
 private:
-    Spinlock& mLock;
+    Lock& mLock;
     bool mLocked;
 };
+
+// Readers share the lock, a writer excludes everyone. A waiting writer
+// keeps new readers out so a steady stream of readers can't starve it.
+class SharedSpinlock
+{
+public:
+    SharedSpinlock() = default;
+
+    void lock();
+    bool try_lock();
+    void unlock() { mState.fetch_and(~WriterBit, std::memory_order_release); }
+
+    void lock_shared();
+    bool try_lock_shared();
+    void unlock_shared() { mState.fetch_sub(1, std::memory_order_release); }
+
+private:
+    enum : uint32_t { WriterBit = 0x80000000u };
+
+    std::atomic<uint32_t> mState { 0 };
+};
+
+inline void SharedSpinlock::lock()
+{
+    // claim the writer bit, then wait for the readers to drain
+    for (;;) {
+        const uint32_t state = mState.fetch_or(WriterBit, std::memory_order_acquire);
+        if (!(state & WriterBit))
+            break;
+        while (mState.load(std::memory_order_relaxed) & WriterBit) {
+            Waiter::pause();
+        }
+    }
+    while (mState.load(std::memory_order_acquire) != WriterBit) {
+        Waiter::pause();
+    }
+}
+
+inline bool SharedSpinlock::try_lock()
+{
+    uint32_t state = 0;
+    return mState.compare_exchange_strong(state, WriterBit, std::memory_order_acquire, std::memory_order_relaxed);
+}
+
+inline void SharedSpinlock::lock_shared()
+{
+    uint32_t state = mState.load(std::memory_order_relaxed);
+    for (;;) {
+        if (state & WriterBit) {
+            Waiter::pause();
+            state = mState.load(std::memory_order_relaxed);
+        } else if (mState.compare_exchange_weak(state, state + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+            break;
+        }
+    }
+}
+
+inline bool SharedSpinlock::try_lock_shared()
+{
+    uint32_t state = mState.load(std::memory_order_relaxed);
+    return !(state & WriterBit)
+        && mState.compare_exchange_strong(state, state + 1, std::memory_order_acquire, std::memory_order_relaxed);
+}
+
+template<typename Lock = SharedSpinlock>
+class ScopedSharedSpinlock
+{
+public:
+    ScopedSharedSpinlock(Lock& lock)
+        : mLock(lock)
+    {
+        mLock.lock_shared();
+    }
+
+    ~ScopedSharedSpinlock()
+    {
+        mLock.unlock_shared();
+    }
+
+private:
+    Lock& mLock;
+};
@@ -1,29 +1,40 @@
 #include "Stack.h"
 #include "Waiter.h"
+#include <common/HookStats.h>
+#include <common/Limits.h>
 
 #include <execinfo.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <mutex>
 #include <dlfcn.h>
 #include <sched.h>
+#include <pthread.h>
 #include <cassert>
+#include <climits>
 
 #include <asan_unwind.h>
 
+extern "C" void* __libc_stack_end;
+
 bool Stack::sNoMmap = false;
+bool Stack::sFastUnwind = false;
+HookStats* Stack::sHookStats = nullptr;
 
 namespace {
 struct SigData {
     std::array<uintptr_t, Stack::MaxFrames> stack;
     size_t stackSize = 0;
+    size_t maxFrames = Stack::MaxFrames;
 
     std::atomic<uint32_t> ptid = 0;
     std::atomic<bool> handled = false;
@@ -49,61 +60,556 @@ void handler(int /*sig*/)
 {
     auto sigData = findSigData(syscall(SYS_gettid));
 
-    asan_unwind::StackTrace st(sigData->stack.data(), Stack::MaxFrames);
+    asan_unwind::StackTrace st(sigData->stack.data(), sigData->maxFrames);
     sigData->stackSize = st.unwindSlow(0);
 
     Waiter wl(sigData->handled);
     wl.notify();
 }
+
+// Frame pointer unwinding. Walking the rbp chain is an order of magnitude
+// cheaper than the eh_frame based unwinder but only gives the right answer if
+// every function on the stack keeps the chain intact. Each module starts out
+// as Unknown, while a stack goes through an Unknown module both unwinders run
+// and the results are compared. A module becomes Trusted after VerifyCount
+// matches and Untrusted as soon as a walk through it goes wrong, stacks going
+// through an Untrusted module always use the slow unwinder.
+enum class Trust : uint8_t { Unknown, Trusted, Untrusted };
+
+struct ModuleRange {
+    std::atomic<uintptr_t> start;
+    std::atomic<uintptr_t> end;
+    std::atomic<Trust> trust;
+    std::atomic<uint32_t> verified;
+};
+
+enum {
+    MaxModuleRanges = 4096,
+    VerifyCount = 32,
+    // frames below main/start_thread come from libc which is usually built
+    // without frame pointers, losing those is fine
+    MaxTailLoss = 3,
+    NotCalibrated = INT_MIN,
+    FlushInterval = 1024
+};
+
+// this has to be constant initialized, the hooks can add modules before the
+// static initializers of this file have run
+struct Modules {
+    std::array<ModuleRange, MaxModuleRanges> ranges;
+    // indexes into ranges sorted by start, guarded by a seqlock for readers
+    std::array<std::atomic<uint16_t>, MaxModuleRanges> sorted;
+    std::atomic<uint32_t> count;
+    std::atomic<uint32_t> seq;
+    std::mutex mutex;
+
+    // difference between the number of frames the frame pointer walk and
+    // asan_unwind need to skip to end up at the same frame
+    std::atomic<int> skipAdjust = NotCalibrated;
+
+    // bumped whenever a module stops being trusted, cached walks from an
+    // older generation can't be reused
+    std::atomic<uint32_t> trustGeneration;
+};
+constinit static Modules modules;
+
+static inline uint32_t lowerBound(uintptr_t addr, uint32_t count)
+{
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        const uint32_t mid = (lo + hi) / 2;
+        const auto idx = modules.sorted[mid].load(std::memory_order_relaxed);
+        if (modules.ranges[idx].start.load(std::memory_order_relaxed) <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static inline ModuleRange* findModule(uintptr_t addr)
+{
+    for (;;) {
+        const uint32_t seq = modules.seq.load(std::memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        const uint32_t count = modules.count.load(std::memory_order_relaxed);
+        ModuleRange* range = nullptr;
+        const uint32_t pos = lowerBound(addr, count);
+        if (pos > 0) {
+            auto candidate = &modules.ranges[modules.sorted[pos - 1].load(std::memory_order_relaxed)];
+            if (addr < candidate->end.load(std::memory_order_relaxed))
+                range = candidate;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (modules.seq.load(std::memory_order_relaxed) == seq)
+            return range;
+    }
+}
+
+// The main thread's bounds would come from /proc/self/maps by way of
+// pthread_getattr_np, glibc already knows where its stack starts and it can
+// grow down as far as the rlimit lets it. A child forked from another thread
+// keeps that thread's bounds with the rest of its TLS. Returns false if the
+// bounds aren't known.
+static bool threadStackBounds(uintptr_t frame, uintptr_t* start, uintptr_t* end)
+{
+    const auto libcStackEnd = reinterpret_cast<uintptr_t>(__libc_stack_end);
+    if (syscall(SYS_gettid) == getpid() && frame < libcStackEnd) {
+        rlimit limit;
+        *end = libcStackEnd;
+        *start = 0;
+        if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < libcStackEnd)
+            *start = libcStackEnd - limit.rlim_cur;
+        return true;
+    }
+
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+        return false;
+    void* addr = nullptr;
+    size_t size = 0;
+    const bool ok = pthread_attr_getstack(&attr, &addr, &size) == 0 && addr != nullptr;
+    pthread_attr_destroy(&attr);
+    if (!ok)
+        return false;
+    *start = reinterpret_cast<uintptr_t>(addr);
+    *end = *start + size;
+    return true;
+}
+
+struct CacheCounters {
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> framesWalked;
+    std::atomic<uint64_t> framesReused;
+};
+constinit static CacheCounters cacheCounters;
+
+// stack bounds for walks without a cache, the preload always passes one
+thread_local uintptr_t uncachedStackStart = 0;
+thread_local uintptr_t uncachedStackEnd = 0;
+
+struct Walk {
+    std::array<void*, Stack::MaxFrames> ptrs;
+    std::array<uintptr_t, Stack::MaxFrames> records;
+    std::array<uintptr_t, Stack::MaxFrames> links;
+    // frames walked this time, the rest came from the cache
+    size_t walked { 0 };
+    size_t count { 0 };
+    // number of bottom frames of the cache that were reused
+    uint32_t reused { 0 };
+    // stopped at the limit before reaching the root
+    bool truncated { false };
+};
+
+// The same frame address and return address don't mean that the callers are
+// the same too, two callers with the same frame size can both end up calling
+// the same function at the same depth. Comparing the frame records is cheap,
+// it's the module lookups and trust checks for each frame that we want to
+// avoid. The records were read from this thread's stack before so they're
+// safe to read again. Returns the number of cached frames up to and including
+// the topmost one that changed, 0 if none did.
+static uint32_t changedFrames(const Stack::Cache* cache, uint32_t cached)
+{
+    for (uint32_t i = cached; i > 0; --i) {
+        const auto record = reinterpret_cast<const uintptr_t*>(cache->records[i - 1]);
+        if (record[0] != cache->links[i - 1] || record[1] != reinterpret_cast<uintptr_t>(cache->ptrs[i - 1]))
+            return i;
+    }
+    return 0;
+}
+
+// Everything from the first frame up to the end of the stack is mapped, the
+// chain only goes up so it can't leave that range. The first frame is on
+// another stack when running on a sigaltstack or a coroutine's stack, those
+// aren't walked.
+static void walkFramePointers(void* frameAddress, uintptr_t stackStart, uintptr_t stackEnd, Walk& walk, const Stack::Cache* cache, size_t limit)
+{
+    if (reinterpret_cast<uintptr_t>(frameAddress) < stackStart)
+        return;
+
+    uint32_t cached = 0;
+    if (cache != nullptr && cache->generation == modules.trustGeneration.load(std::memory_order_relaxed))
+        cached = cache->count;
+
+    auto frame = reinterpret_cast<uintptr_t>(frameAddress);
+    for (;;) {
+        if (frame > stackEnd - 2 * sizeof(uintptr_t) || (frame & (sizeof(uintptr_t) - 1)))
+            break;
+        const auto record = reinterpret_cast<const uintptr_t*>(frame);
+        const uintptr_t next = record[0];
+        const uintptr_t ret = record[1];
+
+        // cached frames below this one have been popped since
+        while (cached > 0 && cache->records[cached - 1] < frame)
+            --cached;
+        if (cached > 0 && cache->records[cached - 1] == frame) {
+            const uint32_t changed = changedFrames(cache, cached);
+            if (changed == 0) {
+                // all of the cached frames are reused even if only some fit
+                // under the limit, the cache still reaches the root
+                const uint32_t copy = std::min<uint32_t>(cached, limit - walk.count);
+                walk.reused = cached;
+                walk.truncated = copy < cached;
+                for (uint32_t i = 0; i < copy; ++i) {
+                    walk.ptrs[walk.count++] = cache->ptrs[cached - 1 - i];
+                }
+                return;
+            }
+            // different callers further down, only the frames below the
+            // change can still be reused
+            cached = changed - 1;
+        }
+
+        // either the root of the stack or a garbage frame pointer
+        if (ret == 0 || findModule(ret) == nullptr)
+            break;
+        if (walk.count == limit) {
+            walk.truncated = true;
+            break;
+        }
+        walk.records[walk.walked] = frame;
+        walk.links[walk.walked] = next;
+        walk.ptrs[walk.walked] = reinterpret_cast<void*>(ret);
+        walk.count = ++walk.walked;
+        // the stack grows down so the chain has to go up
+        if (next <= frame)
+            break;
+        frame = next;
+    }
+}
+
+static void updateCache(Stack::Cache* cache, const Walk& walk, bool trusted)
+{
+    if (!trusted || (walk.truncated && walk.reused == 0) || walk.reused + walk.walked > Stack::MaxFrames) {
+        // only fully trusted walks all the way to the root can be reused
+        // without checking them again
+        cache->count = 0;
+    } else {
+        // the new frames go on top of the part of the cache that was reused
+        for (size_t i = 0; i < walk.walked; ++i) {
+            const size_t idx = walk.reused + walk.walked - 1 - i;
+            cache->records[idx] = walk.records[i];
+            cache->links[idx] = walk.links[i];
+            cache->ptrs[idx] = walk.ptrs[i];
+        }
+        cache->count = walk.reused + walk.walked;
+        cache->generation = modules.trustGeneration.load(std::memory_order_relaxed);
+    }
+
+    if (walk.reused > 0) {
+        ++cache->hits;
+    } else {
+        ++cache->misses;
+    }
+    cache->framesWalked += walk.walked;
+    cache->framesReused += walk.reused;
+    if (++cache->unwinds == FlushInterval) {
+        cacheCounters.hits.fetch_add(cache->hits, std::memory_order_relaxed);
+        cacheCounters.misses.fetch_add(cache->misses, std::memory_order_relaxed);
+        cacheCounters.framesWalked.fetch_add(cache->framesWalked, std::memory_order_relaxed);
+        cacheCounters.framesReused.fetch_add(cache->framesReused, std::memory_order_relaxed);
+        cache->unwinds = 0;
+        cache->hits = cache->misses = cache->framesWalked = cache->framesReused = 0;
+    }
+}
+
+enum class FastResult { Use, Verify, Slow };
+
+static FastResult classify(const Walk& walk, unsigned skip)
+{
+    const size_t count = walk.count;
+    const int adjust = modules.skipAdjust.load(std::memory_order_relaxed);
+    if (adjust == NotCalibrated)
+        return count > 0 ? FastResult::Verify : FastResult::Slow;
+    if (static_cast<int>(skip) + adjust < 0 || skip + adjust >= count)
+        return FastResult::Slow;
+
+    // the walk continues from every frame but the last, so those are the
+    // ones that need to be trusted. Frames from the cache were trusted when
+    // they got cached and the generation check makes sure they still are.
+    const size_t check = walk.reused > 0 ? walk.walked : count - 1;
+    bool unknown = false;
+    for (size_t i = 0; i < check; ++i) {
+        auto module = findModule(reinterpret_cast<uintptr_t>(walk.ptrs[i]));
+        if (module == nullptr)
+            return FastResult::Slow;
+        switch (module->trust.load(std::memory_order_relaxed)) {
+        case Trust::Trusted:
+            break;
+        case Trust::Unknown:
+            unknown = true;
+            break;
+        case Trust::Untrusted:
+            return FastResult::Slow;
+        }
+    }
+    return unknown ? FastResult::Verify : FastResult::Use;
+}
+
+static void markUntrusted(void* ip)
+{
+    if (auto module = findModule(reinterpret_cast<uintptr_t>(ip))) {
+        module->trust.store(Trust::Untrusted, std::memory_order_relaxed);
+        modules.trustGeneration.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+static void verify(void* const* fast, size_t fastCount, void* const* slow, size_t slowCount, unsigned skip)
+{
+    if (slowCount == 0)
+        return;
+
+    size_t start = 0;
+    while (start < fastCount && fast[start] != slow[0])
+        ++start;
+    if (start == fastCount)
+        return;
+
+    const int adjust = static_cast<int>(start) - static_cast<int>(skip);
+    int expected = NotCalibrated;
+    if (!modules.skipAdjust.compare_exchange_strong(expected, adjust, std::memory_order_relaxed) && expected != adjust) {
+        // recursion can make the first frame show up more than once, don't
+        // draw any conclusions from this one
+        return;
+    }
+
+    const size_t count = std::min(fastCount - start, slowCount);
+    size_t matched = 0;
+    while (matched < count && fast[start + matched] == slow[matched])
+        ++matched;
+
+    if (matched < count) {
+        // the function returning to slow[matched - 1] didn't keep the chain
+        if (matched > 0)
+            markUntrusted(slow[matched - 1]);
+        return;
+    }
+    if (slowCount - count > MaxTailLoss) {
+        markUntrusted(slow[count - 1]);
+        return;
+    }
+
+    for (size_t i = 0; i + 1 < start + count; ++i) {
+        auto module = findModule(reinterpret_cast<uintptr_t>(fast[i]));
+        if (module != nullptr
+            && module->trust.load(std::memory_order_relaxed) == Trust::Unknown
+            && module->verified.fetch_add(1, std::memory_order_relaxed) + 1 >= VerifyCount) {
+            Trust unknown = Trust::Unknown;
+            module->trust.compare_exchange_strong(unknown, Trust::Trusted, std::memory_order_relaxed);
+        }
+    }
+}
 } // anonymous namespace
 
-Stack::Stack(unsigned skip, unsigned ptid)
+void Stack::addModule(uintptr_t start, uintptr_t end)
+{
+    std::lock_guard<std::mutex> lock(modules.mutex);
+
+    const uint32_t count = modules.count.load(std::memory_order_relaxed);
+    const uint32_t pos = lowerBound(start, count);
+    if (pos > 0) {
+        auto& existing = modules.ranges[modules.sorted[pos - 1].load(std::memory_order_relaxed)];
+        if (existing.start.load(std::memory_order_relaxed) == start) {
+            if (existing.end.load(std::memory_order_relaxed) != end) {
+                // something else got loaded at the same address
+                modules.seq.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                existing.end.store(end, std::memory_order_relaxed);
+                existing.trust.store(Trust::Unknown, std::memory_order_relaxed);
+                existing.verified.store(0, std::memory_order_relaxed);
+                modules.seq.fetch_add(1, std::memory_order_release);
+                modules.trustGeneration.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+    }
+    if (count == MaxModuleRanges)
+        return;
+
+    auto& range = modules.ranges[count];
+    range.start.store(start, std::memory_order_relaxed);
+    range.end.store(end, std::memory_order_relaxed);
+    range.trust.store(Trust::Unknown, std::memory_order_relaxed);
+    range.verified.store(0, std::memory_order_relaxed);
+
+    modules.seq.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (uint32_t i = count; i > pos; --i) {
+        modules.sorted[i].store(modules.sorted[i - 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    modules.sorted[pos].store(static_cast<uint16_t>(count), std::memory_order_relaxed);
+    modules.count.store(count + 1, std::memory_order_relaxed);
+    modules.seq.fetch_add(1, std::memory_order_release);
+}
+
+void Stack::removeModules(uintptr_t start, uintptr_t end)
+{
+    std::lock_guard<std::mutex> lock(modules.mutex);
+
+    // the slots stay where they are with an empty range, addModule picks
+    // them up again if something gets loaded at the same address
+    const uint32_t count = modules.count.load(std::memory_order_relaxed);
+    bool removed = false;
+    uint32_t pos = lowerBound(start, count);
+    while (pos > 0 && modules.ranges[modules.sorted[pos - 1].load(std::memory_order_relaxed)].start.load(std::memory_order_relaxed) >= start)
+        --pos;
+    for (; pos < count; ++pos) {
+        auto& range = modules.ranges[modules.sorted[pos].load(std::memory_order_relaxed)];
+        const uintptr_t rangeStart = range.start.load(std::memory_order_relaxed);
+        if (rangeStart >= end)
+            break;
+        if (!removed) {
+            modules.seq.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            removed = true;
+        }
+        range.end.store(rangeStart, std::memory_order_relaxed);
+        range.trust.store(Trust::Unknown, std::memory_order_relaxed);
+        range.verified.store(0, std::memory_order_relaxed);
+    }
+    if (removed) {
+        modules.seq.fetch_add(1, std::memory_order_release);
+        modules.trustGeneration.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+Stack::CacheStats Stack::cacheStats()
+{
+    return {
+        cacheCounters.hits.load(std::memory_order_relaxed),
+        cacheCounters.misses.load(std::memory_order_relaxed),
+        cacheCounters.framesWalked.load(std::memory_order_relaxed),
+        cacheCounters.framesReused.load(std::memory_order_relaxed)
+    };
+}
+
+Stack::Stack(unsigned skip, unsigned depth, unsigned ptid)
 {
     // dl_iterate_phdr(dl_iterate_phdr_callback, nullptr);
 
+    const uint64_t start = sHookStats != nullptr ? HookStats::now() : 0;
+    depth = std::min<unsigned>(depth, MaxDepth);
     if (ptid == 0) {
-        //mCount = unw_backtrace(mPtrs.data(), MaxFrames);
-        asan_unwind::StackTrace st(mPtrs.data(), MaxFrames);
-        mCount = st.unwindSlow(skip);
-    } else if (sNoMmap) {
-        mCount = 0;
+        unwind(skip + 1, depth, nullptr);
     } else {
-        mCount = 1;
-        if (!sigDatas.siginstalled.test_and_set()) {
-            struct sigaction sa;
-            sa.sa_flags = SA_SIGINFO;
-            sigemptyset(&sa.sa_mask);
-            sa.sa_handler = handler;
-            sigaction(SIGUSR1, &sa, nullptr);
-        }
+        unwindRemote(skip, depth, ptid);
+    }
+    if (sHookStats != nullptr) {
+        sHookStats->add(HookStats::Unwinds, 1);
+        sHookStats->addTime(HookStats::UnwindNs, start);
+    }
+}
 
-        uint32_t expected = 0;
-        SigData* sigData = nullptr;
-        while (sigData == nullptr) {
-            for (auto& candidate : sigDatas.datas) {
-                if (candidate.ptid.load(std::memory_order_acquire) == expected
-                    && std::atomic_compare_exchange_weak_explicit(&candidate.ptid, &expected, ptid,
-                                                                  std::memory_order_release,
-                                                                  std::memory_order_relaxed)) {
-                    sigData = &candidate;
-                    break;
-                }
-            }
-            if (sigData == nullptr)
-                sched_yield();
+Stack::Stack(unsigned skip, unsigned depth, Cache* cache)
+{
+    const uint64_t start = sHookStats != nullptr ? HookStats::now() : 0;
+    unwind(skip + 1, std::min<unsigned>(depth, MaxDepth), cache);
+    if (sHookStats != nullptr) {
+        sHookStats->add(HookStats::Unwinds, 1);
+        sHookStats->addTime(HookStats::UnwindNs, start);
+    }
+}
+
+__attribute__((noinline)) void Stack::unwind(unsigned skip, unsigned depth, Cache* cache)
+{
+    Walk walk;
+    FastResult result = FastResult::Slow;
+    if (sFastUnwind) {
+        // once the skip is calibrated the walk can stop depth frames past
+        // the skipped ones, before that it has to see everything
+        size_t limit = MaxDepth;
+        const int adjust = modules.skipAdjust.load(std::memory_order_relaxed);
+        if (adjust != NotCalibrated && static_cast<int>(skip) + adjust >= 0)
+            limit = std::min<size_t>(limit, skip + adjust + depth);
+        void* frame = __builtin_frame_address(0);
+        uintptr_t& stackStart = cache != nullptr ? cache->stackStart : uncachedStackStart;
+        uintptr_t& stackEnd = cache != nullptr ? cache->stackEnd : uncachedStackEnd;
+        if (stackEnd == 0)
+            threadStackBounds(reinterpret_cast<uintptr_t>(frame), &stackStart, &stackEnd);
+        if (stackEnd != 0)
+            walkFramePointers(frame, stackStart, stackEnd, walk, cache, limit);
+        result = classify(walk, skip);
+        if (cache != nullptr)
+            updateCache(cache, walk, result == FastResult::Use);
+        if (result == FastResult::Use) {
+            const size_t first = skip + modules.skipAdjust.load(std::memory_order_relaxed);
+            mCount = walk.count - first;
+            memcpy(mPtrs.data(), walk.ptrs.data() + first, mCount * sizeof(void*));
+            truncate(depth, walk.truncated);
+            return;
         }
+    }
+
+    //mCount = unw_backtrace(mPtrs.data(), MaxFrames);
+    asan_unwind::StackTrace st(mPtrs.data(), std::min<size_t>(MaxDepth, skip + depth + 1));
+    mCount = st.unwindSlow(skip);
 
-        syscall(SYS_tkill, ptid, SIGUSR1);
+    // a cut off walk can't be compared with the slow one
+    if (result == FastResult::Verify && !walk.truncated)
+        verify(walk.ptrs.data(), walk.count, mPtrs.data(), mCount, skip);
+    truncate(depth, mCount == MaxDepth);
+}
+
+void Stack::truncate(unsigned depth, bool truncated)
+{
+    if (mCount > depth) {
+        mCount = depth;
+        truncated = true;
+    }
+    if (truncated)
+        mPtrs[mCount++] = reinterpret_cast<void*>(static_cast<uintptr_t>(Limits::TruncatedFrame));
+}
+
+void Stack::unwindRemote(unsigned skip, unsigned depth, unsigned ptid)
+{
+    if (sNoMmap) {
+        mCount = 0;
+        return;
+    }
 
-        Waiter wl(sigData->handled);
-        wl.wait();
+    mCount = 1;
+    if (!sigDatas.siginstalled.test_and_set()) {
+        struct sigaction sa;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_handler = handler;
+        sigaction(SIGUSR1, &sa, nullptr);
+    }
 
-        if (sigData->stackSize > 0) {
-            static_assert(sizeof(uintptr_t) == sizeof(void*));
-            memcpy(mPtrs.data(), static_cast<uintptr_t*>(sigData->stack.data()) + skip, (sigData->stackSize - skip) * sizeof(uintptr_t));
+    uint32_t expected = 0;
+    SigData* sigData = nullptr;
+    while (sigData == nullptr) {
+        for (auto& candidate : sigDatas.datas) {
+            if (candidate.ptid.load(std::memory_order_acquire) == expected
+                && std::atomic_compare_exchange_weak_explicit(&candidate.ptid, &expected, ptid,
+                                                              std::memory_order_release,
+                                                              std::memory_order_relaxed)) {
+                sigData = &candidate;
+                break;
+            }
         }
-        mCount = sigData->stackSize;
+        if (sigData == nullptr)
+            sched_yield();
+    }
 
-        sigData->ptid.store(0, std::memory_order_release);
+    sigData->maxFrames = std::min<size_t>(MaxDepth, skip + depth + 1);
+    syscall(SYS_tkill, ptid, SIGUSR1);
+
+    Waiter wl(sigData->handled);
+    wl.wait();
+
+    mCount = sigData->stackSize > skip ? sigData->stackSize - skip : 0;
+    if (mCount > 0) {
+        static_assert(sizeof(uintptr_t) == sizeof(void*));
+        memcpy(mPtrs.data(), static_cast<uintptr_t*>(sigData->stack.data()) + skip, mCount * sizeof(uintptr_t));
     }
+    const bool full = sigData->stackSize == MaxDepth;
+
+    sigData->ptid.store(0, std::memory_order_release);
+    truncate(depth, full);
 }
@@ -4,25 +4,79 @@
 #include <array>
 #include <sys/ucontext.h>
 
+struct HookStats;
+
 class Stack
 {
 public:
-    enum { MaxFrames = 255 };
+    // one frame is kept for Limits::TruncatedFrame
+    enum { MaxFrames = 255, MaxDepth = MaxFrames - 1 };
+
+    // Per thread copy of the last frame pointer walk, bottom frame first.
+    // When the next walk reaches a frame record that still holds the same
+    // return address and saved frame pointer as last time the rest of the
+    // chain is taken from here instead of being walked again.
+    struct Cache
+    {
+        std::array<uintptr_t, MaxFrames> records;
+        std::array<uintptr_t, MaxFrames> links;
+        std::array<void*, MaxFrames> ptrs;
+        uint32_t count { 0 };
+        uint32_t generation { 0 };
+        // bounds of this thread's stack, looked up by the first walk
+        uintptr_t stackStart { 0 };
+        uintptr_t stackEnd { 0 };
+
+        // flushed into the global counters every FlushInterval unwinds
+        uint32_t unwinds { 0 };
+        uint64_t hits { 0 };
+        uint64_t misses { 0 };
+        uint64_t framesWalked { 0 };
+        uint64_t framesReused { 0 };
+    };
+
+    struct CacheStats
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t framesWalked;
+        uint64_t framesReused;
+    };
 
-    Stack(unsigned skip, unsigned ptid = 0);
+    // at most depth frames, if there are more the ones towards the root
+    // are replaced by Limits::TruncatedFrame
+    Stack(unsigned skip, unsigned depth, unsigned ptid = 0);
+    Stack(unsigned skip, unsigned depth, Cache* cache);
 
     void* const* ptrs() const { return mPtrs.data(); }
     const void* data() const { return mPtrs.data(); }
     uint32_t size() const { return mCount * sizeof(void*); }
 
     static void setNoMmap() { sNoMmap = true; }
+    static void setFastUnwind(bool enabled) { sFastUnwind = enabled; }
+    // MTRACK_STATS, counts the unwinds and the time they take
+    static void setHookStats(HookStats* stats) { sHookStats = stats; }
+
+    // executable ranges of the loaded modules, used to decide whether the
+    // frame pointer chain through a module can be trusted
+    static void addModule(uintptr_t start, uintptr_t end);
+    // forgets the ranges inside start..end after a module was unloaded
+    static void removeModules(uintptr_t start, uintptr_t end);
+
+    static CacheStats cacheStats();
 
 private:
     Stack(const Stack &) = delete;
     Stack &operator=(const Stack &) = delete;
 
+    void unwind(unsigned skip, unsigned depth, Cache* cache);
+    void unwindRemote(unsigned skip, unsigned depth, unsigned ptid);
+    void truncate(unsigned depth, bool truncated);
+
     uint32_t mCount { 0 };
     std::array<void *, MaxFrames> mPtrs;
 
     static bool sNoMmap;
+    static bool sFastUnwind;
+    static HookStats* sHookStats;
 };
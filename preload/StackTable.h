@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <sched.h>
+#include <utility>
+
+// Lock free table mapping unwound stacks to small ids so that records only
+// need to carry the id. Stacks are keyed by two independent 64 bit hashes of
+// their frames. The storage is handed in by the caller and has to be zero
+// filled (a fresh anonymous mapping).
+class StackTable
+{
+public:
+    StackTable(void* mem, size_t capacity);
+
+    static size_t mappingSize(size_t capacity);
+
+    // Returns the id of the stack, calling define(id) first if the stack
+    // hasn't been seen before. Other threads don't get to see the id until
+    // define has returned, so no record can refer to a stack that hasn't
+    // been sent yet. Empty stacks are always id 0.
+    template<typename Func>
+    uint32_t index(const void* frames, uint32_t size, Func&& define);
+
+    uint32_t count() const { return mNextId.load(std::memory_order_relaxed) - 1; }
+
+    // Around a fork. A child mustn't inherit an entry that's claimed but
+    // doesn't have its id yet, nothing would ever set it, and the parser
+    // copies the parent at the Fork record so the definition has to be
+    // sent before it. beginFork waits for the stacks being defined and
+    // holds off new ones until endFork.
+    void beginFork();
+    void endFork();
+
+private:
+    static std::pair<uint64_t, uint64_t> hash(const void* frames, uint32_t size);
+
+    struct Entry
+    {
+        std::atomic<uint64_t> hash;
+        std::atomic<uint64_t> check;
+        std::atomic<uint32_t> id;
+    };
+
+    enum { MaxProbes = 64 };
+
+    Entry* mEntries { nullptr };
+    size_t mMask { 0 };
+    std::atomic<uint32_t> mNextId { 1 };
+    std::atomic<uint32_t> mDefining { 0 };
+    std::atomic<bool> mForking { false };
+};
+
+inline StackTable::StackTable(void* mem, size_t capacity)
+    : mEntries(static_cast<Entry*>(mem)), mMask(capacity - 1)
+{
+}
+
+inline size_t StackTable::mappingSize(size_t capacity)
+{
+    return capacity * sizeof(Entry);
+}
+
+inline std::pair<uint64_t, uint64_t> StackTable::hash(const void* frames, uint32_t size)
+{
+    const auto ptrs = static_cast<const uintptr_t*>(frames);
+    const size_t count = size / sizeof(uintptr_t);
+    uint64_t h1 = 0xcbf29ce484222325ull;
+    uint64_t h2 = count;
+    for (size_t i = 0; i < count; ++i) {
+        const uint64_t p = static_cast<uint64_t>(ptrs[i]);
+        h1 = (h1 ^ p) * 0x100000001b3ull;
+        h2 = (h2 + p) * 0x9E3779B97F4A7C15ull;
+        h2 ^= h2 >> 29;
+    }
+    // 0 marks an empty entry
+    return std::make_pair(h1 ? h1 : 1, h2);
+}
+
+inline void StackTable::beginFork()
+{
+    mForking.store(true);
+    while (mDefining.load() != 0) {
+        sched_yield();
+    }
+}
+
+inline void StackTable::endFork()
+{
+    mForking.store(false);
+}
+
+template<typename Func>
+inline uint32_t StackTable::index(const void* frames, uint32_t size, Func&& define)
+{
+    if (size == 0)
+        return 0;
+
+    const auto [ h1, h2 ] = hash(frames, size);
+    const size_t start = static_cast<size_t>(h1 ^ (h1 >> 32));
+    for (size_t i = 0; i < MaxProbes; ++i) {
+        auto& entry = mEntries[(start + i) & mMask];
+        uint64_t cur = entry.hash.load(std::memory_order_acquire);
+        if (cur == 0) {
+            // seq_cst against beginFork, either it sees us or we see it
+            while (mDefining.fetch_add(1), mForking.load()) {
+                mDefining.fetch_sub(1);
+                while (mForking.load(std::memory_order_relaxed)) {
+                    sched_yield();
+                }
+            }
+            if (entry.hash.compare_exchange_strong(cur, h1, std::memory_order_acq_rel)) {
+                entry.check.store(h2, std::memory_order_relaxed);
+                const uint32_t id = mNextId.fetch_add(1, std::memory_order_relaxed);
+                define(id);
+                entry.id.store(id, std::memory_order_release);
+                mDefining.fetch_sub(1, std::memory_order_release);
+                return id;
+            }
+            mDefining.fetch_sub(1, std::memory_order_release);
+            // someone else claimed the entry, cur is now their hash
+        }
+        if (cur == h1) {
+            uint32_t id;
+            while ((id = entry.id.load(std::memory_order_acquire)) == 0) {
+                sched_yield();
+            }
+            if (entry.check.load(std::memory_order_relaxed) == h2) {
+                return id;
+            }
+        }
+    }
+
+    // table is full, fall back to sending the stack every time
+    const uint32_t id = mNextId.fetch_add(1, std::memory_order_relaxed);
+    define(id);
+    return id;
+}
@@ -17,13 +17,18 @@ public:
                 break;
             }
             while (mLock.load(std::memory_order_relaxed) == false) {
+                pause();
+            }
+        }
+    }
+
+    static void pause()
+    {
 #if defined(__arm__) || defined(__aarch64__)
-                asm volatile("yield");
+        asm volatile("yield");
 #else
-                __builtin_ia32_pause();
+        __builtin_ia32_pause();
 #endif
-            }
-        }
     }
 
     void notify() {
@@ -0,0 +1,55 @@
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+// Measures the cost of malloc/free pairs, run it with and without the preload
+// (LD_PRELOAD=libmtrack_preload.so) to see the overhead of the hooks. With
+// MTRACK_SAMPLE_RATE set high almost nothing gets reported so what's left is
+// the cost of the hook prologue itself.
+//
+// malloc_benchmark [iterations per thread] [threads] [size]
+
+static double run(unsigned iterations, size_t size)
+{
+    void* ptrs[16];
+    const auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < iterations; i += 16) {
+        for (auto& ptr : ptrs) {
+            ptr = malloc(size);
+            // keep the compiler from pairing up malloc and free
+            asm volatile("" : : "r"(ptr) : "memory");
+        }
+        for (auto ptr : ptrs) {
+            free(ptr);
+        }
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+int main(int argc, char** argv)
+{
+    const unsigned iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+    const unsigned numThreads = argc > 2 ? atoi(argv[2]) : 1;
+    const size_t size = argc > 3 ? atoi(argv[3]) : 32;
+
+    std::vector<double> results(numThreads);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&results, t, iterations, size]() {
+            results[t] = run(iterations, size);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    double total = 0;
+    for (double result : results) {
+        total += result;
+    }
+    printf("%u threads, %zu bytes: %.1f ns per malloc/free pair\n", numThreads, size, total / numThreads);
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <thread>
+#include <vector>
+
+// Measures page fault throughput, every thread maps its own anonymous
+// memory and touches each page of it once. Run it with the preload
+// (LD_PRELOAD=libmtrack_preload.so) and different MTRACK_FAULT_THREADS to
+// see how handling the faults scales, and without it for what the kernel
+// does on its own.
+//
+// mmap_benchmark [pages per thread] [max threads]
+//
+// The thread count doubles from 1 up to max threads.
+
+static void touch(size_t pages)
+{
+    const size_t size = pages * 4096;
+    auto mem = static_cast<char*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        abort();
+    }
+    for (size_t p = 0; p < pages; ++p) {
+        mem[p * 4096] = 1;
+    }
+    munmap(mem, size);
+}
+
+int main(int argc, char** argv)
+{
+    const size_t pages = argc > 1 ? atoi(argv[1]) : 16384;
+    const unsigned maxThreads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+
+    for (unsigned numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+        std::vector<std::thread> threads;
+        const auto start = std::chrono::steady_clock::now();
+        for (unsigned t = 0; t < numThreads; ++t) {
+            threads.emplace_back(touch, pages);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const double seconds = std::chrono::duration<double>(elapsed).count();
+        printf("%u threads, %zu pages each: %.0f faults/sec\n", numThreads, pages, (pages * numThreads) / seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include "VectorMmapTracker.h"
+#include <common/MmapTracker.h>
+
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+// Runs the same mmap/mprotect/munmap sequence through the map based
+// MmapTracker and the old sorted vector one at a few mapping counts and
+// checks that they end up with the same mappings.
+//
+// mmaptracker_benchmark [operations]
+
+enum { PageSize = 4096 };
+
+struct Op
+{
+    enum Type { Mmap, Mprotect, Munmap, Madvise } type;
+    uintptr_t addr;
+    size_t size;
+    int32_t prot;
+};
+
+static std::vector<Op> generate(unsigned mappings, unsigned operations)
+{
+    std::mt19937_64 rng(mappings);
+    std::vector<Op> ops;
+    ops.reserve(mappings + operations);
+
+    // leave a gap after every mapping so they don't merge into one range
+    std::vector<std::pair<uintptr_t, size_t>> ranges;
+    uintptr_t addr = 0x10000000;
+    for (unsigned i = 0; i < mappings; ++i) {
+        const size_t size = (1 + rng() % 16) * PageSize;
+        ranges.push_back(std::make_pair(addr, size));
+        ops.push_back({ Op::Mmap, addr, size, PROT_READ | PROT_WRITE });
+        addr += size + PageSize;
+    }
+
+    for (unsigned i = 0; i < operations; ++i) {
+        const auto& range = ranges[rng() % ranges.size()];
+        const size_t pages = range.second / PageSize;
+        const uintptr_t start = range.first + (rng() % pages) * PageSize;
+        const size_t size = (1 + rng() % (pages - (start - range.first) / PageSize)) * PageSize;
+        switch (rng() % 4) {
+        case 0:
+            ops.push_back({ Op::Mmap, start, size, static_cast<int32_t>(rng() % 2 ? PROT_READ : PROT_READ | PROT_WRITE) });
+            break;
+        case 1:
+            ops.push_back({ Op::Mprotect, start, size, static_cast<int32_t>(rng() % 2 ? PROT_READ : PROT_NONE) });
+            break;
+        case 2:
+            ops.push_back({ Op::Munmap, start, size, 0 });
+            break;
+        case 3:
+            ops.push_back({ Op::Madvise, start, size, 0 });
+            break;
+        }
+    }
+    return ops;
+}
+
+template<typename Tracker>
+static double run(Tracker& tracker, const std::vector<Op>& ops)
+{
+    const auto start = std::chrono::steady_clock::now();
+    for (const auto& op : ops) {
+        switch (op.type) {
+        case Op::Mmap:
+            tracker.mmap(op.addr, op.size, op.prot, MAP_PRIVATE | MAP_ANONYMOUS, 0);
+            break;
+        case Op::Mprotect:
+            tracker.mprotect(op.addr, op.size, op.prot);
+            break;
+        case Op::Munmap:
+            tracker.munmap(op.addr, op.size);
+            break;
+        case Op::Madvise:
+            tracker.madvise(op.addr, op.size);
+            break;
+        }
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+template<typename Tracker>
+static std::vector<VectorMmapTracker::Mmap> contents(const Tracker& tracker)
+{
+    std::vector<VectorMmapTracker::Mmap> ret;
+    tracker.forEach([&ret](uintptr_t start, uintptr_t end, int32_t prot, int32_t flags, int32_t stack) {
+        ret.push_back({ start, end, prot, flags, stack });
+    });
+    return ret;
+}
+
+int main(int argc, char** argv)
+{
+    const unsigned operations = argc > 1 ? atoi(argv[1]) : 100000;
+
+    bool ok = true;
+    for (unsigned mappings : { 1000, 10000, 100000 }) {
+        const auto ops = generate(mappings, operations);
+
+        VectorMmapTracker vectorTracker;
+        MmapTracker mapTracker;
+        const double vectorTime = run(vectorTracker, ops);
+        const double mapTime = run(mapTracker, ops);
+
+        const auto vectorContents = contents(vectorTracker);
+        const auto mapContents = contents(mapTracker);
+        bool same = vectorContents.size() == mapContents.size();
+        for (size_t i = 0; same && i < vectorContents.size(); ++i) {
+            const auto& a = vectorContents[i];
+            const auto& b = mapContents[i];
+            same = a.start == b.start && a.end == b.end && a.prot == b.prot && a.flags == b.flags && a.stack == b.stack;
+        }
+        ok = ok && same;
+
+        printf("%6u mappings, %zu operations: vector %8.1fms map %8.1fms, %zu mappings at the end%s\n",
+               mappings, ops.size(), vectorTime, mapTime, mapTracker.size(), same ? "" : " MISMATCH");
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+#include <Stack.h>
+
+#include <chrono>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Compares the cost of the frame pointer walk against asan_unwind at a few
+// stack depths. Run with no arguments, or pass the number of iterations.
+
+static int addModules(struct dl_phdr_info* info, size_t /*size*/, void* /*data*/)
+{
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const auto& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X)) {
+            Stack::addModule(info->dlpi_addr + phdr.p_vaddr, info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz);
+        }
+    }
+    return 0;
+}
+
+static uint32_t frames;
+static Stack::Cache cache;
+
+__attribute__((noinline)) static double unwind(unsigned depth, unsigned iterations, bool cached)
+{
+    if (depth > 0) {
+        const double ret = unwind(depth - 1, iterations, cached);
+        // keep the recursion from being turned into a loop
+        asm volatile("" ::: "memory");
+        return ret;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    if (cached) {
+        for (unsigned i = 0; i < iterations; ++i) {
+            Stack stack(1, Stack::MaxDepth, &cache);
+            frames = stack.size() / sizeof(void*);
+        }
+    } else {
+        for (unsigned i = 0; i < iterations; ++i) {
+            Stack stack(1, Stack::MaxDepth);
+            frames = stack.size() / sizeof(void*);
+        }
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+int main(int argc, char** argv)
+{
+    const unsigned iterations = argc > 1 ? atoi(argv[1]) : 100000;
+
+    dl_iterate_phdr(addModules, nullptr);
+
+    printf("%8s %11s %14s %14s %14s %8s\n", "depth", "frames s/f", "slow ns", "fast ns", "cached ns", "speedup");
+    for (unsigned depth : { 8, 32, 128 }) {
+        Stack::setFastUnwind(false);
+        const double slow = unwind(depth, iterations, false);
+        const uint32_t slowFrames = frames;
+
+        Stack::setFastUnwind(true);
+        // let the modules on the stack get verified before timing
+        unwind(depth, 1000, false);
+        const double fast = unwind(depth, iterations, false);
+        const uint32_t fastFrames = frames;
+        const double cached = unwind(depth, iterations, true);
+
+        // the frame pointer walk usually stops a couple of frames short in
+        // libc's startup code
+        printf("%8u %5u/%-5u %14.1f %14.1f %14.1f %7.1fx\n", depth, slowFrames, fastFrames, slow, fast, cached, slow / cached);
+    }
+
+    const auto stats = Stack::cacheStats();
+    printf("cache hits %llu/%llu, reused %llu of %llu frames\n",
+           static_cast<unsigned long long>(stats.hits),
+           static_cast<unsigned long long>(stats.hits + stats.misses),
+           static_cast<unsigned long long>(stats.framesReused),
+           static_cast<unsigned long long>(stats.framesReused + stats.framesWalked));
+    return 0;
+}
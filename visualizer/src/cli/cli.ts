@@ -73,6 +73,12 @@ async function readData(): Uint8Array | undefined {
 
     console.log(`peaked at ${(peak[0] / mb).toFixed(2)}MB, pf ${(peak[1] / mb).toFixed(2)}MB, malloc ${(peak[2] / mb).toFixed(2)}MB`);
 
+    if (model.workingSets.length > 0) {
+        const hot = model.workingSets.reduce((prev, cur) => Math.max(prev, cur.hot), 0);
+        const last = model.workingSets[model.workingSets.length - 1];
+        console.log(`working set peaked at ${(hot / mb).toFixed(2)}MB, last ${(last.hot / mb).toFixed(2)}MB hot ${(last.cold / mb).toFixed(2)}MB cold`);
+    }
+
 })().then(() => {
     process.exit(0);
 }).catch(e => {
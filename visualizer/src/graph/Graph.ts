@@ -4,7 +4,7 @@ import { Line, ScaleLinear, axisBottom, axisLeft, easeCubic, extent, line, max,
 import { Model, PageSize } from "../model/Model";
 import { assert } from "../Assert";
 import { format } from "d3-format";
-import { stringifyFrame } from "../model/Frame";
+import { TruncatedIp, stringifyFrame } from "../model/Frame";
 
 type Margin = {
     top: number;
@@ -192,11 +192,13 @@ export class Graph {
             time: number;
             used: number;
             name?: string;
+            approximate?: boolean;
         }
 
         const mdata_t: { time: number, used: number }[] = [];
         const mdata_p: { time: number, used: number }[] = [];
         const mdata_m: { time: number, used: number }[] = [];
+        const mdata_w: { time: number, used: number }[] = [];
         const sdata_t: StackData[] = [];
         this._model.parse();
         for (const memory of this._model.memories) {
@@ -204,8 +206,11 @@ export class Graph {
             mdata_p.push({ time: memory.time, used: memory.pageFault / (1024 * 1024) });
             mdata_m.push({ time: memory.time, used: memory.malloc / (1024 * 1024) });
         }
+        for (const workingSet of this._model.workingSets) {
+            mdata_w.push({ time: workingSet.time, used: workingSet.hot / (1024 * 1024) });
+        }
         for (const snapshot of this._model.snapshots) {
-            sdata_t.push({ time: snapshot.time, used: (snapshot.pageFault + snapshot.malloc) / (1024 * 1024), name: snapshot.name });
+            sdata_t.push({ time: snapshot.time, used: (snapshot.pageFault + snapshot.malloc) / (1024 * 1024), name: snapshot.name, approximate: snapshot.approximate });
         }
         // @ts-ignore there's probably a nice way to do this
         mdata_t.columns = ["time", "used"];
@@ -213,17 +218,19 @@ export class Graph {
         mdata_p.columns = ["time", "used"];
         // @ts-ignore
         mdata_m.columns = ["time", "used"];
+        // @ts-ignore
+        mdata_w.columns = ["time", "used"];
 
         // @ts-ignore
         this._line.x.domain(extent(mdata_t, d => d.time));
         // @ts-ignore
         this._line.y.domain([0, max(mdata_t, d => d.used)]);
 
-        const lineColors = ["steelblue", "red", "green"];
+        const lineColors = ["steelblue", "red", "green", "orange"];
 
         // @ts-ignore
         this._line.svg.selectAll("lines")
-            .data([mdata_t, mdata_m, mdata_p])
+            .data([mdata_t, mdata_m, mdata_p, mdata_w])
             .enter()
             .append("path")
             .attr("fill", "none")
@@ -261,6 +268,10 @@ export class Graph {
                     str += `<br/>(${d.name})`;
                     yoff += 20;
                 }
+                if (d.approximate) {
+                    str += "<br/>(approximate, events were dropped)";
+                    yoff += 20;
+                }
                 const avent = event;
                 setTimeout(() => {
                     toolTip.transition()
@@ -423,11 +434,12 @@ export class Graph {
         const byStack: Map<number, { num: number, size: number }> = new Map();
         for (const pf of snapshot.pageFaults) {
             const bs = byStack.get(pf.stackIdx);
+            const pages = pf.size / PageSize;
             if (bs) {
-                bs.num += 1;
-                bs.size += PageSize;
+                bs.num += pages;
+                bs.size += pf.size;
             } else {
-                byStack.set(pf.stackIdx, { num: 1, size: PageSize });
+                byStack.set(pf.stackIdx, { num: pages, size: pf.size });
             }
         }
         for (const m of snapshot.mallocs) {
@@ -439,6 +451,18 @@ export class Graph {
                 byStack.set(m.stackIdx, { num: 1, size: m.size });
             }
         }
+        for (const c of snapshot.callsites) {
+            if (c.count <= 0) {
+                continue;
+            }
+            const bs = byStack.get(c.stackIdx);
+            if (bs) {
+                bs.num += c.count;
+                bs.size += c.bytes;
+            } else {
+                byStack.set(c.stackIdx, { num: c.count, size: c.bytes });
+            }
+        }
 
         let cur = children;
         for (const [ stackIdx, item ] of byStack) {
@@ -463,7 +487,8 @@ export class Graph {
                 });
                 if (curIdx === -1) {
                     curIdx = cur.length;
-                    cur.push({ name: stringifyFrame(frame, this._model.stackStrings), value: item.size, num: item.num, ip: stackFrame.ip, children: [] });
+                    const name = stackFrame.frame === undefined && stackFrame.ip === TruncatedIp ? "[truncated]" : stringifyFrame(frame, this._model.stackStrings);
+                    cur.push({ name, value: item.size, num: item.num, ip: stackFrame.ip, children: [] });
                 } else {
                     cur[curIdx].value += item.size;
                     cur[curIdx].num += item.num;
@@ -2,6 +2,9 @@ export type SingleFrame = [number, number, number];
 export type FrameWithInlines = [number, number, number, SingleFrame[]];
 export type Frame = SingleFrame | FrameWithInlines;
 
+// the last frame of a stack that the preload cut off at its depth limit
+export const TruncatedIp = 1;
+
 export function stringifyFrame(frame: Frame, stringTable: string[]): string {
     let str: string;
     if (frame[0] === -1) {
@@ -12,7 +12,8 @@ const enum EventType {
     Stack,
     StackAddr,
     StackString,
-    ThreadName
+    ThreadName,
+    WorkingSet
 }
 
 type FrameOrSingleFrame = Frame | SingleFrame;
@@ -30,8 +31,26 @@ export interface Memory {
     malloc: number;
 }
 
+// bytes used in the last interval per call site, from applications running
+// with MTRACK_WORKING_SET
+interface WorkingSetCallsite {
+    stackIdx: number;
+    hot: number;
+    cold: number;
+}
+
+export interface WorkingSet {
+    appid: number;
+    time: number;
+    hot: number;
+    cold: number;
+    callsites: WorkingSetCallsite[];
+}
+
 interface Pagefault {
     place: number;
+    // a multiple of PageSize
+    size: number;
     ptid: number;
     stackIdx: number;
     time: number;
@@ -51,16 +70,28 @@ interface Mmap {
     stackIdx: number;
 }
 
+// live allocations of a call site, from applications running with
+// MTRACK_AGGREGATE
+interface Callsite {
+    bytes: number;
+    count: number;
+    allocations: number;
+    stackIdx: number;
+}
+
 export interface Snapshot {
     appid: number;
     name?: string;
     time: number;
     pageFault: number;
     malloc: number;
+    // the preload dropped events, the numbers are a lower bound
+    approximate: boolean;
 
     pageFaults: Pagefault[];
     mallocs: Malloc[];
     mmaps: Mmap[];
+    callsites: Callsite[];
 }
 
 export const enum CallbackType {
@@ -76,6 +107,7 @@ export class Model {
     private _stackStrings: string[] | undefined;
     private _stacks: Stack[] | undefined;
     private _memories: Memory[] | undefined;
+    private _workingSets: WorkingSet[] | undefined;
     private _snapshots: Snapshot[] | undefined;
     private _parsed: boolean;
 
@@ -132,14 +164,15 @@ export class Model {
         }> = new Map();
         const memories: Memory[] = [];
         const snapshots: Snapshot[] = [];
+        const workingSets: WorkingSet[] = [];
 
         while (this._offset < this._data.byteLength) {
             const et = this._readUint8();
             console.log("got event", et);
             switch (et) {
             case EventType.Start: {
+                // a daemon reuses the ids of applications that are gone
                 const appid = this._readUint8();
-                assert(applications.get(appid) === undefined);
                 applications.set(appid, { threads: new Map(), ipToStacks: new Map(), ipToFrame: new Map() });
                 break; }
             case EventType.Stack: {
@@ -208,7 +241,7 @@ export class Model {
                 }
                 break; }
             case EventType.Memory: {
-                const time = this._readUint32();
+                const time = this._readFloat64();
                 const pageFault = this._readFloat64();
                 const malloc = this._readFloat64();
                 memories.push({ time, pageFault, malloc });
@@ -217,27 +250,30 @@ export class Model {
                 const appid = this._readUint8();
                 const app = applications.get(appid);
                 assert(app !== undefined);
-                const time = this._readUint32();
+                const time = this._readFloat64();
                 const pageFault = this._readFloat64();
                 const malloc = this._readFloat64();
                 memories.push({ time, pageFault, malloc });
+                const approximate = this._readUint8() !== 0;
                 const numPfs = this._readUint32();
                 const numMallocs = this._readUint32();
                 const numMmaps = this._readUint32();
-                const snapshot: Snapshot = { appid, time, pageFault, malloc, pageFaults: [], mallocs: [], mmaps: [] };
+                const numCallsites = this._readUint32();
+                const snapshot: Snapshot = { appid, time, pageFault, malloc, approximate, pageFaults: [], mallocs: [], mmaps: [], callsites: [] };
                 for (let n = 0; n < numPfs; ++n) {
                     const place = this._readFloat64();
+                    const size = this._readFloat64();
                     const ptid = this._readUint32();
                     const stackIdx = this._readInt32();
-                    const time = this._readUint32();
-                    snapshot.pageFaults.push({ place, ptid, stackIdx, time });
+                    const time = this._readFloat64();
+                    snapshot.pageFaults.push({ place, size, ptid, stackIdx, time });
                 }
                 for (let n = 0; n < numMallocs; ++n) {
                     const addr = this._readFloat64();
                     const size = this._readFloat64();
                     const ptid = this._readUint32();
                     const stackIdx = this._readInt32();
-                    const time = this._readUint32();
+                    const time = this._readFloat64();
                     snapshot.mallocs.push({ addr, size, ptid, stackIdx, time });
                 }
                 for (let n = 0; n < numMmaps; ++n) {
@@ -246,12 +282,34 @@ export class Model {
                     const stackIdx = this._readInt32();
                     snapshot.mmaps.push({ start, end, stackIdx });
                 }
+                for (let n = 0; n < numCallsites; ++n) {
+                    const bytes = this._readFloat64();
+                    const count = this._readFloat64();
+                    const allocations = this._readFloat64();
+                    const stackIdx = this._readInt32();
+                    snapshot.callsites.push({ bytes, count, allocations, stackIdx });
+                }
                 snapshots.push(snapshot);
                 break; }
             case EventType.SnapshotName: {
                 const n = this._readString();
                 snapshots[snapshots.length - 1].name = n ? n : undefined;
                 break; }
+            case EventType.WorkingSet: {
+                const appid = this._readUint8();
+                const time = this._readFloat64();
+                const hot = this._readFloat64();
+                const cold = this._readFloat64();
+                const numCallsites = this._readUint32();
+                const workingSet: WorkingSet = { appid, time, hot, cold, callsites: [] };
+                for (let n = 0; n < numCallsites; ++n) {
+                    const stackIdx = this._readInt32();
+                    const hot = this._readFloat64();
+                    const cold = this._readFloat64();
+                    workingSet.callsites.push({ stackIdx, hot, cold });
+                }
+                workingSets.push(workingSet);
+                break; }
             case EventType.ThreadName: {
                 const appid = this._readUint8();
                 const app = applications.get(appid);
@@ -266,6 +324,7 @@ export class Model {
         }
 
         this._snapshots = snapshots;
+        this._workingSets = workingSets;
         this._memories = memories.sort((m1, m2) => {
             return m1.time - m2.time;
         });
@@ -295,6 +354,13 @@ export class Model {
         return this._memories;
     }
 
+    get workingSets(): WorkingSet[] {
+        if (!this._workingSets) {
+            throw new Error("Not parsed");
+        }
+        return this._workingSets;
+    }
+
     get snapshots(): Snapshot[] {
         if (!this._snapshots) {
             throw new Error("Not parsed");
@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <atomic>
 #include <mutex>
+#include <unordered_map>
 
 #include <emscripten/bind.h>
 #include <emscripten/emscripten.h>
@@ -39,6 +40,7 @@ private:
 struct Data {
     uint8_t appId { 2 };
     std::map<std::string, uint64_t> urls;
+    std::unordered_map<std::string, uint32_t> stacks;
 } *data = nullptr;
 
 namespace {
@@ -68,7 +70,7 @@ void Hooks::hook()
 
     {
         HostEmitter emitter;
-        emitter.emit(RecordType::Start, data->appId, ApplicationType::WASM, 0);
+        emitter.emit(RecordType::Start, data->appId, ApplicationType::WASM, TimestampMode::Milliseconds, static_cast<uint64_t>(0), static_cast<uint64_t>(0));
         emitter.emit(RecordType::Executable, data->appId, Emitter::String("http://www.netflix.com"));
     }
     safePrint("Mtrack: hooked\n");
@@ -128,9 +130,20 @@ static void reportMalloc(void* ptr, size_t size)
             stack.setPtr(i, ptr | u->second);
         }
     }
+    uint32_t stackId = 0;
+    if (stack.count() > 0) {
+        auto s = data->stacks.find(std::string(reinterpret_cast<const char*>(stack.data()), stack.size()));
+        if (s == data->stacks.end()) {
+            stackId = static_cast<uint32_t>(data->stacks.size() + 1);
+            data->stacks[std::string(reinterpret_cast<const char*>(stack.data()), stack.size())] = stackId;
+            emitter.emit(RecordType::StackDefinition, data->appId, stackId, stack);
+        } else {
+            stackId = s->second;
+        }
+    }
     emitter.emit(RecordType::Malloc,
                  data->appId, timestamp(), static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr)),
-                 static_cast<uint64_t>(size), static_cast<uint32_t>(gettid()), stack);
+                 static_cast<uint64_t>(size), static_cast<uint32_t>(gettid()), stackId);
     //printf("Malloc %p [%d]\n", ptr, size);
 }
 